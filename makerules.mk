@@ -20,15 +20,64 @@ _LDFLAGS  := \
 	-Wl,-rpath=$(TGTDIR) \
 	-Wl,-rpath=$(ZEROMQ_HOME)/lib
 
-TARGETS := recordertest
+TARGETS := recordertest recorderquery recorderbench recordershm recordercompact \
+	recorderread
 
 recordertest_SRCS := \
 	src/main_recorder.cpp \
 	src/RecorderBase.cpp \
+	src/RecorderShm.cpp \
 	src/RecorderTypes.cpp \
+	src/RecorderCache.cpp \
+	src/RecorderSchema.cpp \
+	src/RecorderMerge.cpp \
+	src/RecorderFormat.cpp \
+	src/RecorderStorage.cpp \
+	src/RecorderTelemetry.cpp \
+	src/RecorderAffinity.cpp \
+	src/RecorderClock.cpp \
+	src/RecorderRules.cpp \
 	src/RecorderSink.cpp
 
 recordertest_USES := zeromq protobuf
-recordertest_LINK := zmq protobuf pthread boost_program_options
+recordertest_LINK := zmq protobuf pthread rt boost_program_options
+
+recorderquery_SRCS := \
+	src/main_query.cpp \
+	src/RecorderTypes.cpp
+
+recorderquery_USES := zeromq
+recorderquery_LINK := zmq boost_program_options
+
+recorderbench_SRCS := \
+	src/main_storagebench.cpp \
+	src/RecorderTypes.cpp \
+	src/RecorderFormat.cpp \
+	src/RecorderStorage.cpp
+
+recorderbench_LINK := boost_program_options
+
+recordershm_SRCS := \
+	src/main_shm.cpp \
+	src/RecorderShm.cpp \
+	src/RecorderTypes.cpp
+
+recordershm_LINK := rt boost_program_options
+
+recordercompact_SRCS := \
+	src/main_compact.cpp \
+	src/RecorderTypes.cpp \
+	src/RecorderFormat.cpp \
+	src/RecorderCompactor.cpp
+
+recordercompact_LINK := pthread boost_program_options
+
+recorderread_SRCS := \
+	src/main_read.cpp \
+	src/RecorderTypes.cpp \
+	src/RecorderFormat.cpp \
+	src/RecorderReader.cpp
+
+recorderread_LINK := boost_program_options
 
 include $(FOOTER)
@@ -26,11 +26,15 @@
 
 #include "RecorderBase.h"
 
+#include <algorithm>
 #include <array>
+#include <cmath>
 #include <cstdlib>
 #include <ctime>
 #include <memory>
 #include <string>
+#include <type_traits>
+#include <vector>
 
 
 namespace util {
@@ -63,9 +67,78 @@ void updateData(Item* item, V const (&v)[N]) {
   }
 }
 
+// Widen an element to the 8 byte item representation at dst.
+template<typename V>
+void widen(V const value, char* dst) {
+  typedef typename std::conditional<
+    std::is_unsigned<V>::value, uint64_t, int64_t>::type Integer;
+  typedef typename std::conditional<
+    std::is_integral<V>::value, Integer, double>::type Wide;
+  Wide const wide = static_cast<Wide>(value);
+  std::memcpy(dst, &wide, sizeof(wide));
+}
+
 }  // namespace util
 
 
+// Per item decimation policy for Recorder::setup(). Intervals and
+// windows are in the unit of the recorded item time. Samples suppressed
+// by a policy never reach the change detection or the send buffer.
+// Policies can be changed at runtime via the control channel, see
+// ControlCommand.
+struct ItemPolicy {
+  enum class Mode : int8_t {
+    ALL, INTERVAL, NTH, MINMAX, };
+
+  // Record every change (default).
+  ItemPolicy()
+      : mode(Mode::ALL), period(0), deadband(0.0), priority(false) {}
+
+  // At least min_interval between recorded samples.
+  static ItemPolicy interval(int32_t min_interval) {
+    return ItemPolicy(Mode::INTERVAL, min_interval);
+  }
+
+  // Keep every n:th sample.
+  static ItemPolicy nth(int32_t n) {
+    return ItemPolicy(Mode::NTH, n);
+  }
+
+  // Keep the minimum and maximum sample, in time order, of each window.
+  // For arrays the first element decides. A window is closed by the
+  // first sample outside it, or by Recorder::flush().
+  static ItemPolicy minmax(int32_t window) {
+    return ItemPolicy(Mode::MINMAX, window);
+  }
+
+  // Additionally suppress samples within band of the last recorded
+  // value. For arrays the first element decides, not used with MINMAX.
+  ItemPolicy withDeadband(double band) const {
+    ItemPolicy policy(*this);
+    policy.deadband = band;
+    return policy;
+  }
+
+  // High priority, e.g. alarms and events. Recorded samples bypass the
+  // send buffer, see RecorderBase::setPriorityAddress().
+  ItemPolicy withPriority() const {
+    ItemPolicy policy(*this);
+    policy.priority = true;
+    return policy;
+  }
+
+  Mode    mode;
+  int32_t period;
+  double  deadband;
+  bool    priority;
+
+ private:
+  ItemPolicy(Mode policy_mode, int32_t policy_period)
+      : mode(policy_mode), period(policy_period), deadband(0.0)
+      , priority(false) {}
+};
+
+
 template<typename K>
 class Recorder : public RecorderBase {
  public:
@@ -73,36 +146,85 @@ class Recorder : public RecorderBase {
   Recorder& operator= (Recorder const&) = delete;
 
   Recorder(std::string const& name, int32_t external_id = 0)
-      : RecorderBase(name, external_id) {
+      : RecorderBase(name, external_id)
+      , has_triggers_(false) {
     RecorderBase::setupRecorder(items_.max_size());
+    triggers_.fill(Trigger());
   }
 
   ~Recorder() {
+    flush();
+  }
+
+  // Record the extremes of the open MINMAX windows (see
+  // ItemPolicy::minmax()), send the window of a pending flight recorder
+  // trigger and the buffered items, e.g. before the recorded signals go
+  // quiet. Called at destruction.
+  void flush() {
+    for (size_t key = 0; key < decimation_.size(); ++key) {
+      if (decimation_[key].window_open) {
+        closeWindow(&decimation_[key], &items_[key]);
+      }
+    }
+    RecorderBase::flushPendingTrigger();
+    RecorderBase::flushSendBuffer();
   }
 
   // Setup parameter with key (name) and unit for recording. The unit is
   // a string which must be parsed at the receiving side. Calling setup
   // multiple times with the same key value will have no effect, once
   // setup the key and unit will be locked. The description is for
-  // explaining the recorded data item, type, purpose etc.
+  // explaining the recorded data item, type, purpose etc. The policy
+  // limits the rate at which the item is recorded, see ItemPolicy.
   void setup(K const enumkey,
              std::string const& name,
-             std::string const& desc = "N/A") {
+             std::string const& desc = "N/A",
+             ItemPolicy const& policy = ItemPolicy()) {
     auto const key = static_cast<decltype(Item::key)>(enumkey);
     items_[key] = Item(key);
+    setPolicy(enumkey, policy);
     RecorderBase::setupItem(InitItem(recorder_id_, key, name, desc));
   }
 
+  // Change the decimation policy of key, resets the policy state except
+  // the last recorded time and value.
+  void setPolicy(K const enumkey, ItemPolicy const& policy) {
+    auto& dec = decimation_[static_cast<size_t>(enumkey)];
+    auto const last_time = dec.last_time;
+    auto const last_value = dec.last_value;
+    dec = Decimation();
+    dec.filtered = policy.mode != ItemPolicy::Mode::ALL || policy.deadband > 0;
+    dec.mode = policy.mode;
+    dec.period = policy.period;
+    dec.deadband = policy.deadband;
+    dec.priority = policy.priority;
+    dec.last_time = last_time;
+    dec.last_value = last_value;
+  }
+
+  // Number of samples of key suppressed by its policy.
+  int64_t suppressed(K const enumkey) const {
+    return decimation_[static_cast<size_t>(enumkey)].suppressed;
+  }
+
   // Record parameter with key, previously setup using setup(). The
   // value need not have the same type in each call but there will be a
   // difference between 1 (integer) and 1.0 (float) causing a new
   // recording event to occur.
   template<typename V, size_t N>
-  void record(K const enumkey, V const (&value)[N], uint64_t time = 0) {
-    static_assert(N <= 3, "Maximum array size is 3");
-    auto& item = items_[static_cast<size_t>(enumkey)];
+  typename std::enable_if<(N <= 3)>::type
+  record(K const enumkey, V const (&value)[N], uint64_t time = 0) {
+    auto const key = static_cast<size_t>(enumkey);
+    if (control_flags_[key].load(std::memory_order_relaxed) != 0 &&
+        !controlled(enumkey)) {
+      return;
+    }
+    auto& item = items_[key];
+    auto& dec = decimation_[key];
 
-    if (item.type == ItemType::NOTSETUP) {
+    if (dec.filtered && !admit(&dec, &item, value, time)) {
+      // Suppressed or decimated
+    } else if (item.type == ItemType::NOTSETUP) {
       printf("Warning: Not setup item enum %d[%lu] \"%s\"\n",
              enumkey, N, recorder_name_.c_str());
     } else if (item.type == ItemType::INIT) {
@@ -114,16 +236,22 @@ class Recorder : public RecorderBase {
       item.time = time;
       // Set data
       util::updateData(&item, value);
+      if (has_triggers_) {
+        checkTrigger(item.key, value[0]);
+      }
       // Record
-      RecorderBase::record(item);
+      submit(dec, item);
     } else if (std::memcmp(&(item.data), &value, sizeof(value))) {
       // First record old value at current time
       item.time = time;
-      RecorderBase::record(item);
+      submit(dec, item);
       // Then update value and record again at current time to get a
       // "step" in the data. Items are sent "in order" to the receiver.
       util::updateData(&item, value);
-      RecorderBase::record(item);
+      if (has_triggers_) {
+        checkTrigger(item.key, value[0]);
+      }
+      submit(dec, item);
     } else {
       // Ignore unchanged value
     }
@@ -135,9 +263,324 @@ class Recorder : public RecorderBase {
     record(enumkey, {value}, time);
   }
 
+  // Arrays of more than three elements, and strings, are recorded as a
+  // single variable length item (see VarItem) of at most
+  // RECORDER_MAX_VAR_LENGTH elements or characters, longer ones are
+  // truncated. The whole item is recorded when any element changed,
+  // without the step of the fixed size items. Decimation policies do
+  // not apply to variable length items.
+  template<typename V>
+  void recordArray(K const enumkey,
+                   V const* values,
+                   size_t length,
+                   uint64_t time = 0) {
+    static_assert(std::is_arithmetic<V>::value, "Array of numbers required");
+    Item typed;
+    setDataType<V, 1>(&typed);
+    length = std::min<size_t>(length, RECORDER_MAX_VAR_LENGTH);
+    char* data = beginVar(enumkey, typed.type, length, time);
+    if (data == nullptr) {
+      return;
+    }
+    for (size_t i = 0; i < length; ++i) {
+      util::widen(values[i], data + i * 8);
+    }
+    if (commitVar(enumkey, 8) && has_triggers_ && length > 0) {
+      checkTrigger(static_cast<size_t>(enumkey), values[0]);
+    }
+  }
+
+  template<typename V, size_t N>
+  typename std::enable_if<(N > 3 && !std::is_same<V, char>::value)>::type
+  record(K const enumkey, V const (&value)[N], uint64_t time = 0) {
+    recordArray(enumkey, value, N, time);
+  }
+
+  template<typename V>
+  void record(K const enumkey,
+              std::vector<V> const& values,
+              uint64_t time = 0) {
+    recordArray(enumkey, values.data(), values.size(), time);
+  }
+
+  // A null string is recorded as empty.
+  void record(K const enumkey, char const* value, uint64_t time = 0) {
+    if (value == nullptr) {
+      value = "";
+    }
+    auto const length = strnlen(value, RECORDER_MAX_VAR_LENGTH);
+    char* data = beginVar(enumkey, ItemType::STRING, length, time);
+    if (data != nullptr) {
+      std::memcpy(data, value, length);
+      commitVar(enumkey, 1);
+    }
+  }
+
+  void record(K const enumkey, std::string const& value, uint64_t time = 0) {
+    record(enumkey, value.c_str(), time);
+  }
+
+  // Trigger the flight recorder (see setFlightRecorder()) when the
+  // value of key leaves the range [low, high]. For arrays only the
+  // first element is checked.
+  void setTrigger(K const enumkey, double low, double high) {
+    auto& trig = triggers_[static_cast<size_t>(enumkey)];
+    trig.enabled = true;
+    trig.outside = false;
+    trig.low = low;
+    trig.high = high;
+    has_triggers_ = true;
+  }
+
  private:
+  // Slow path for keys with control state set, applies a pending policy
+  // update. Returns false if the key is disabled.
+  bool controlled(K const enumkey) {
+    ItemControl update;
+    if (RecorderBase::takeControl(static_cast<int16_t>(enumkey), &update)) {
+      ItemPolicy policy;
+      policy.mode = static_cast<ItemPolicy::Mode>(update.mode);
+      policy.period = update.period;
+      policy.deadband = update.deadband;
+      policy.priority = decimation_[static_cast<size_t>(enumkey)].priority;
+      setPolicy(enumkey, policy);
+    }
+    return RecorderBase::enabled(static_cast<int16_t>(enumkey));
+  }
+
+  // Encode a variable length item of key into the scratch slots, returns
+  // where to put the elements or null if the key is not recorded.
+  char* beginVar(K const enumkey,
+                 ItemType type,
+                 size_t length,
+                 uint64_t time) {
+    auto const key = static_cast<size_t>(enumkey);
+    if (control_flags_[key].load(std::memory_order_relaxed) != 0 &&
+        !controlled(enumkey)) {
+      return nullptr;
+    }
+    if (items_[key].type == ItemType::NOTSETUP) {
+      printf("Warning: Not setup item enum %d[%lu] \"%s\"\n",
+             static_cast<int>(enumkey), length, recorder_name_.c_str());
+      return nullptr;
+    }
+    auto const num_slots = varItemSlots(type, length);
+    var_scratch_.resize(num_slots);
+    std::memset(static_cast<void*>(var_scratch_.data()), 0,
+                num_slots * sizeof(Item));
+    auto* var = reinterpret_cast<VarItem*>(var_scratch_.data());
+    var->time = time;
+    var->key = key;
+    var->type = type;
+    var->length = length;
+    var->changed = length;
+    return reinterpret_cast<char*>(var + 1);
+  }
+
+  // Per element change detection against the last recorded value of the
+  // key, records the scratch item if any element changed. Returns true
+  // if recorded.
+  bool commitVar(K const enumkey, size_t element_size) {
+    auto const key = static_cast<size_t>(enumkey);
+    if (var_values_.empty()) {
+      var_values_.resize(items_.size());
+    }
+    auto& last = var_values_[key];
+    auto* var = reinterpret_cast<VarItem*>(var_scratch_.data());
+    auto const* last_var = reinterpret_cast<VarItem const*>(last.data());
+    if (!last.empty() &&
+        last_var->type == var->type &&
+        last_var->length == var->length) {
+      auto const* a = reinterpret_cast<char const*>(var + 1);
+      auto const* b = reinterpret_cast<char const*>(last_var + 1);
+      int32_t changed = 0;
+      for (int32_t i = 0; i < var->length; ++i) {
+        changed += std::memcmp(a + i * element_size,
+                               b + i * element_size,
+                               element_size) != 0;
+      }
+      if (changed == 0) {
+        return false;
+      }
+      var->changed = changed;
+    }
+    items_[key].type = var->type;
+    last.swap(var_scratch_);
+    RecorderBase::recordVar(
+        last.data(), last.size(), decimation_[key].priority);
+    return true;
+  }
+
+  struct Trigger {
+    Trigger() : enabled(false), outside(false), low(0.0), high(0.0) {}
+    bool enabled;
+    bool outside;
+    double low;
+    double high;
+  };
+
+  // Decimation state per key.
+  struct Decimation {
+    Decimation()
+        : filtered(false), mode(ItemPolicy::Mode::ALL), period(0)
+        , deadband(0.0), priority(false), last_value(0.0), count(0)
+        , last_time(0)
+        , window_start(0), window_open(false), min_value(0.0)
+        , max_value(0.0), suppressed(0) {}
+    bool    filtered;  // Any policy or deadband
+    ItemPolicy::Mode mode;
+    int32_t period;
+    double  deadband;
+    bool    priority;
+    double  last_value;
+    int32_t count;
+    int32_t last_time;
+    int32_t window_start;
+    bool    window_open;
+    double  min_value;
+    double  max_value;
+    Item    min_item;
+    Item    max_item;
+    int64_t suppressed;
+  };
+
+  // Returns true if the sample shall be recorded as usual. The first
+  // sample of an item is always admitted to establish its data type.
+  template<typename V, size_t N>
+  bool admit(Decimation* dec,
+             Item* item,
+             V const (&value)[N],
+             uint64_t time) {
+    auto const now = static_cast<int32_t>(time);
+    auto const v = static_cast<double>(value[0]);
+    if (item->type == ItemType::NOTSETUP || item->type == ItemType::INIT) {
+      dec->last_time = now;
+      dec->last_value = v;
+      return true;
+    }
+    if (dec->deadband > 0.0 && dec->mode != ItemPolicy::Mode::MINMAX &&
+        std::fabs(v - dec->last_value) <= dec->deadband) {
+      ++dec->suppressed;
+      return false;
+    }
+    switch (dec->mode) {
+      case ItemPolicy::Mode::INTERVAL:
+        if (now - dec->last_time < dec->period) {
+          ++dec->suppressed;
+          return false;
+        }
+        dec->last_time = now;
+        break;;
+      case ItemPolicy::Mode::NTH:
+        if (++dec->count < dec->period) {
+          ++dec->suppressed;
+          return false;
+        }
+        dec->count = 0;
+        break;;
+      case ItemPolicy::Mode::MINMAX:
+        decimate(dec, item, value, now);
+        return false;
+      default:
+        break;;
+    }
+    dec->last_value = v;
+    return true;
+  }
+
+  template<typename V, size_t N>
+  void decimate(Decimation* dec,
+                Item* item,
+                V const (&value)[N],
+                int32_t now) {
+    if (has_triggers_) {
+      checkTrigger(item->key, value[0]);
+    }
+    if (dec->window_open && now - dec->window_start >= dec->period) {
+      closeWindow(dec, item);
+    }
+
+    Item sample;
+    sample.time = now;
+    util::updateData(&sample, value);
+    auto const v = static_cast<double>(value[0]);
+    ++dec->suppressed;
+    if (!dec->window_open) {
+      dec->window_open = true;
+      dec->window_start = now;
+      dec->min_value = dec->max_value = v;
+      dec->min_item = dec->max_item = sample;
+    } else if (v < dec->min_value) {
+      dec->min_value = v;
+      dec->min_item = sample;
+    } else if (v > dec->max_value) {
+      dec->max_value = v;
+      dec->max_item = sample;
+    }
+  }
+
+  // Record the extremes of the open window in time order.
+  void closeWindow(Decimation* dec, Item* item) {
+    auto const* first = &dec->min_item;
+    auto const* second = &dec->max_item;
+    if (second->time < first->time) {
+      std::swap(first, second);
+    }
+    dec->suppressed -= recordSample(*dec, item, *first);
+    if (dec->min_value != dec->max_value) {
+      dec->suppressed -= recordSample(*dec, item, *second);
+    }
+    dec->window_open = false;
+  }
+
+  // Record a decimated sample as a step from the previous value,
+  // returns false if the value is unchanged.
+  bool recordSample(Decimation const& dec,
+                    Item* item,
+                    Item const& sample) {
+    if (std::memcmp(&item->data, &sample.data, sizeof(item->data))) {
+      item->time = sample.time;
+      submit(dec, *item);
+      item->data = sample.data;
+      submit(dec, *item);
+      return true;
+    }
+    return false;
+  }
+
+  void submit(Decimation const& dec, Item const& item) {
+    if (dec.priority) {
+      RecorderBase::recordPriority(item);
+    } else {
+      RecorderBase::record(item);
+    }
+  }
+
+  template<typename V>
+  void checkTrigger(size_t key, V const value) {
+    auto& trig = triggers_[key];
+    if (trig.enabled) {
+      auto const v = static_cast<double>(value);
+      bool const outside = v < trig.low || v > trig.high;
+      if (outside && !trig.outside) {
+        RecorderBase::trigger();
+      }
+      trig.outside = outside;
+    }
+  }
+
   // Local storage for recorder. Each recorded item is appended to the
   // array and when it is full it is copied to a zeromq message buffer
   // for transport.
   std::array<Item, static_cast<size_t>(K::Count)> items_;
+
+  std::array<Decimation, static_cast<size_t>(K::Count)> decimation_;
+
+  // Last recorded variable length item per key, allocated on first use.
+  std::vector<std::vector<Item>> var_values_;
+  std::vector<Item> var_scratch_;
+
+  // Flight recorder triggers per key.
+  bool has_triggers_;
+  std::array<Trigger, static_cast<size_t>(K::Count)> triggers_;
 };
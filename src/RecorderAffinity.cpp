@@ -0,0 +1,100 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#include "RecorderAffinity.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+bool
+parseCpuList(std::string const& list, std::vector<int>* cpus) {
+  cpus->clear();
+  char const* p = list.c_str();
+  while (*p != '\0') {
+    char* end = nullptr;
+    long const first = std::strtol(p, &end, 10);
+    long last = first;
+    if (end == p || first < 0) {
+      return false;
+    }
+    p = end;
+    if (*p == '-') {
+      ++p;
+      last = std::strtol(p, &end, 10);
+      if (end == p || last < first) {
+        return false;
+      }
+      p = end;
+    }
+    for (long cpu = first; cpu <= last; ++cpu) {
+      cpus->push_back(static_cast<int>(cpu));
+    }
+    if (*p == ',') {
+      ++p;
+    } else if (*p != '\0') {
+      return false;
+    }
+  }
+  return !cpus->empty();
+}
+
+bool
+pinThread(int cpu) {
+  if (cpu < 0 || cpu >= CPU_SETSIZE) {
+    std::fprintf(stderr, "Cpu %d out of range\n", cpu);
+    return false;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  int const rval = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (rval != 0) {
+    std::fprintf(stderr, "Pinning to cpu %d: %s\n", cpu, std::strerror(rval));
+    return false;
+  }
+  return true;
+}
+
+int
+cpuNode(int cpu) {
+  char path[64];
+  std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR* dir = opendir(path);
+  if (dir == nullptr) {
+    return -1;
+  }
+  int node = -1;
+  while (dirent* entry = readdir(dir)) {
+    if (std::sscanf(entry->d_name, "node%d", &node) == 1) {
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
@@ -0,0 +1,43 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+// CPU placement of threads. On multi-socket hosts memory is allocated on
+// the NUMA node of the cpu that first touches it, so threads pinned to
+// the cpus of a node and allocating their own state keep it node local.
+
+// Parse a cpu list, e.g. "0-3,8,10", as in /sys. Returns false if
+// malformed.
+bool parseCpuList(std::string const& list, std::vector<int>* cpus);
+
+// Pin the calling thread to cpu. Returns false, with a message, if the
+// cpu is not available.
+bool pinThread(int cpu);
+
+// NUMA node of cpu, -1 if unknown.
+int cpuNode(int cpu);
@@ -29,17 +29,172 @@
 
 #include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
 #include <memory>
+#include <mutex>
+#include <random>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include <zmq.hpp>
 
+#include "RecorderShm.h"
 #include "zmqutils.h"
 
 
+namespace {
+// Registry of set up recorders, for the control channel.
+std::mutex g_registry_mutex;
+std::vector<RecorderBase*> g_registry;
+
+// Control channel subscriber, one per process. The SUB socket is owned
+// by the control thread.
+class ControlThread {
+ public:
+  ControlThread() : running_(false), process_(0) {}
+  ~ControlThread() { stop(); }
+
+  // Clock probes are echoed to echo_address. The process token is drawn
+  // at each start, forked processes must not share it.
+  void start(zmq::context_t* ctx,
+             std::string const& address,
+             std::string const& echo_address) {
+    stop();
+    running_ = true;
+    process_ = static_cast<int32_t>(std::random_device()());
+    thread_ = std::thread(
+        &ControlThread::run, this, ctx, address, echo_address);
+  }
+
+  void stop() {
+    running_ = false;
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+ private:
+  void run(zmq::context_t* ctx,
+           std::string const& address,
+           std::string const& echo_address) {
+    zmq::socket_t socket(*ctx, ZMQ_SUB);
+    int constexpr linger = 0;
+    socket.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+    socket.setsockopt(ZMQ_SUBSCRIBE, "", 0);
+    zmqutils::connect(&socket, address);
+    zmq_pollitem_t items[] = { { socket, 0, ZMQ_POLLIN, 0 } };
+    zmq::message_t zmsg;
+    std::unique_ptr<zmq::socket_t> echo;
+    while (running_) {
+      if (!zmqutils::poll(items)) {
+        continue;
+      }
+      socket.recv(&zmsg);
+      if (zmsg.size() == sizeof(ControlCommand)) {
+        ControlCommand command(ControlType::ENABLE, "");
+        std::memcpy(&command, zmsg.data(), sizeof(command));
+        RecorderBase::control(command);
+      } else if (zmsg.size() == sizeof(ClockSync)) {
+        auto const received = RecorderBase::now();
+        if (!echo) {
+          int constexpr sendtimeout = 2;
+          echo.reset(new zmq::socket_t(*ctx, ZMQ_PUSH));
+          echo->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+          echo->setsockopt(ZMQ_SNDTIMEO, &sendtimeout, sizeof(sendtimeout));
+          zmqutils::connect(echo.get(), echo_address);
+        }
+        ClockSync sync;
+        std::memcpy(&sync, zmsg.data(), sizeof(sync));
+        sync.process = process_;
+        sync.t2 = received;
+        echoClock(echo.get(), &sync);
+      }
+    }
+    if (echo) {
+      echo->close();
+    }
+    socket.close();
+  }
+
+  // The recorder ids let the sink apply the clock estimate of the
+  // process to its recorders.
+  void echoClock(zmq::socket_t* echo, ClockSync* sync) {
+    recorder_ids_.clear();
+    RecorderBase::recorderIds(&recorder_ids_);
+    auto constexpr type = PayloadType::CLOCK;
+    sync->t3 = RecorderBase::now();
+    if (echo->send(&type, sizeof(type), ZMQ_SNDMORE) > 0) {
+      echo->send(sync, sizeof(*sync), ZMQ_SNDMORE);
+      echo->send(recorder_ids_.data(),
+                 recorder_ids_.size() * sizeof(recorder_ids_[0]));
+    }
+  }
+
+  std::atomic<bool> running_;
+  std::thread thread_;
+  int32_t process_;
+  std::vector<int16_t> recorder_ids_;
+};
+
+ControlThread g_control;
+
+// Open frame of the thread, see RecorderBase::beginFrame().
+struct Frame {
+  Frame()
+      : open(false)
+      , time(0)
+      , sequence(0)
+      , source(syscall(SYS_gettid))
+      , count(0) {}
+  bool    open;
+  int32_t time;
+  int64_t sequence;
+  int32_t source;
+  size_t  count;  // Items, a variable length item counts once
+  std::vector<RecorderBase*> recorders;
+  std::vector<FrameSection> sections;
+  std::vector<Item> items;
+};
+
+thread_local Frame t_frame;
+
+// Process wide send accounting, see RecorderBase::sendStats().
+std::atomic<int64_t> g_sent_batches(0);
+std::atomic<int64_t> g_sent_items(0);
+std::atomic<int64_t> g_dropped_batches(0);
+std::atomic<int64_t> g_dropped_items(0);
+
+// Process clock, see RecorderBase::setClock().
+int64_t
+systemClock() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+RecorderBase::ClockFunction g_clock = &systemClock;
+
+// Send timestamp of data messages, microseconds since epoch.
+int64_t
+sendTime() {
+  return g_clock();
+}
+
+void
+account(bool sent, size_t num_items) {
+  if (sent) {
+    g_sent_batches.fetch_add(1, std::memory_order_relaxed);
+    g_sent_items.fetch_add(num_items, std::memory_order_relaxed);
+  } else {
+    g_dropped_batches.fetch_add(1, std::memory_order_relaxed);
+    g_dropped_items.fetch_add(num_items, std::memory_order_relaxed);
+  }
+}
+}  // namespace
+
+
 // Static definitions for RecorderBase
 // ----------------------------------------------------------------------------
 void
@@ -57,17 +212,137 @@ RecorderBase::getAddress() {
   return RecorderBase::socket_address;
 }
 
+void
+RecorderBase::setPriorityAddress(std::string const& address) {
+  RecorderBase::priority_address = address;
+}
+
+void
+RecorderBase::setControlAddress(std::string const& address) {
+  if (socket_context == nullptr) {
+    std::fprintf(stderr, "setContext() must be called before %s\n",
+                 __func__);
+    std::exit(1);
+  }
+  g_control.start(socket_context,
+                  address,
+                  priority_address.empty() ? socket_address : priority_address);
+}
+
+void
+RecorderBase::setClock(ClockFunction clock) {
+  g_clock = clock;
+}
+
+int64_t
+RecorderBase::now() {
+  return g_clock();
+}
+
+void
+RecorderBase::recorderIds(std::vector<int16_t>* ids) {
+  std::lock_guard<std::mutex> lock(g_registry_mutex);
+  for (auto const* recorder : g_registry) {
+    ids->push_back(recorder->recorder_id_);
+  }
+}
+
+void
+RecorderBase::control(ControlCommand const& command) {
+  std::string const name(
+      command.recorder_name,
+      strnlen(command.recorder_name, sizeof(command.recorder_name)));
+  std::lock_guard<std::mutex> lock(g_registry_mutex);
+  for (auto* recorder : g_registry) {
+    if (name.empty() || name == recorder->recorder_name_) {
+      recorder->applyControl(command);
+    }
+  }
+}
+
+void
+RecorderBase::beginFrame(int32_t time) {
+  if (t_frame.open) {
+    commitFrame();
+  }
+  t_frame.open = true;
+  t_frame.time = time;
+}
+
+void
+RecorderBase::commitFrame() {
+  auto& frame = t_frame;
+  if (!frame.open) {
+    return;
+  }
+  frame.open = false;
+
+  // Recorders are announced, and items recorded before the frame sent,
+  // ahead of the frame.
+  for (auto* recorder : frame.recorders) {
+    recorder->flushSendBuffer();
+  }
+  if (!frame.items.empty()) {
+    auto constexpr type = PayloadType::FRAME;
+    FrameHeader const header = {
+      frame.sequence,
+      frame.time,
+      frame.source,
+      static_cast<int32_t>(frame.sections.size()),
+      static_cast<int32_t>(frame.items.size()),
+      sendTime() };
+    // The remaining parts of a message are always accepted once the
+    // first part is.
+    bool const sent = socket_->send(&type, sizeof(type), ZMQ_SNDMORE) > 0;
+    if (sent) {
+      socket_->send(&header, sizeof(header), ZMQ_SNDMORE);
+      socket_->send(frame.sections.data(),
+                    frame.sections.size() * sizeof(FrameSection),
+                    ZMQ_SNDMORE);
+      socket_->send(frame.items.data(), frame.items.size() * sizeof(Item));
+    }
+    account(sent, frame.count);
+  }
+  ++frame.sequence;
+  frame.count = 0;
+  frame.recorders.clear();
+  frame.sections.clear();
+  frame.items.clear();
+}
+
+RecorderBase::SendStats
+RecorderBase::sendStats() {
+  SendStats stats;
+  stats.batches = g_sent_batches.load(std::memory_order_relaxed);
+  stats.items = g_sent_items.load(std::memory_order_relaxed);
+  stats.dropped_batches = g_dropped_batches.load(std::memory_order_relaxed);
+  stats.dropped_items = g_dropped_items.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void
+RecorderBase::setSharedMemory(std::string const& prefix) {
+  shm_prefix = prefix;
+}
+
 void
 RecorderBase::shutDown() {
+  g_control.stop();
   if (RecorderBase::socket_) {
     RecorderBase::socket_->close();
   }
+  if (RecorderBase::priority_socket_) {
+    RecorderBase::priority_socket_->close();
+  }
 }
 
 zmq::context_t* RecorderBase::socket_context = nullptr;
 std::string     RecorderBase::socket_address = "";
+std::string     RecorderBase::priority_address = "";
+std::string     RecorderBase::shm_prefix = "";
 
 thread_local std::shared_ptr<zmq::socket_t> RecorderBase::socket_;
+thread_local std::shared_ptr<zmq::socket_t> RecorderBase::priority_socket_;
 // ----------------------------------------------------------------------------
 
 
@@ -75,6 +350,20 @@ namespace {
 void Error(char const* msg) { std::fprintf(stderr, "%s\n", msg); }
 std::atomic<int16_t> g_recorder_id = ATOMIC_VAR_INIT(0);
 
+void
+connectPush(zmq::context_t* ctx,
+            std::string const& address,
+            std::shared_ptr<zmq::socket_t>* socket) {
+  int constexpr linger = 3000;
+  int constexpr sendtimeout = 2;
+  int constexpr sendhwm = 16000;
+  socket->reset(new zmq::socket_t(*ctx, ZMQ_PUSH));
+  (*socket)->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+  (*socket)->setsockopt(ZMQ_SNDTIMEO, &sendtimeout, sizeof(sendtimeout));
+  (*socket)->setsockopt(ZMQ_SNDHWM, &sendhwm, sizeof(sendhwm));
+  zmqutils::connect(socket->get(), address);
+}
+
 // Socket creator class, whose purpose is to safely create only a single
 // socket within each thread. It is statically declared in the ctor of
 // RecorderBase and "should" therefore guarantee only to be called once,
@@ -86,25 +375,26 @@ class SocketCreator {
                 std::shared_ptr<zmq::socket_t>* socket) {
     pid_t tid = syscall(SYS_gettid);
     printf("%s: %d\n", __func__, tid);
-    int constexpr linger = 3000;
-    int constexpr sendtimeout = 2;
-    int constexpr sendhwm = 16000;
-    socket->reset(new zmq::socket_t(*ctx, ZMQ_PUSH));
-    (*socket)->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
-    (*socket)->setsockopt(ZMQ_SNDTIMEO, &sendtimeout, sizeof(sendtimeout));
-    (*socket)->setsockopt(ZMQ_SNDHWM, &sendhwm, sizeof(sendhwm));
-    zmqutils::connect(socket->get(), address);
+    connectPush(ctx, address, socket);
   }
 };
 
 }  // namespace
 
 
+void
+RecorderBase::setRecorderIdBase(int16_t base) {
+  g_recorder_id.store(base);
+}
+
 RecorderBase::RecorderBase(std::string const& name, int32_t id)
     : recorder_id_(g_recorder_id.fetch_add(1))
     , external_id_(id)
     , recorder_name_(name)
-    , send_buffer_index(0) {
+    , send_buffer_index(0)
+    , var_buffer_items_(0)
+    , schema_num_items_(0)
+    , schema_dirty_(false) {
   bool error = false;
   if (RecorderBase::socket_context == nullptr) {
     Error("setContext() must be called before first instantiation");
@@ -126,6 +416,16 @@ RecorderBase::RecorderBase(std::string const& name, int32_t id)
 }
 
 RecorderBase::~RecorderBase() {
+  {
+    std::lock_guard<std::mutex> lock(g_registry_mutex);
+    g_registry.erase(
+        std::remove(g_registry.begin(), g_registry.end(), this),
+        g_registry.end());
+  }
+  auto& recorders = t_frame.recorders;
+  recorders.erase(std::remove(recorders.begin(), recorders.end(), this),
+                  recorders.end());
+  flushPendingTrigger();
   flushSendBuffer();
 }
 
@@ -133,34 +433,371 @@ void
 RecorderBase::flushSendBuffer() {
   auto constexpr frame = PayloadType::DATA;
   auto constexpr item_size = sizeof(decltype(send_buffer)::value_type);
+  if (schema_dirty_) {
+    sendSchema();
+  }
   if (send_buffer_index > 0) {
-    socket_->send(&frame, sizeof(frame), ZMQ_SNDMORE);
-    socket_->send(&recorder_id_, sizeof(recorder_id_), ZMQ_SNDMORE);
-    socket_->send(send_buffer.data(), send_buffer_index * item_size);
+    bool const sent = socket_->send(&frame, sizeof(frame), ZMQ_SNDMORE) > 0;
+    if (sent) {
+      auto const sent_time = sendTime();
+      socket_->send(&recorder_id_, sizeof(recorder_id_), ZMQ_SNDMORE);
+      socket_->send(send_buffer.data(), send_buffer_index * item_size,
+                    ZMQ_SNDMORE);
+      socket_->send(&sent_time, sizeof(sent_time));
+    }
+    account(sent, send_buffer_index);
     send_buffer_index = 0;
   }
+  if (!var_buffer_.empty()) {
+    auto constexpr var_frame = PayloadType::VARDATA;
+    bool const sent =
+        socket_->send(&var_frame, sizeof(var_frame), ZMQ_SNDMORE) > 0;
+    if (sent) {
+      auto const sent_time = sendTime();
+      socket_->send(&recorder_id_, sizeof(recorder_id_), ZMQ_SNDMORE);
+      socket_->send(var_buffer_.data(), var_buffer_.size() * item_size,
+                    ZMQ_SNDMORE);
+      socket_->send(&sent_time, sizeof(sent_time));
+    }
+    account(sent, var_buffer_items_);
+    var_buffer_.clear();
+    var_buffer_items_ = 0;
+  }
 }
 
 void
 RecorderBase::setupRecorder(int32_t num_items) {
-  auto constexpr frame = PayloadType::INIT_RECORDER;
-  InitRecorder const init_rec(
-      recorder_id_, num_items, external_id_, recorder_name_);
-  socket_->send(&frame, sizeof(frame), ZMQ_SNDMORE);
-  socket_->send(&init_rec, sizeof(init_rec));
+  schema_num_items_ = num_items;
+  schema_dirty_ = true;
+
+  control_flags_.reset(new std::atomic<uint8_t>[num_items]);
+  for (int32_t i = 0; i < num_items; ++i) {
+    control_flags_[i].store(0, std::memory_order_relaxed);
+  }
+  control_updates_.resize(num_items);
+
+  if (!shm_prefix.empty()) {
+    shm_.reset(new RecorderShm(
+        shm_prefix, recorder_id_, external_id_, recorder_name_, num_items));
+    if (!shm_->valid()) {
+      shm_.reset();
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(g_registry_mutex);
+  g_registry.push_back(this);
 }
 
 void
 RecorderBase::setupItem(InitItem const& init_item) {
-  auto constexpr frame = PayloadType::INIT_ITEM;
-  socket_->send(&frame, sizeof(frame), ZMQ_SNDMORE);
-  socket_->send(&init_item, sizeof(init_item));
+  auto it = std::find_if(
+      schema_items_.begin(), schema_items_.end(),
+      [&init_item](InitItem const& item) { return item.key == init_item.key; });
+  if (it != schema_items_.end()) {
+    *it = init_item;
+  } else {
+    schema_items_.push_back(init_item);
+  }
+  schema_dirty_ = true;
+  if (shm_) {
+    shm_->setupItem(init_item);
+  }
+}
+
+void
+RecorderBase::sendSchema() {
+  auto constexpr frame = PayloadType::INIT_RECORDER;
+  auto const hash = schemaHash(
+      schema_num_items_, schema_items_.data(), schema_items_.size());
+  InitRecorder const init_rec(
+      recorder_id_, schema_num_items_, external_id_, recorder_name_, hash);
+  // Retried with the next flush if not sent.
+  if (socket_->send(&frame, sizeof(frame), ZMQ_SNDMORE) > 0) {
+    socket_->send(&init_rec, sizeof(init_rec), ZMQ_SNDMORE);
+    socket_->send(schema_items_.data(),
+                  schema_items_.size() * sizeof(InitItem));
+    schema_dirty_ = false;
+  }
 }
 
 void
 RecorderBase::record(Item const& item) {
+  if (schema_dirty_) {
+    sendSchema();
+  }
+  if (t_frame.open) {
+    Item framed(item);
+    framed.time = t_frame.time;
+    dispatch(framed);
+  } else {
+    dispatch(item);
+  }
+}
+
+void
+RecorderBase::dispatch(Item const& item) {
+  if (shm_) {
+    shm_->publish(item);
+  }
+  if (flight_) {
+    recordFlight(item);
+  } else {
+    send(item);
+  }
+}
+
+void
+RecorderBase::recordPriority(Item const& item) {
+  Item stamped(item);
+  if (t_frame.open) {
+    stamped.time = t_frame.time;
+  }
+  if (shm_) {
+    shm_->publish(stamped);
+  }
+  sendPriority(PayloadType::DATA, &stamped, 1, 1);
+}
+
+void
+RecorderBase::sendPriority(PayloadType type,
+                           Item const* items,
+                           size_t num_items,
+                           size_t count) {
+  if (schema_dirty_) {
+    sendSchema();
+  }
+  zmq::socket_t* socket = priority_socket_.get();
+  if (socket == nullptr) {
+    if (priority_address.empty()) {
+      // No separate lane, keep the order of the bulk socket.
+      flushSendBuffer();
+      socket = socket_.get();
+    } else {
+      connectPush(socket_context, priority_address, &priority_socket_);
+      socket = priority_socket_.get();
+    }
+  }
+  bool const sent = socket->send(&type, sizeof(type), ZMQ_SNDMORE) > 0;
+  if (sent) {
+    auto const sent_time = sendTime();
+    socket->send(&recorder_id_, sizeof(recorder_id_), ZMQ_SNDMORE);
+    socket->send(items, num_items * sizeof(Item), ZMQ_SNDMORE);
+    socket->send(&sent_time, sizeof(sent_time));
+  }
+  account(sent, count);
+}
+
+void
+RecorderBase::recordVar(Item const* slots, size_t num_slots, bool priority) {
+  if (schema_dirty_) {
+    sendSchema();
+  }
+  if (priority && t_frame.open) {
+    std::vector<Item> framed(slots, slots + num_slots);
+    reinterpret_cast<VarItem*>(framed.data())->time = t_frame.time;
+    sendPriority(PayloadType::VARDATA, framed.data(), num_slots, 1);
+    return;
+  } else if (priority) {
+    sendPriority(PayloadType::VARDATA, slots, num_slots, 1);
+    return;
+  }
+  std::vector<Item>* buffer = &var_buffer_;
+  if (t_frame.open) {
+    frameSection(FRAME_SECTION_VAR).num_items += num_slots;
+    ++t_frame.count;
+    buffer = &t_frame.items;
+  } else {
+    ++var_buffer_items_;
+  }
+  auto const offset = buffer->size();
+  buffer->insert(buffer->end(), slots, slots + num_slots);
+  if (t_frame.open) {
+    reinterpret_cast<VarItem*>(&(*buffer)[offset])->time = t_frame.time;
+  } else if (var_buffer_.size() >= send_buffer.max_size()) {
+    flushSendBuffer();
+  }
+}
+
+FrameSection&
+RecorderBase::frameSection(int16_t flags) {
+  auto& frame = t_frame;
+  if (frame.sections.empty() ||
+      frame.sections.back().recorder_id != recorder_id_ ||
+      frame.sections.back().flags != flags) {
+    if (std::find(frame.recorders.begin(), frame.recorders.end(), this) ==
+        frame.recorders.end()) {
+      frame.recorders.push_back(this);
+    }
+    frame.sections.push_back(FrameSection{recorder_id_, flags, 0});
+  }
+  return frame.sections.back();
+}
+
+void
+RecorderBase::send(Item const& item) {
+  if (t_frame.open) {
+    ++frameSection(0).num_items;
+    ++t_frame.count;
+    t_frame.items.push_back(item);
+    return;
+  }
   send_buffer[send_buffer_index++] = item;
   if (send_buffer_index == send_buffer.max_size()) {
     flushSendBuffer();
   }
 }
+
+void
+RecorderBase::setFlightRecorder(size_t pre_items,
+                                size_t post_items,
+                                int32_t pre_time,
+                                int32_t post_time) {
+  if (pre_items == 0) {
+    flight_.reset();
+    return;
+  }
+  flight_.reset(new FlightRecorder);
+  flight_->state = FlightRecorder::State::ARMED;
+  flight_->trigger_pending.store(false);
+  flight_->ring.resize(pre_items);
+  flight_->ring_head = 0;
+  flight_->ring_size = 0;
+  flight_->post_items = post_items;
+  flight_->post_count = 0;
+  flight_->pre_time = pre_time;
+  flight_->post_time = post_time;
+  flight_->trigger_time = 0;
+  flight_->last_time = 0;
+  flight_->owner = std::this_thread::get_id();
+}
+
+void
+RecorderBase::trigger() {
+  if (!flight_) {
+    return;
+  }
+  if (flight_->owner == std::this_thread::get_id()) {
+    shipFlight(flight_->last_time);
+    flushSendBuffer();
+  } else {
+    flight_->trigger_pending.store(true, std::memory_order_release);
+  }
+}
+
+void
+RecorderBase::flushPendingTrigger() {
+  if (flight_ &&
+      flight_->trigger_pending.load(std::memory_order_relaxed) &&
+      flight_->trigger_pending.exchange(false, std::memory_order_acquire)) {
+    shipFlight(flight_->last_time);
+    flushSendBuffer();
+  }
+}
+
+// Ship the pre-trigger window, oldest first, of items at most pre_time
+// older than time, and open the post-trigger window at time. A trigger
+// within the post-trigger window extends it.
+void
+RecorderBase::shipFlight(int32_t time) {
+  auto& flight = *flight_;
+  auto const capacity = flight.ring.size();
+  if (flight.state == FlightRecorder::State::ARMED) {
+    auto idx = (flight.ring_head + capacity - flight.ring_size) % capacity;
+    for (size_t i = 0; i < flight.ring_size; ++i) {
+      auto const& ring_item = flight.ring[idx];
+      if (flight.pre_time <= 0 || time - ring_item.time <= flight.pre_time) {
+        send(ring_item);
+      }
+      idx = (idx + 1) % capacity;
+    }
+    flight.ring_size = 0;
+    flight.state = FlightRecorder::State::TRIGGERED;
+  }
+  flight.trigger_time = time;
+  flight.post_count = 0;
+}
+
+void
+RecorderBase::recordFlight(Item const& item) {
+  auto& flight = *flight_;
+  auto const capacity = flight.ring.size();
+
+  flight.last_time = item.time;
+  if (flight.trigger_pending.load(std::memory_order_relaxed) &&
+      flight.trigger_pending.exchange(false, std::memory_order_acquire)) {
+    shipFlight(item.time);
+  }
+
+  if (flight.state == FlightRecorder::State::TRIGGERED) {
+    if (flight.post_time <= 0 ||
+        item.time - flight.trigger_time <= flight.post_time) {
+      send(item);
+      if (++flight.post_count >= flight.post_items) {
+        flushSendBuffer();
+        flight.state = FlightRecorder::State::ARMED;
+      }
+      return;
+    }
+    flushSendBuffer();
+    flight.state = FlightRecorder::State::ARMED;
+  }
+
+  flight.ring[flight.ring_head] = item;
+  flight.ring_head = (flight.ring_head + 1) % capacity;
+  if (flight.ring_size < capacity) {
+    ++flight.ring_size;
+  }
+}
+
+void
+RecorderBase::applyControl(ControlCommand const& command) {
+  if (command.type == ControlType::TRIGGER) {
+    trigger();
+    return;
+  }
+
+  int16_t first = 0;
+  int16_t last = schema_num_items_;
+  if (command.key >= 0) {
+    if (command.key >= schema_num_items_) {
+      return;
+    }
+    first = command.key;
+    last = command.key + 1;
+  }
+  uint8_t const off =
+      command.key < 0 ? CONTROL_RECORDER_OFF : CONTROL_ITEM_OFF;
+
+  std::lock_guard<std::mutex> lock(control_mutex_);
+  for (auto key = first; key < last; ++key) {
+    auto& flags = control_flags_[key];
+    switch (command.type) {
+      case ControlType::ENABLE:
+        flags.fetch_and(~off, std::memory_order_relaxed);
+        break;;
+      case ControlType::DISABLE:
+        flags.fetch_or(off, std::memory_order_relaxed);
+        break;;
+      case ControlType::POLICY:
+        control_updates_[key].mode = command.mode;
+        control_updates_[key].period = command.period;
+        control_updates_[key].deadband = command.deadband;
+        flags.fetch_or(CONTROL_PENDING, std::memory_order_relaxed);
+        break;;
+      default:
+        break;;
+    }
+  }
+}
+
+bool
+RecorderBase::takeControl(int16_t key, ItemControl* update) {
+  auto& flags = control_flags_[key];
+  if ((flags.load(std::memory_order_relaxed) & CONTROL_PENDING) == 0) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(control_mutex_);
+  flags.fetch_and(~CONTROL_PENDING, std::memory_order_relaxed);
+  *update = control_updates_[key];
+  return true;
+}
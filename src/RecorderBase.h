@@ -27,14 +27,20 @@
 #include "RecorderTypes.h"
 
 #include <array>
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 namespace zmq {
 class context_t;
 class socket_t;
 }
 
+class RecorderShm;
+
 // RecorderBase shall simplify the sharing of socket addresses and
 // communication infrastructure for producers and recorders. Both
 // context and sink address shall be the same for all instances.
@@ -66,15 +72,120 @@ class RecorderBase {
   // Get socket address.
   static std::string getAddress();
 
+  // Address of the sink priority lane (see
+  // RecorderSink::setPriorityEndpoint()). Items of high priority keys
+  // (see ItemPolicy::withPriority()) are sent at once, each in its own
+  // message, on a separate socket per thread so that bulk data can not
+  // delay them. Without an address they are sent at once on the bulk
+  // socket, with the items buffered before them.
+  static void setPriorityAddress(std::string const& address);
+
+  // Subscribe to the sink control channel (see ControlCommand) at
+  // address. Commands are received by a background thread and applied
+  // to the recorders of the process. Clock synchronization probes (see
+  // ClockSync) are echoed by the same thread, on the priority lane if
+  // its address is set, else on the bulk address. Requires setContext()
+  // and setAddress().
+  static void setControlAddress(std::string const& address);
+
+  // Clock of the process, microseconds since epoch, for the send time of
+  // messages and the clock synchronization with the sink. The system
+  // clock by default, replaceable e.g. to test with synthetic clock
+  // skew. Must be set before any recorder is created.
+  typedef int64_t (*ClockFunction)();
+  static void setClock(ClockFunction clock);
+  static int64_t now();
+
+  // Recorder ids are allocated per process from base, zero by default.
+  // The sink keeps its state by recorder id, processes sharing a sink
+  // must use disjoint ranges. Must be set before any recorder is
+  // created.
+  static void setRecorderIdBase(int16_t base);
+
+  // Apply a control command to the matching recorders of the process.
+  // Safe to call from any thread.
+  static void control(ControlCommand const& command);
+
+  // Append the ids of the set up recorders of the process to ids. Safe
+  // to call from any thread.
+  static void recorderIds(std::vector<int16_t>* ids);
+
+  // Frames group everything recorded by the calling thread between
+  // beginFrame() and commitFrame(), e.g. one control tick, into a single
+  // FRAME message sent at commit, coalesced across the recorders of the
+  // thread. All items recorded within the frame get the frame time.
+  // Frames do not nest, beginFrame() commits an open frame.
+  static void beginFrame(int32_t time);
+  static void commitFrame();
+
+  // Data messages (DATA, VARDATA and FRAME) sent by all recorders of the
+  // process, and dropped because the send timed out, e.g. when the sink
+  // is not keeping up.
+  struct SendStats {
+    int64_t batches;
+    int64_t items;
+    int64_t dropped_batches;
+    int64_t dropped_items;
+  };
+  static SendStats sendStats();
+
+  // Also publish the latest value of each item to shared memory, see
+  // RecorderShm.h, for recorders created after the call. Segment names
+  // start with prefix. Disabled if empty (default).
+  static void setSharedMemory(std::string const& prefix);
+
   // Stop all operations (by closing the socket).
   static void shutDown();
 
+  // Flight recorder mode. Recorded items are kept in a ring of the last
+  // pre_items items and nothing is sent until trigger() is called. On
+  // trigger the ring is sent, optionally limited to items at most
+  // pre_time older than the trigger, followed by a post-trigger window
+  // of post_items items, counting the item recorded at the trigger, or
+  // post_time (whichever ends first, zero for no time limit). Time is
+  // in the unit of the recorded item time. After the post-trigger
+  // window the recorder goes back to buffering. Zero pre_items disables
+  // flight recorder mode. The calling thread is taken to be the
+  // recording thread of the recorder.
+  void setFlightRecorder(size_t pre_items,
+                         size_t post_items,
+                         int32_t pre_time = 0,
+                         int32_t post_time = 0);
+
+  // Trigger shipping of the flight recorder window. Safe to call from
+  // any thread. On the recording thread the pre-trigger window is sent
+  // at once. From other threads, e.g. the control thread, the trigger is
+  // left pending for the recording thread, which sends the window at its
+  // next record call or flushPendingTrigger().
+  void trigger();
+
+  // Send the pre-trigger window of a pending trigger. Called by the
+  // recording thread, e.g. by Recorder::flush() and at destruction.
+  void flushPendingTrigger();
+
  protected:
+  // Pending item policy from a POLICY control command.
+  struct ItemControl {
+    int8_t  mode;
+    int32_t period;
+    double  deadband;
+  };
+
+  // Control state bits per key. Non-zero means the key is not recorded
+  // as usual, either disabled or with a policy update pending.
+  enum : uint8_t {
+    CONTROL_ITEM_OFF     = 1<<0,
+    CONTROL_RECORDER_OFF = 1<<1,
+    CONTROL_PENDING      = 1<<2,
+  };
+
   void flushSendBuffer();
 
   // Sets up the recorder instance by sending data to the backend with
   // "suitable" data. This data shall be used for sorting the source of
-  // future item data.
+  // future item data. The recorder and all its items are sent as one
+  // message with the first record after set up, ahead of the item, and
+  // again if items are set up after that.
   void setupRecorder(int32_t max_size);
 
   // Sets up each item to record. This enables the backend to predict
@@ -85,8 +196,29 @@ class RecorderBase {
   // if necessary.
   void record(Item const& item);
 
+  // Priority lane version of record(), bypasses the send buffer, the
+  // open frame (the item still gets the frame time) and the flight
+  // recorder. The lanes are not ordered with respect to each other.
+  void recordPriority(Item const& item);
+
+  // Send a variable length item, the VarItem header and element slots.
+  // Variable length items are not published to shared memory nor kept
+  // by the flight recorder.
+  void recordVar(Item const* slots, size_t num_slots, bool priority = false);
+
+  // Slow path of the control check, for keys with non-zero control
+  // state. Takes a pending policy update, returns false if there is
+  // none.
+  bool takeControl(int16_t key, ItemControl* update);
+  bool enabled(int16_t key) const {
+    return (control_flags_[key].load(std::memory_order_relaxed) &
+            (CONTROL_ITEM_OFF | CONTROL_RECORDER_OFF)) == 0;
+  }
+
   static zmq::context_t* socket_context;
   static std::string     socket_address;
+  static std::string     priority_address;
+  static std::string     shm_prefix;
 
   // Local/internal identifer for the recorder. This goes into the first
   // frame of the zeromq message for the backend to use for filtering
@@ -101,9 +233,64 @@ class RecorderBase {
   int64_t const external_id_;
   std::string const recorder_name_;
 
+  // Control state per key, written by the control thread and read with
+  // a single relaxed load on every record. Allocated by setupRecorder().
+  std::unique_ptr<std::atomic<uint8_t>[]> control_flags_;
+
  private:
   static thread_local std::shared_ptr<zmq::socket_t> socket_;
+  static thread_local std::shared_ptr<zmq::socket_t> priority_socket_;
+
+  // Shared memory, flight recorder and send buffer.
+  void dispatch(Item const& item);
+
+  // Append item to the open frame or the send buffer, flushing it when
+  // full.
+  void send(Item const& item);
+  void sendSchema();
+  void sendPriority(PayloadType type,
+                    Item const* items,
+                    size_t num_items,
+                    size_t count);
+  FrameSection& frameSection(int16_t flags);
+  void recordFlight(Item const& item);
+  void shipFlight(int32_t time);
+  void applyControl(ControlCommand const& command);
 
   SendBuffer send_buffer;
   SendBuffer::size_type send_buffer_index;
+
+  // Variable length items, sent as VARDATA with the send buffer.
+  std::vector<Item> var_buffer_;
+  size_t var_buffer_items_;
+
+  // Recorder schema, sent batched by sendSchema().
+  int32_t schema_num_items_;
+  bool schema_dirty_;
+  std::vector<InitItem> schema_items_;
+
+  // Pending policy updates, guarded by control_mutex_.
+  std::mutex control_mutex_;
+  std::vector<ItemControl> control_updates_;
+
+  // Flight recorder state, only allocated when the mode is enabled.
+  struct FlightRecorder {
+    enum class State { ARMED, TRIGGERED, };
+    State state;
+    std::atomic<bool> trigger_pending;
+    std::vector<Item> ring;
+    size_t ring_head;
+    size_t ring_size;
+    size_t post_items;
+    size_t post_count;
+    int32_t pre_time;
+    int32_t post_time;
+    int32_t trigger_time;
+    int32_t last_time;  // Of the last recorded item
+    std::thread::id owner;
+  };
+  std::unique_ptr<FlightRecorder> flight_;
+
+  // Shared memory latest values, only allocated when enabled.
+  std::unique_ptr<RecorderShm> shm_;
 };
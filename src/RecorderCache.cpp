@@ -0,0 +1,209 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#include "RecorderCache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+namespace {
+typedef std::chrono::microseconds usec;
+
+int64_t
+toUsec(RecorderCache::Clock::time_point tp) {
+  return std::chrono::duration_cast<usec>(tp.time_since_epoch()).count();
+}
+
+bool
+startsWith(std::string const& str, std::string const& prefix) {
+  return str.compare(0, prefix.size(), prefix) == 0;
+}
+
+bool
+startsWith(char const* str, std::string const& prefix) {
+  return str != nullptr &&
+         std::strncmp(str, prefix.c_str(), prefix.size()) == 0;
+}
+}  // namespace
+
+RecorderCache::Channel*
+RecorderCache::channel(int16_t recorder_id, size_t num_items) {
+  if (recorder_id < 0) {
+    return nullptr;
+  }
+  auto const rcid = static_cast<size_t>(recorder_id);
+  if (rcid >= recorders_.size()) {
+    recorders_.resize(rcid + 1);
+  }
+  auto& chan = recorders_[rcid];
+  if (num_items > chan.slots.size()) {
+    Slot const empty = { Item(), 0, 0, false };
+    chan.slots.resize(num_items, empty);
+    chan.item_names.resize(num_items, nullptr);
+  }
+  return &chan;
+}
+
+void
+RecorderCache::addRecorder(InitRecorder const& init,
+                           RecorderSchema::Schema const& schema) {
+  auto const num_items = std::max<size_t>(
+      std::max<int16_t>(init.recorder_num_items, 0), schema.names.size());
+  auto* chan = channel(init.recorder_id, num_items);
+  if (chan == nullptr) {
+    return;
+  }
+  chan->name.assign(init.recorder_name,
+                    strnlen(init.recorder_name, sizeof(init.recorder_name)));
+  for (size_t key = 0; key < schema.names.size(); ++key) {
+    if (schema.names[key] != nullptr) {
+      auto& slot = chan->slots[key];
+      slot.known = true;
+      slot.item.key = key;
+      chan->item_names[key] = schema.names[key];
+    }
+  }
+}
+
+void
+RecorderCache::addItem(InitItem const& init, char const* name) {
+  if (init.key < 0) {
+    return;
+  }
+  auto* chan = channel(init.recorder_id, init.key + 1);
+  if (chan != nullptr) {
+    auto& slot = chan->slots[init.key];
+    slot.known = true;
+    slot.item.key = init.key;
+    chan->item_names[init.key] = name;
+  }
+}
+
+void
+RecorderCache::update(int16_t recorder_id,
+                      Item const* items,
+                      size_t num_items,
+                      Clock::time_point now) {
+  if (recorder_id < 0 || num_items == 0) {
+    return;
+  }
+  auto const rcid = static_cast<size_t>(recorder_id);
+  auto const updated = toUsec(now);
+  for (size_t i = 0; i < num_items; ++i) {
+    auto const key = items[i].key;
+    if (key < 0) {
+      continue;
+    }
+    // Recorders normally announce their size up front, only grow the
+    // table for unannounced recorders and keys.
+    if (rcid >= recorders_.size() ||
+        static_cast<size_t>(key) >= recorders_[rcid].slots.size()) {
+      channel(recorder_id, key + 1);
+    }
+    auto& slot = recorders_[rcid].slots[key];
+    slot.item = items[i];
+    slot.updated = updated;
+    slot.updates += 1;
+    slot.known = true;
+  }
+}
+
+void
+RecorderCache::append(int16_t recorder_id,
+                      size_t key,
+                      Clock::time_point now,
+                      std::vector<CacheEntry>* entries,
+                      std::string* names) const {
+  auto const& chan = recorders_[recorder_id];
+  auto const& slot = chan.slots[key];
+  CacheEntry entry;
+  entry.age = slot.updates > 0 ? toUsec(now) - slot.updated : -1;
+  entry.updates = slot.updates;
+  entry.recorder_id = recorder_id;
+  entry.reserved = 0;
+  entry.item = slot.item;
+  entries->push_back(entry);
+  names->append(chan.name);
+  names->push_back('/');
+  if (chan.item_names[key] != nullptr) {
+    names->append(chan.item_names[key]);
+  }
+  names->push_back('\0');
+}
+
+void
+RecorderCache::lookup(QueryKey const* keys,
+                      size_t num_keys,
+                      Clock::time_point now,
+                      std::vector<CacheEntry>* entries,
+                      std::string* names) const {
+  for (size_t i = 0; i < num_keys; ++i) {
+    auto const rcid = keys[i].recorder_id;
+    auto const key = keys[i].key;
+    if (rcid < 0 || static_cast<size_t>(rcid) >= recorders_.size() ||
+        key < 0 || static_cast<size_t>(key) >= recorders_[rcid].slots.size() ||
+        !recorders_[rcid].slots[key].known) {
+      continue;
+    }
+    append(rcid, key, now, entries, names);
+  }
+}
+
+void
+RecorderCache::prefix(std::string const& recorder_prefix,
+                      std::string const& item_prefix,
+                      Clock::time_point now,
+                      std::vector<CacheEntry>* entries,
+                      std::string* names) const {
+  for (size_t rcid = 0; rcid < recorders_.size(); ++rcid) {
+    auto const& chan = recorders_[rcid];
+    if (!startsWith(chan.name, recorder_prefix)) {
+      continue;
+    }
+    for (size_t key = 0; key < chan.slots.size(); ++key) {
+      if (chan.slots[key].known &&
+          startsWith(chan.item_names[key], item_prefix)) {
+        append(rcid, key, now, entries, names);
+      }
+    }
+  }
+}
+
+void
+RecorderCache::stale(std::chrono::milliseconds max_age,
+                     Clock::time_point now,
+                     std::vector<CacheEntry>* entries,
+                     std::string* names) const {
+  auto const limit = toUsec(now - max_age);
+  for (size_t rcid = 0; rcid < recorders_.size(); ++rcid) {
+    auto const& chan = recorders_[rcid];
+    for (size_t key = 0; key < chan.slots.size(); ++key) {
+      auto const& slot = chan.slots[key];
+      if (slot.known && (slot.updates == 0 || slot.updated < limit)) {
+        append(rcid, key, now, entries, names);
+      }
+    }
+  }
+}
@@ -0,0 +1,101 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "RecorderSchema.h"
+#include "RecorderTypes.h"
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Last-value cache kept by the sink. Each recorder has a flat array of
+// slots indexed by item key, so updating the cache with a DATA batch
+// is a plain copy per item. The cache is owned and accessed by a single
+// thread (the sink poller) and therefore needs no locking.
+class RecorderCache {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  RecorderCache() = default;
+  RecorderCache(RecorderCache const&) = delete;
+  RecorderCache& operator=(RecorderCache const&) = delete;
+
+  // Names are interned by the schema registry and must outlive the
+  // cache.
+  void addRecorder(InitRecorder const& init,
+                   RecorderSchema::Schema const& schema);
+  void addItem(InitItem const& init, char const* name);
+
+  // Store the last value of each item in the batch.
+  void update(int16_t recorder_id,
+              Item const* items,
+              size_t num_items,
+              Clock::time_point now);
+
+  // Queries, matching entries are appended to entries and their
+  // "recorder/item" names to names ('\0' separated).
+  void lookup(QueryKey const* keys,
+              size_t num_keys,
+              Clock::time_point now,
+              std::vector<CacheEntry>* entries,
+              std::string* names) const;
+
+  void prefix(std::string const& recorder_prefix,
+              std::string const& item_prefix,
+              Clock::time_point now,
+              std::vector<CacheEntry>* entries,
+              std::string* names) const;
+
+  // Items set up or updated but not updated within max_age.
+  void stale(std::chrono::milliseconds max_age,
+             Clock::time_point now,
+             std::vector<CacheEntry>* entries,
+             std::string* names) const;
+
+ private:
+  struct Slot {
+    Item    item;
+    int64_t updated;  // Clock time in microseconds
+    int32_t updates;
+    bool    known;    // Set up or updated at least once
+  };
+
+  struct Channel {
+    std::string name;
+    std::vector<Slot> slots;
+    std::vector<char const*> item_names;
+  };
+
+  Channel* channel(int16_t recorder_id, size_t num_items);
+  void append(int16_t recorder_id,
+              size_t key,
+              Clock::time_point now,
+              std::vector<CacheEntry>* entries,
+              std::string* names) const;
+
+  std::vector<Channel> recorders_;
+};
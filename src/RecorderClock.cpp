@@ -0,0 +1,168 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+
+#include "RecorderClock.h"
+
+#include <algorithm>
+#include <cmath>
+
+RecorderClock::Config::Config()
+    : interval(std::chrono::seconds(1))
+    , window(16)
+    , correct(true)
+    , time_unit_usec(1.0) {}
+
+RecorderClock::RecorderClock(Config const& config)
+    : config_(config) {}
+
+void
+RecorderClock::add(ClockSync const& echo,
+                   int64_t t4,
+                   int16_t const* recorders,
+                   size_t num_recorders) {
+  auto it = std::find_if(
+      processes_.begin(), processes_.end(),
+      [&echo](Process const& process) {
+        return process.token == echo.process;
+      });
+  if (it == processes_.end()) {
+    Process process;
+    process.token = echo.process;
+    process.next = 0;
+    process.count = 0;
+    process.time = t4;
+    process.offset = 0.0;
+    process.drift = 0.0;
+    process.delay = 0;
+    it = processes_.insert(processes_.end(), process);
+  }
+  auto const index = static_cast<int>(it - processes_.begin());
+
+  Sample sample;
+  sample.time = t4;
+  sample.offset = ((echo.t2 - echo.t1) + (echo.t3 - t4)) / 2.0;
+  sample.delay = std::max<int64_t>(0, (t4 - echo.t1) - (echo.t3 - echo.t2));
+  auto& samples = it->samples;
+  if (samples.size() < std::max<size_t>(config_.window, 1)) {
+    samples.push_back(sample);
+  } else {
+    samples[it->next] = sample;
+    it->next = (it->next + 1) % samples.size();
+  }
+  ++it->count;
+  fit(&*it);
+
+  for (size_t i = 0; i < num_recorders; ++i) {
+    auto const id = recorders[i];
+    if (id < 0) {
+      continue;
+    }
+    if (static_cast<size_t>(id) >= recorder_process_.size()) {
+      recorder_process_.resize(id + 1, -1);
+    }
+    recorder_process_[id] = index;
+  }
+}
+
+void
+RecorderClock::fit(Process* process) {
+  // The half of the window with the least delay.
+  fit_ = process->samples;
+  std::sort(fit_.begin(), fit_.end(),
+            [](Sample const& a, Sample const& b) {
+              return a.delay < b.delay;
+            });
+  fit_.resize((fit_.size() + 1) / 2);
+
+  // Times relative to the latest sample, doubles can not hold
+  // microseconds since epoch exactly.
+  int64_t latest = fit_[0].time;
+  for (auto const& sample : fit_) {
+    latest = std::max(latest, sample.time);
+  }
+  double mean_time = 0.0;
+  double mean_offset = 0.0;
+  for (auto const& sample : fit_) {
+    mean_time += sample.time - latest;
+    mean_offset += sample.offset;
+  }
+  mean_time /= fit_.size();
+  mean_offset /= fit_.size();
+
+  // The drift needs a few samples apart in time.
+  double drift = 0.0;
+  if (fit_.size() >= 4) {
+    double sxx = 0.0;
+    double sxy = 0.0;
+    for (auto const& sample : fit_) {
+      double const dt = sample.time - latest - mean_time;
+      sxx += dt * dt;
+      sxy += dt * (sample.offset - mean_offset);
+    }
+    drift = sxx > 0.0 ? sxy / sxx : 0.0;
+  }
+  process->time = latest + static_cast<int64_t>(std::llround(mean_time));
+  process->offset = mean_offset;
+  process->drift = drift;
+  process->delay = fit_[0].delay;
+}
+
+int32_t
+RecorderClock::correction(int16_t recorder_id, int64_t now) const {
+  if (recorder_id < 0 ||
+      static_cast<size_t>(recorder_id) >= recorder_process_.size() ||
+      recorder_process_[recorder_id] < 0) {
+    return 0;
+  }
+  auto const& process = processes_[recorder_process_[recorder_id]];
+  auto const offset =
+      process.offset + process.drift * (now - process.time);
+  return static_cast<int32_t>(std::llround(offset / config_.time_unit_usec));
+}
+
+std::vector<RecorderClock::Estimate>
+RecorderClock::estimates() const {
+  std::vector<Estimate> estimates;
+  for (auto const& process : processes_) {
+    Estimate estimate;
+    estimate.process = process.token;
+    auto const latest = std::max_element(
+        process.samples.begin(), process.samples.end(),
+        [](Sample const& a, Sample const& b) { return a.time < b.time; });
+    estimate.offset_usec =
+        process.offset + process.drift * (latest->time - process.time);
+    estimate.drift_ppm = process.drift * 1e6;
+    estimate.delay_usec = process.delay;
+    estimate.samples = process.count;
+    estimate.recorders = 0;
+    estimates.push_back(estimate);
+  }
+  for (auto const index : recorder_process_) {
+    if (index >= 0) {
+      ++estimates[index].recorders;
+    }
+  }
+  return estimates;
+}
@@ -0,0 +1,110 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+
+#pragma once
+
+#include "RecorderTypes.h"
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Clock offset and drift of the producer processes relative to the
+// sink, estimated from the probe and echo exchange of ClockSync. Each
+// echo is a sample of the offset (producer minus sink clock), assuming a
+// symmetric path, and of the round trip delay:
+//
+//   offset = ((t2 - t1) + (t3 - t4)) / 2
+//   delay  = (t4 - t1) - (t3 - t2)
+//
+// Queueing only adds delay, so of the last window samples of a process
+// the half with the least delay is kept and a line fitted through them,
+// giving the offset at any sink time and the drift. The estimate of a
+// process applies to the recorders listed in its last echo. Owned by a
+// single thread (the sink decode stage), not thread safe.
+class RecorderClock {
+ public:
+  RecorderClock(RecorderClock const&) = delete;
+  RecorderClock& operator=(RecorderClock const&) = delete;
+
+  struct Config {
+    Config();
+    std::chrono::milliseconds interval;  // Between probes
+    size_t window;          // Samples per estimate
+    bool   correct;         // Correct item times on ingest
+    double time_unit_usec;  // Microseconds per unit of the item time
+  };
+
+  struct Estimate {
+    int32_t process;
+    double  offset_usec;  // At the last sample
+    double  drift_ppm;
+    int64_t delay_usec;   // Least round trip delay of the window
+    int64_t samples;
+    size_t  recorders;
+  };
+
+  explicit RecorderClock(Config const& config);
+
+  Config const& config() const { return config_; }
+
+  // The echo of a probe, received by the sink at t4. The recorders are
+  // those of the echoing process.
+  void add(ClockSync const& echo,
+           int64_t t4,
+           int16_t const* recorders,
+           size_t num_recorders);
+
+  // Correction of the item time of a recorder at sink time now, in the
+  // unit of the item time, to subtract. Zero without an estimate.
+  int32_t correction(int16_t recorder_id, int64_t now) const;
+
+  std::vector<Estimate> estimates() const;
+
+ private:
+  struct Sample {
+    int64_t time;  // Sink receive time
+    double  offset;
+    int64_t delay;
+  };
+
+  struct Process {
+    int32_t token;
+    std::vector<Sample> samples;  // Ring of the last window samples
+    size_t  next;
+    int64_t count;
+    int64_t time;    // Sink time of the fitted offset
+    double  offset;
+    double  drift;   // Microseconds per microsecond
+    int64_t delay;
+  };
+
+  void fit(Process* process);
+
+  Config const config_;
+  std::vector<Process> processes_;
+  std::vector<int> recorder_process_;  // By recorder id, -1 if none
+  std::vector<Sample> fit_;
+};
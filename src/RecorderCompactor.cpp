@@ -0,0 +1,917 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#include "RecorderCompactor.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace {
+// A task of the pool, cost orders the tasks, largest first.
+struct Task {
+  size_t cost;
+  std::function<void()> run;
+};
+
+// Run tasks on num_threads threads. Tasks are dealt round robin to a
+// deque per thread, each thread takes the largest task of its own deque
+// and when empty steals the smallest from the other threads, so that a
+// few large tasks (recorders) do not leave the other threads idle.
+void
+runTasks(std::vector<Task> tasks, int num_threads) {
+  std::sort(tasks.begin(), tasks.end(),
+            [](Task const& a, Task const& b) { return a.cost > b.cost; });
+  auto const n = std::min<size_t>(std::max(num_threads, 1), tasks.size());
+  if (n <= 1) {
+    for (auto const& task : tasks) {
+      task.run();
+    }
+    return;
+  }
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task const*> tasks;  // Ascending cost
+  };
+  std::vector<std::unique_ptr<Queue> > queues;
+  for (size_t i = 0; i < n; ++i) {
+    queues.emplace_back(new Queue);
+  }
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    queues[i % n]->tasks.push_front(&tasks[i]);
+  }
+
+  auto const worker = [&queues, n](size_t self) {
+    for (;;) {
+      Task const* task = nullptr;
+      {
+        auto& queue = *queues[self];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+          task = queue.tasks.back();
+          queue.tasks.pop_back();
+        }
+      }
+      for (size_t i = 1; task == nullptr && i < n; ++i) {
+        auto& victim = *queues[(self + i) % n];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+          task = victim.tasks.front();
+          victim.tasks.pop_front();
+        }
+      }
+      if (task == nullptr) {
+        return;
+      }
+      task->run();
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < n; ++i) {
+    threads.emplace_back(worker, i);
+  }
+  worker(0);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+// Append a record to out.
+void
+appendRecord(std::vector<char>* out,
+             RecordType type,
+             int16_t recorder_id,
+             void const* payload,
+             size_t size) {
+  RecordHeader const header = {
+    RECORD_MAGIC,
+    static_cast<uint32_t>(size),
+    crc32c(payload, size),
+    type,
+    recorder_id };
+  auto const offset = out->size();
+  out->resize(offset + recordSize(size), 0);
+  std::memcpy(out->data() + offset, &header, sizeof(header));
+  std::memcpy(out->data() + offset + sizeof(header), payload, size);
+}
+
+bool
+writeAll(int fd, char const* data, size_t size, int64_t offset) {
+  while (size > 0) {
+    auto const rval = pwrite(fd, data, size, offset);
+    if (rval < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Compacted segment write");
+      return false;
+    }
+    data += rval;
+    size -= rval;
+    offset += rval;
+  }
+  return true;
+}
+
+bool
+syncDirectory(std::string const& directory) {
+  int const fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0 || fsync(fd) != 0) {
+    perror(directory.c_str());
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+// Read only mapping of a file, empty if the file can not be mapped.
+struct Mapping {
+  Mapping(Mapping const&) = delete;
+  Mapping& operator=(Mapping const&) = delete;
+
+  explicit Mapping(std::string const& path) : data(nullptr), size(0) {
+    int const fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      perror(path.c_str());
+    } else if (st.st_size > 0) {
+      void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED) {
+        perror(path.c_str());
+      } else {
+        data = static_cast<char const*>(map);
+        size = st.st_size;
+      }
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  ~Mapping() {
+    if (data != nullptr) {
+      munmap(const_cast<char*>(data), size);
+    }
+  }
+
+  char const* data;
+  size_t size;
+};
+
+// True if the storage holds the segment locked, it is still written or
+// its writes may be in flight (see RecorderStorage).
+bool
+locked(std::string const& path) {
+  int const fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  bool const busy = flock(fd, LOCK_SH | LOCK_NB) != 0 && errno == EWOULDBLOCK;
+  close(fd);
+  return busy;
+}
+
+// The record at offset of a mapping, nullptr at the end or if the
+// record is incomplete. Sets the payload.
+RecordHeader const*
+recordAt(Mapping const& map, size_t offset, char const** payload) {
+  if (offset + sizeof(RecordHeader) > map.size) {
+    return nullptr;
+  }
+  auto const* header =
+      reinterpret_cast<RecordHeader const*>(map.data + offset);
+  if (header->magic != RECORD_MAGIC ||
+      offset + recordSize(header->size) > map.size) {
+    return nullptr;
+  }
+  *payload = map.data + offset + sizeof(RecordHeader);
+  return header;
+}
+
+// Identity of a recorder, ids are reused by another sink run.
+bool
+sameRecorder(InitRecorder const& a, InitRecorder const& b) {
+  return a.external_id == b.external_id &&
+      std::strncmp(a.recorder_name, b.recorder_name,
+                   sizeof(a.recorder_name)) == 0;
+}
+}  // namespace
+
+
+// Items of a recorder in an input segment, the items of a DATA record
+// or frame section.
+struct RecorderCompactor::Extent {
+  Item const* items;
+  size_t num_items;  // Slots if var
+  bool var;
+};
+
+struct RecorderCompactor::Segment {
+  Segment(std::string const& path, uint32_t sequence)
+      : map(path)
+      , num_items(0)
+      , truncated(false) {
+    std::memset(&info, 0, sizeof(info));
+    info.sequence = sequence;
+  }
+
+  Mapping map;
+  SegmentInfo info;
+  std::map<int16_t, InitRecorder> recorders;
+  std::map<std::pair<int16_t, int16_t>, InitItem> items;
+  std::map<int16_t, std::vector<Extent> > extents;
+  std::map<int16_t, int64_t> recorder_items;
+  int64_t num_items;
+  bool truncated;
+};
+
+// The compacted segment being written. Chunks are appended by the
+// compacting threads at offsets taken from offset.
+struct RecorderCompactor::Output {
+  Output() : fd(-1), offset(0), items(0), chunks(0), failed(false) {}
+
+  int fd;
+  std::atomic<int64_t> offset;
+  std::atomic<int64_t> items;
+  std::atomic<int64_t> chunks;
+  std::atomic<bool> failed;
+  std::mutex mutex;
+  std::vector<IndexEntry> index;
+};
+
+
+// Compactor
+// ----------------------------------------------------------------------------
+RecorderCompactor::Config::Config()
+    : directory(".")
+    , num_threads(std::max(1u, std::thread::hardware_concurrency()))
+    , chunk_items(1 << 16)
+    , memory(64 << 20)
+    , run_size(size_t(16) << 30) {
+}
+
+RecorderCompactor::RecorderCompactor(Config const& config)
+    : config_(config) {
+  std::memset(&stats_, 0, sizeof(stats_));
+}
+
+RecorderCompactor::~RecorderCompactor() {
+}
+
+std::string
+RecorderCompactor::path(uint32_t sequence) const {
+  return config_.directory + "/" + segmentName(sequence);
+}
+
+bool
+RecorderCompactor::run() {
+  recover();
+  if (segments_.empty()) {
+    return true;
+  }
+
+  // The newest segment may still be written, as may older segments the
+  // storage still holds locked. Compacted and incomplete segments are
+  // skipped (second).
+  std::vector<std::pair<uint32_t, bool> > candidates(segments_.begin(),
+                                                     segments_.end());
+  candidates.pop_back();
+  for (size_t k = 0; k < candidates.size(); ++k) {
+    if (locked(path(candidates[k].first))) {
+      std::fprintf(stderr, "Segment %u still written, not compacted\n",
+                   candidates[k].first);
+      candidates.resize(k);
+      break;
+    }
+  }
+
+  size_t i = 0;
+  while (i < candidates.size()) {
+    if (candidates[i].second) {
+      ++i;
+      continue;
+    }
+    // Consecutive segments up to the run size, a compacted segment
+    // ends the run.
+    std::vector<std::unique_ptr<Segment> > segments;
+    size_t run_size = 0;
+    while (i < candidates.size() && !candidates[i].second &&
+           (segments.empty() || run_size < config_.run_size)) {
+      auto const sequence = candidates[i].first;
+      segments.emplace_back(new Segment(path(sequence), sequence));
+      run_size += segments.back()->map.size;
+      ++i;
+    }
+
+    std::vector<Task> tasks;
+    std::atomic<bool> scanned(true);
+    for (auto const& segment : segments) {
+      auto* s = segment.get();
+      tasks.push_back(Task{ s->map.size, [this, s, &scanned]() {
+            if (!scan(s)) {
+              scanned = false;
+            }
+          } });
+    }
+    runTasks(std::move(tasks), config_.num_threads);
+    if (!scanned) {
+      return false;
+    }
+
+    // An incomplete segment ends the run and is kept as it is, its tail
+    // may still be recovered.
+    size_t const start = i - segments.size();
+    for (size_t k = 0; k < segments.size(); ++k) {
+      if (segments[k]->truncated) {
+        candidates[start + k].second = true;
+        ++stats_.truncated;
+        i = start + k;
+        segments.resize(k);
+        break;
+      }
+    }
+    if (segments.empty()) {
+      continue;
+    }
+
+    // A recorder id taken by another recorder ends the run, the rest
+    // is compacted by the next.
+    std::map<int16_t, InitRecorder> recorders;
+    std::vector<Segment*> run;
+    for (auto const& segment : segments) {
+      bool reused = false;
+      for (auto const& recorder : segment->recorders) {
+        auto const it = recorders.find(recorder.first);
+        reused |= it != recorders.end() &&
+            !sameRecorder(it->second, recorder.second);
+      }
+      if (reused) {
+        i -= segments.size() - run.size();
+        break;
+      }
+      for (auto const& recorder : segment->recorders) {
+        recorders.erase(recorder.first);
+        recorders.insert(recorder);
+      }
+      run.push_back(segment.get());
+    }
+
+    if (!compact(run)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Remove temporary files and the segments replaced by an interrupted
+// swap, and list the segments.
+void
+RecorderCompactor::recover() {
+  segments_.clear();
+  DIR* dir = opendir(config_.directory.c_str());
+  if (dir == nullptr) {
+    perror(config_.directory.c_str());
+    return;
+  }
+  std::vector<std::string> temporary;
+  while (dirent* entry = readdir(dir)) {
+    uint32_t sequence;
+    if (parseSegmentName(entry->d_name, &sequence)) {
+      segments_[sequence] = false;
+    } else if (std::strncmp(entry->d_name, "compact_", 8) == 0) {
+      temporary.push_back(entry->d_name);
+    }
+  }
+  closedir(dir);
+  for (auto const& name : temporary) {
+    unlink((config_.directory + "/" + name).c_str());
+  }
+
+  std::vector<uint32_t> replaced;
+  for (auto& segment : segments_) {
+    Mapping const map(path(segment.first));
+    char const* payload = nullptr;
+    auto const* header = recordAt(map, 0, &payload);
+    if (header == nullptr ||
+        header->type != RecordType::SEGMENT ||
+        header->size != sizeof(SegmentInfo) ||
+        header->checksum != crc32c(payload, header->size)) {
+      continue;
+    }
+    auto const* info = reinterpret_cast<SegmentInfo const*>(payload);
+    if (info->flags & SEGMENT_COMPACTED) {
+      segment.second = true;
+      for (auto it = segments_.upper_bound(segment.first);
+           it != segments_.end() && it->first <= info->last_sequence;
+           ++it) {
+        replaced.push_back(it->first);
+      }
+    }
+  }
+  for (auto const sequence : replaced) {
+    if (segments_.erase(sequence) > 0) {
+      std::fprintf(stderr, "Removing replaced %s\n", path(sequence).c_str());
+      unlink(path(sequence).c_str());
+    }
+  }
+  if (!temporary.empty() || !replaced.empty()) {
+    syncDirectory(config_.directory);
+  }
+}
+
+// Index the items of a segment by recorder and verify the checksums.
+// The segment ends at the first incomplete record, it is truncated if
+// that is not the end of the file.
+bool
+RecorderCompactor::scan(Segment* segment) {
+  auto const& map = segment->map;
+  size_t offset = 0;
+  char const* payload = nullptr;
+  while (auto const* header = recordAt(map, offset, &payload)) {
+    auto const size = header->size;
+    auto const recorder_id = header->recorder_id;
+    if (header->checksum != crc32c(payload, size)) {
+      std::fprintf(stderr, "Checksum mismatch at offset %lu of segment %u\n",
+                   offset, segment->info.sequence);
+      return false;
+    }
+    offset += recordSize(size);
+
+    bool valid = true;
+    switch (header->type) {
+      case RecordType::SEGMENT:
+        valid = size == sizeof(SegmentInfo);
+        if (valid) {
+          std::memcpy(&segment->info, payload, size);
+        }
+        break;;
+      case RecordType::RECORDER: {
+        valid = size == sizeof(InitRecorder);
+        if (valid) {
+          auto const& init = *reinterpret_cast<InitRecorder const*>(payload);
+          segment->recorders.erase(recorder_id);
+          segment->recorders.insert(std::make_pair(recorder_id, init));
+        }
+      } break;;
+      case RecordType::ITEM: {
+        valid = size == sizeof(InitItem);
+        if (valid) {
+          auto const& init = *reinterpret_cast<InitItem const*>(payload);
+          auto const key = std::make_pair(init.recorder_id, init.key);
+          segment->items.erase(key);
+          segment->items.insert(std::make_pair(key, init));
+        }
+      } break;;
+      case RecordType::DATA:
+      case RecordType::VARDATA: {
+        auto const* items = reinterpret_cast<Item const*>(payload);
+        auto const num_slots = size / sizeof(Item);
+        bool const var = header->type == RecordType::VARDATA;
+        int64_t const count = var ?
+            varItemCount(items, num_slots) : static_cast<int64_t>(num_slots);
+        valid = size % sizeof(Item) == 0 && count >= 0;
+        if (valid) {
+          segment->extents[recorder_id].push_back(
+              Extent{ items, num_slots, var });
+          segment->recorder_items[recorder_id] += count;
+          segment->num_items += count;
+        }
+      } break;;
+      case RecordType::FRAME: {
+        auto const* frame = reinterpret_cast<FrameHeader const*>(payload);
+        auto const* sections =
+            reinterpret_cast<FrameSection const*>(frame + 1);
+        valid = size >= sizeof(FrameHeader) &&
+            frame->num_sections >= 0 && frame->num_items >= 0 &&
+            size == sizeof(FrameHeader) +
+            frame->num_sections * sizeof(FrameSection) +
+            frame->num_items * sizeof(Item);
+        auto const* items =
+            reinterpret_cast<Item const*>(sections + frame->num_sections);
+        int32_t remaining = frame->num_items;
+        for (int32_t i = 0; valid && i < frame->num_sections; ++i) {
+          auto const& section = sections[i];
+          bool const var = section.flags & FRAME_SECTION_VAR;
+          valid = section.num_items >= 0 && section.num_items <= remaining;
+          if (!valid) {
+            break;
+          }
+          remaining -= section.num_items;
+          auto const count = var ?
+              varItemCount(items, section.num_items) : section.num_items;
+          valid = count >= 0;
+          segment->extents[section.recorder_id].push_back(
+              Extent{ items, static_cast<size_t>(section.num_items), var });
+          segment->recorder_items[section.recorder_id] += count;
+          segment->num_items += count;
+          items += section.num_items;
+        }
+      } break;;
+      default:
+        break;;
+    }
+    if (!valid) {
+      std::fprintf(stderr, "Malformed record at offset %lu of segment %u\n",
+                   offset - recordSize(size), segment->info.sequence);
+      return false;
+    }
+  }
+  if (offset < map.size) {
+    segment->truncated = true;
+    std::fprintf(stderr, "Segment %u incomplete, %lu bytes unreadable, "
+                 "not compacted\n",
+                 segment->info.sequence, map.size - offset);
+  }
+  return true;
+}
+
+bool
+RecorderCompactor::compact(std::vector<Segment*> const& run) {
+  auto const& first = run.front()->info;
+  auto const& last = run.back()->info;
+  char name[32];
+  std::snprintf(name, sizeof(name), "compact_%06u.tmp", first.sequence);
+  std::string const tmp_path = config_.directory + "/" + name;
+
+  Output output;
+  output.fd = open(tmp_path.c_str(),
+                   O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (output.fd < 0) {
+    perror(tmp_path.c_str());
+    return false;
+  }
+
+  // Set ups of the run, the latest of each recorder and item.
+  std::map<int16_t, InitRecorder> recorders;
+  std::map<std::pair<int16_t, int16_t>, InitItem> items;
+  std::map<int16_t, int64_t> recorder_items;
+  int64_t num_items = 0;
+  for (auto const* segment : run) {
+    for (auto const& recorder : segment->recorders) {
+      recorders.erase(recorder.first);
+      recorders.insert(recorder);
+    }
+    for (auto const& item : segment->items) {
+      items.erase(item.first);
+      items.insert(item);
+    }
+    for (auto const& count : segment->recorder_items) {
+      recorder_items[count.first] += count.second;
+    }
+    num_items += segment->num_items;
+    stats_.bytes_in += segment->map.size;
+  }
+
+  SegmentInfo info;
+  std::memset(&info, 0, sizeof(info));
+  info.version = SEGMENT_VERSION;
+  info.sequence = first.sequence;
+  info.last_sequence = last.sequence;
+  info.created = first.created;
+  info.flags = SEGMENT_COMPACTED;
+  std::vector<char> head;
+  appendRecord(&head, RecordType::SEGMENT, -1, &info, sizeof(info));
+  for (auto const& recorder : recorders) {
+    appendRecord(&head, RecordType::RECORDER, recorder.first,
+                 &recorder.second, sizeof(recorder.second));
+  }
+  for (auto const& item : items) {
+    appendRecord(&head, RecordType::ITEM, item.second.recorder_id,
+                 &item.second, sizeof(item.second));
+  }
+  output.offset = head.size();
+  output.failed = !writeAll(output.fd, head.data(), head.size(), 0);
+
+  std::vector<Task> tasks;
+  for (auto const& count : recorder_items) {
+    auto const recorder_id = count.first;
+    tasks.push_back(Task{ static_cast<size_t>(count.second),
+          [this, recorder_id, &run, &output]() {
+            compactRecorder(recorder_id, run, &output);
+          } });
+  }
+  runTasks(std::move(tasks), config_.num_threads);
+
+  // Index at the end, the segment info written last points to it.
+  auto& index = output.index;
+  std::sort(index.begin(), index.end(),
+            [](IndexEntry const& a, IndexEntry const& b) {
+              return a.recorder_id != b.recorder_id ?
+                  a.recorder_id < b.recorder_id :
+                  a.key != b.key ? a.key < b.key :
+                  a.first_time < b.first_time;
+            });
+  std::vector<char> tail;
+  appendRecord(&tail, RecordType::INDEX, -1,
+               index.data(), index.size() * sizeof(IndexEntry));
+  info.index_offset = output.offset;
+  head.clear();
+  appendRecord(&head, RecordType::SEGMENT, -1, &info, sizeof(info));
+
+  bool ok = !output.failed &&
+      writeAll(output.fd, tail.data(), tail.size(), info.index_offset) &&
+      writeAll(output.fd, head.data(), head.size(), 0);
+  if (ok && fsync(output.fd) != 0) {
+    perror(tmp_path.c_str());
+    ok = false;
+  }
+  close(output.fd);
+
+  ok = ok && verify(tmp_path, num_items) && swap(tmp_path, run);
+  if (!ok) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  stats_.segments += run.size();
+  stats_.compacted += 1;
+  stats_.items += output.items;
+  stats_.chunks += output.chunks;
+  stats_.bytes_out += info.index_offset + tail.size();
+  return true;
+}
+
+// Items are buffered per key and written as a chunk when the key has
+// chunk_items items, or the largest buffer when the memory budget is
+// exceeded.
+void
+RecorderCompactor::compactRecorder(int16_t recorder_id,
+                                   std::vector<Segment*> const& run,
+                                   Output* output) {
+  struct Buffer {
+    Buffer() : num_var(0) {}
+    std::vector<Item> items;
+    std::vector<Item> slots;  // Var items
+    size_t num_var;
+    size_t bytes() const {
+      return (items.size() + slots.size()) * sizeof(Item);
+    }
+  };
+  std::vector<Buffer> buffers;
+  size_t buffered = 0;
+  std::vector<IndexEntry> index;
+  std::vector<char> payload;
+  std::vector<char> record;
+  std::vector<Item> slots;
+  std::vector<std::pair<int32_t, size_t> > order;
+  int64_t num_items = 0;
+
+  auto const write = [&](int16_t key,
+                         ChunkHeader const& chunk) {
+    std::memcpy(payload.data(), &chunk, sizeof(chunk));
+    record.clear();
+    appendRecord(&record, RecordType::CHUNK, recorder_id,
+                 payload.data(), payload.size());
+    auto const offset = output->offset.fetch_add(record.size());
+    if (!writeAll(output->fd, record.data(), record.size(), offset)) {
+      output->failed = true;
+    }
+    index.push_back(IndexEntry{ recorder_id, key, chunk.num_items,
+          chunk.first_time, chunk.last_time, offset, 0 });
+    num_items += chunk.num_items;
+  };
+
+  auto const flush = [&](int16_t key) {
+    auto& buffer = buffers[static_cast<uint16_t>(key)];
+    buffered -= buffer.bytes();
+    ChunkHeader chunk;
+    std::memset(&chunk, 0, sizeof(chunk));
+    chunk.key = key;
+    if (!buffer.items.empty()) {
+      auto& items = buffer.items;
+      std::stable_sort(items.begin(), items.end(),
+                       [](Item const& a, Item const& b) {
+                         return a.time < b.time;
+                       });
+      payload.resize(sizeof(chunk));
+      encodeItems(items.data(), items.size(), &payload);
+      chunk.codec = ChunkCodec::DELTA;
+      chunk.num_items = items.size();
+      chunk.first_time = items.front().time;
+      chunk.last_time = items.back().time;
+      chunk.raw_size = items.size() * sizeof(Item);
+      write(key, chunk);
+      items.clear();
+    }
+    if (buffer.num_var > 0) {
+      // Sorted by time, whole items.
+      order.clear();
+      for (size_t i = 0; i < buffer.slots.size();) {
+        auto const* var = reinterpret_cast<VarItem const*>(&buffer.slots[i]);
+        order.emplace_back(var->time, i);
+        i += varItemSlots(var->type, var->length);
+      }
+      std::stable_sort(order.begin(), order.end(),
+                       [](std::pair<int32_t, size_t> const& a,
+                          std::pair<int32_t, size_t> const& b) {
+                         return a.first < b.first;
+                       });
+      payload.resize(sizeof(chunk));
+      for (auto const& entry : order) {
+        auto const* begin = &buffer.slots[entry.second];
+        auto const* var = reinterpret_cast<VarItem const*>(begin);
+        auto const* bytes = reinterpret_cast<char const*>(begin);
+        auto const size = varItemSlots(var->type, var->length) * sizeof(Item);
+        payload.insert(payload.end(), bytes, bytes + size);
+      }
+      chunk.codec = ChunkCodec::RAW;
+      chunk.flags = CHUNK_VAR;
+      chunk.num_items = buffer.num_var;
+      chunk.first_time = order.front().first;
+      chunk.last_time = order.back().first;
+      chunk.raw_size = buffer.slots.size() * sizeof(Item);
+      write(key, chunk);
+      buffer.slots.clear();
+      buffer.num_var = 0;
+    }
+  };
+
+  auto const add = [&](int16_t key) -> Buffer& {
+    auto const index = static_cast<uint16_t>(key);
+    if (index >= buffers.size()) {
+      buffers.resize(index + 1);
+    }
+    return buffers[index];
+  };
+
+  auto const limit = [&](int16_t key, size_t count) {
+    if (count >= config_.chunk_items) {
+      flush(key);
+    }
+    if (buffered > config_.memory) {
+      size_t largest = 0;
+      for (size_t i = 1; i < buffers.size(); ++i) {
+        if (buffers[i].bytes() > buffers[largest].bytes()) {
+          largest = i;
+        }
+      }
+      flush(static_cast<int16_t>(largest));
+    }
+  };
+
+  for (auto const* segment : run) {
+    auto const it = segment->extents.find(recorder_id);
+    if (it == segment->extents.end()) {
+      continue;
+    }
+    for (auto const& extent : it->second) {
+      if (!extent.var) {
+        for (size_t i = 0; i < extent.num_items; ++i) {
+          auto const& item = extent.items[i];
+          auto& buffer = add(item.key);
+          buffer.items.push_back(item);
+          buffered += sizeof(Item);
+          limit(item.key, buffer.items.size());
+        }
+        continue;
+      }
+      for (size_t i = 0; i < extent.num_items;) {
+        auto const* var = reinterpret_cast<VarItem const*>(extent.items + i);
+        auto const n = varItemSlots(var->type, var->length);
+        auto& buffer = add(var->key);
+        buffer.slots.insert(buffer.slots.end(),
+                            extent.items + i, extent.items + i + n);
+        buffer.num_var += 1;
+        buffered += n * sizeof(Item);
+        i += n;
+        limit(var->key, buffer.num_var);
+      }
+    }
+  }
+  for (size_t i = 0; i < buffers.size(); ++i) {
+    flush(static_cast<int16_t>(i));
+  }
+
+  output->items += num_items;
+  output->chunks += index.size();
+  std::lock_guard<std::mutex> lock(output->mutex);
+  output->index.insert(output->index.end(), index.begin(), index.end());
+}
+
+// Decode the compacted segment, in parallel by chunk.
+bool
+RecorderCompactor::verify(std::string const& path, int64_t num_items) {
+  Mapping const map(path);
+  std::vector<std::pair<RecordHeader const*, char const*> > chunks;
+  size_t offset = 0;
+  size_t num_index = 0;
+  char const* payload = nullptr;
+  bool valid = true;
+  while (auto const* header = recordAt(map, offset, &payload)) {
+    offset += recordSize(header->size);
+    if (header->type == RecordType::CHUNK) {
+      chunks.emplace_back(header, payload);
+      continue;
+    }
+    if (header->type == RecordType::INDEX) {
+      num_index = header->size / sizeof(IndexEntry);
+    }
+    valid &= header->checksum == crc32c(payload, header->size);
+  }
+  valid &= offset == map.size && num_index == chunks.size();
+
+  std::atomic<int64_t> decoded(0);
+  std::atomic<bool> chunks_valid(true);
+  std::vector<Task> tasks;
+  for (auto const& chunk : chunks) {
+    auto const* header = chunk.first;
+    auto const* data = chunk.second;
+    tasks.push_back(Task{ header->size, [header, data, &decoded,
+                                         &chunks_valid]() {
+          ChunkHeader chunk;
+          if (header->size < sizeof(chunk) ||
+              header->checksum != crc32c(data, header->size)) {
+            chunks_valid = false;
+            return;
+          }
+          std::memcpy(&chunk, data, sizeof(chunk));
+          auto const size = header->size - sizeof(chunk);
+          auto const* items = data + sizeof(chunk);
+          bool ok = chunk.num_items > 0;
+          if (ok && chunk.codec == ChunkCodec::DELTA) {
+            std::vector<Item> decoded_items(chunk.num_items);
+            ok = decodeItems(items, size, chunk.key, chunk.num_items,
+                             decoded_items.data()) &&
+                decoded_items.front().time == chunk.first_time &&
+                decoded_items.back().time == chunk.last_time;
+          } else if (ok) {
+            ok = size == chunk.raw_size &&
+                varItemCount(reinterpret_cast<Item const*>(items),
+                             size / sizeof(Item)) == chunk.num_items;
+          }
+          if (!ok) {
+            chunks_valid = false;
+          }
+          decoded += chunk.num_items;
+        } });
+  }
+  runTasks(std::move(tasks), config_.num_threads);
+
+  if (!valid || !chunks_valid || decoded != num_items) {
+    std::fprintf(stderr, "Compacted segment %s invalid, %ld of %ld items\n",
+                 path.c_str(), decoded.load(), num_items);
+    return false;
+  }
+  return true;
+}
+
+// Replace the first segment of the run, then remove the rest.
+bool
+RecorderCompactor::swap(std::string const& tmp_path,
+                        std::vector<Segment*> const& run) {
+  auto const first = run.front()->info.sequence;
+  if (std::rename(tmp_path.c_str(), path(first).c_str()) != 0) {
+    perror(path(first).c_str());
+    return false;
+  }
+  if (!syncDirectory(config_.directory)) {
+    return false;
+  }
+  segments_[first] = true;
+  for (size_t i = 1; i < run.size(); ++i) {
+    auto const sequence = run[i]->info.sequence;
+    if (unlink(path(sequence).c_str()) != 0) {
+      perror(path(sequence).c_str());
+    }
+    segments_.erase(sequence);
+  }
+  return syncDirectory(config_.directory);
+}
@@ -0,0 +1,104 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "RecorderFormat.h"
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Offline compaction of recorded segments (see RecorderFormat.h). Runs
+// of consecutive complete segments are replaced by a single compacted
+// segment with the items re-sorted by recorder, key and time into
+// large DELTA encoded chunks, and an index of the chunks. The segments
+// of a run are scanned, and the recorders of the run compacted, on a
+// pool of threads with work stealing. The inputs are memory mapped and
+// the items buffered per recorder within a memory budget, so memory
+// stays bounded however large the run. Input checksums are verified
+// when scanned, and the compacted segment is verified by decoding it
+// back before it atomically replaces the first segment of the run
+// (rename), after which the rest of the run is removed. Segments left
+// over by an interrupted swap are removed on the next run.
+//
+// Only complete segments are ever replaced. Compaction stops at the
+// newest segment and at the first segment the storage still holds
+// locked, whose writes may be in flight (see RecorderStorage). A
+// segment with an incomplete tail, e.g. left by a crash, ends a run
+// and is kept as it is. Not thread safe.
+class RecorderCompactor {
+ public:
+  RecorderCompactor(RecorderCompactor const&) = delete;
+  RecorderCompactor& operator=(RecorderCompactor const&) = delete;
+
+  struct Config {
+    Config();
+    std::string directory;
+    int    num_threads;
+    size_t chunk_items;   // Maximum items per chunk
+    size_t memory;        // Items buffered per thread, in bytes
+    size_t run_size;      // Input bytes per compacted segment
+  };
+
+  struct Stats {
+    int64_t segments;      // Input segments replaced
+    int64_t compacted;     // Compacted segments written
+    int64_t items;
+    int64_t chunks;
+    int64_t bytes_in;
+    int64_t bytes_out;
+    int64_t truncated;     // Incomplete segments kept
+  };
+
+  explicit RecorderCompactor(Config const& config);
+  ~RecorderCompactor();
+
+  // Compact all segments of the directory. Returns false on the first
+  // failed run, which leaves its segments as they were.
+  bool run();
+
+  Stats const& stats() const { return stats_; }
+
+ private:
+  struct Segment;
+  struct Extent;
+  struct Output;
+
+  std::string path(uint32_t sequence) const;
+  void recover();
+  bool scan(Segment* segment);
+  bool compact(std::vector<Segment*> const& run);
+  void compactRecorder(int16_t recorder_id,
+                       std::vector<Segment*> const& run,
+                       Output* output);
+  bool verify(std::string const& path, int64_t num_items);
+  bool swap(std::string const& tmp_path, std::vector<Segment*> const& run);
+
+  Config const config_;
+  Stats stats_;
+  std::map<uint32_t, bool> segments_;  // Compacted by sequence
+};
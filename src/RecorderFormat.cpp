@@ -0,0 +1,252 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#include "RecorderFormat.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace {
+std::array<uint32_t, 256>
+makeCrcTable() {
+  std::array<uint32_t, 256> table;
+  for (uint32_t i = 0; i < table.size(); ++i) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+    }
+    table[i] = crc;
+  }
+  return table;
+}
+
+uint32_t
+crc32cTable(unsigned char const* bytes, size_t size, uint32_t crc) {
+  static std::array<uint32_t, 256> const table = makeCrcTable();
+  for (; size > 0; --size) {
+    crc = (crc >> 8) ^ table[(crc ^ *bytes++) & 0xff];
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+// Built for SSE 4.2 regardless of the compiler flags, only called if
+// the cpu supports it.
+__attribute__((target("sse4.2")))
+uint32_t
+crc32cSse42(unsigned char const* bytes, size_t size, uint32_t crc) {
+  uint64_t crc64 = crc;
+  for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, bytes, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+    bytes += sizeof(word);
+  }
+  crc = static_cast<uint32_t>(crc64);
+  for (; size > 0; --size) {
+    crc = _mm_crc32_u8(crc, *bytes++);
+  }
+  return crc;
+}
+#endif
+
+uint64_t
+zigzag(uint64_t v) {
+  return (v << 1) ^ (0 - (v >> 63));
+}
+
+uint64_t
+unzigzag(uint64_t v) {
+  return (v >> 1) ^ (0 - (v & 1));
+}
+
+void
+putVarint(uint64_t v, std::vector<char>* out) {
+  while (v >= 0x80) {
+    out->push_back(static_cast<char>(v | 0x80));
+    v >>= 7;
+  }
+  out->push_back(static_cast<char>(v));
+}
+
+bool
+getVarint(char const** data, char const* end, uint64_t* v) {
+  *v = 0;
+  for (int shift = 0; shift < 64 && *data < end; shift += 7) {
+    auto const byte = static_cast<unsigned char>(*(*data)++);
+    *v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Number of elements stored by the DELTA codec.
+int
+numElements(ItemType type, int8_t length) {
+  switch (type) {
+    case ItemType::INT:
+    case ItemType::UINT:
+    case ItemType::FLOAT:
+      return std::max(0, std::min<int>(length, 3));
+    case ItemType::STRING:
+      return std::max(0, std::min<int>(length, sizeof(Item::Data::s)));
+    default:
+      return sizeof(Item::Data);
+  }
+}
+}  // namespace
+
+std::string
+segmentName(uint32_t sequence) {
+  char name[32];
+  std::snprintf(name, sizeof(name), "segment_%06u.rec", sequence);
+  return name;
+}
+
+bool
+parseSegmentName(char const* name, uint32_t* sequence) {
+  unsigned int value = 0;
+  int end = 0;
+  if (std::sscanf(name, "segment_%u.rec%n", &value, &end) != 1 ||
+      end == 0 || name[end] != '\0') {
+    return false;
+  }
+  *sequence = value;
+  return segmentName(value) == name;
+}
+
+uint32_t
+crc32c(void const* data, size_t size, uint32_t crc) {
+  auto const* bytes = static_cast<unsigned char const*>(data);
+#if defined(__x86_64__)
+  static bool const sse42 = __builtin_cpu_supports("sse4.2");
+  if (sse42) {
+    return ~crc32cSse42(bytes, size, ~crc);
+  }
+#endif
+  return ~crc32cTable(bytes, size, ~crc);
+}
+
+void
+encodeItems(Item const* items, size_t num_items, std::vector<char>* out) {
+  int64_t time = 0;
+  ItemType type = ItemType::NOTSETUP;
+  int8_t length = 0;
+  uint64_t prev[3] = { 0, 0, 0 };
+  for (size_t i = 0; i < num_items; ++i) {
+    auto const& item = items[i];
+    bool const changed = item.type != type || item.length != length;
+    putVarint(zigzag(item.time - time) << 1 | changed, out);
+    time = item.time;
+    if (changed) {
+      type = item.type;
+      length = item.length;
+      out->push_back(static_cast<char>(type));
+      out->push_back(static_cast<char>(length));
+      std::fill(std::begin(prev), std::end(prev), 0);
+    }
+    auto const n = numElements(type, length);
+    switch (type) {
+      case ItemType::INT:
+      case ItemType::UINT:
+      case ItemType::FLOAT:
+        for (int j = 0; j < n; ++j) {
+          auto const v = item.data.v_u[j];
+          putVarint(type == ItemType::FLOAT ? v ^ prev[j] :
+                    zigzag(v - prev[j]), out);
+          prev[j] = v;
+        }
+        break;;
+      default: {
+        auto const* bytes = reinterpret_cast<char const*>(&item.data);
+        out->insert(out->end(), bytes, bytes + n);
+      } break;;
+    }
+  }
+}
+
+bool
+decodeItems(char const* data,
+            size_t size,
+            int16_t key,
+            size_t num_items,
+            Item* items) {
+  auto const* end = data + size;
+  int64_t time = 0;
+  ItemType type = ItemType::NOTSETUP;
+  int8_t length = 0;
+  uint64_t prev[3] = { 0, 0, 0 };
+  for (size_t i = 0; i < num_items; ++i) {
+    uint64_t v;
+    if (!getVarint(&data, end, &v)) {
+      return false;
+    }
+    time += static_cast<int64_t>(unzigzag(v >> 1));
+    if (v & 1) {
+      if (end - data < 2) {
+        return false;
+      }
+      type = static_cast<ItemType>(*data++);
+      length = static_cast<int8_t>(*data++);
+      std::fill(std::begin(prev), std::end(prev), 0);
+    }
+    auto& item = items[i];
+    std::memset(static_cast<void*>(&item), 0, sizeof(item));
+    item.time = static_cast<int32_t>(time);
+    item.key = key;
+    item.type = type;
+    item.length = length;
+    auto const n = numElements(type, length);
+    switch (type) {
+      case ItemType::INT:
+      case ItemType::UINT:
+      case ItemType::FLOAT:
+        for (int j = 0; j < n; ++j) {
+          if (!getVarint(&data, end, &v)) {
+            return false;
+          }
+          prev[j] = type == ItemType::FLOAT ? v ^ prev[j] :
+              prev[j] + unzigzag(v);
+          item.data.v_u[j] = prev[j];
+        }
+        break;;
+      default:
+        if (end - data < n) {
+          return false;
+        }
+        std::memcpy(&item.data, data, n);
+        data += n;
+        break;;
+    }
+  }
+  return data == end;
+}
@@ -0,0 +1,142 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "RecorderTypes.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// On-disk format of recorded segments. A segment file is a sequence of
+// records, each a RecordHeader followed by its payload padded to
+// RECORD_ALIGNMENT bytes. The first record of a segment is a
+// SegmentInfo. Payloads are the wire structs, InitRecorder, InitItem
+// and arrays of Item for DATA. VARDATA holds whole variable length
+// items, each a VarItem and its element slots. A FRAME record holds a
+// whole frame, the FrameHeader, its FrameSection array and the items of
+// all sections, with recorder id -1 in the header. Readers shall check
+// magic and checksum and stop at the first invalid record, the tail of
+// a segment still being written may be incomplete.
+//
+// Compacted segments (see RecorderCompactor.h) replace a range of
+// segments and hold the items as CHUNK records instead, each a
+// ChunkHeader and the encoded items of a single key sorted by time,
+// followed by an INDEX record of all chunks. The SegmentInfo of a
+// compacted segment has the SEGMENT_COMPACTED flag.
+// ----------------------------------------------------------------------------
+enum class RecordType : int16_t {
+  SEGMENT, RECORDER, ITEM, DATA, PADDING, FRAME, VARDATA, CHUNK, INDEX, };
+
+uint32_t constexpr RECORD_MAGIC = 0x31434552;  // "REC1"
+uint32_t constexpr SEGMENT_VERSION = 1;
+size_t constexpr RECORD_ALIGNMENT = 8;
+
+struct PACKED RecordHeader {
+  uint32_t   magic;
+  uint32_t   size;      // Payload size, excluding padding
+  uint32_t   checksum;  // CRC-32C of the payload
+  RecordType type;
+  int16_t    recorder_id;
+};
+
+enum : uint32_t {
+  SEGMENT_COMPACTED = 1<<0,
+};
+
+struct PACKED SegmentInfo {
+  uint32_t version;
+  uint32_t sequence;
+  int64_t  created;        // Microseconds since epoch
+  uint32_t last_sequence;  // Last segment replaced, if compacted
+  uint32_t flags;
+  int64_t  index_offset;   // File offset of the INDEX record, if compacted
+  char     reserved[32];
+};
+
+// Items of CHUNK records are either DELTA encoded (see encodeItems())
+// or, for variable length items (CHUNK_VAR), RAW VarItem slots.
+enum class ChunkCodec : int8_t { RAW, DELTA, };
+
+enum : int8_t {
+  CHUNK_VAR = 1<<0,
+};
+
+struct PACKED ChunkHeader {
+  int16_t    key;
+  ChunkCodec codec;
+  int8_t     flags;
+  int32_t    num_items;
+  int32_t    first_time;
+  int32_t    last_time;
+  uint32_t   raw_size;   // Size of the decoded items or slots
+  uint32_t   reserved[3];
+};
+
+// Chunks of a compacted segment sorted by recorder id, key and time.
+struct PACKED IndexEntry {
+  int16_t recorder_id;
+  int16_t key;
+  int32_t num_items;
+  int32_t first_time;
+  int32_t last_time;
+  int64_t offset;        // File offset of the CHUNK record
+  int64_t reserved;
+};
+
+CHECK_POW2_SIZE(RecordHeader);
+CHECK_POW2_SIZE(SegmentInfo);
+CHECK_POW2_SIZE(ChunkHeader);
+CHECK_POW2_SIZE(IndexEntry);
+
+// Size of a record with the given payload size, including padding.
+inline size_t
+recordSize(size_t payload_size) {
+  return sizeof(RecordHeader) +
+      ((payload_size + RECORD_ALIGNMENT - 1) & ~(RECORD_ALIGNMENT - 1));
+}
+
+// Segment file name, "segment_<sequence>.rec". Parse returns false if
+// name is not a segment file name.
+std::string segmentName(uint32_t sequence);
+bool parseSegmentName(char const* name, uint32_t* sequence);
+
+// CRC-32C (Castagnoli), hardware accelerated on cpus with SSE 4.2.
+uint32_t crc32c(void const* data, size_t size, uint32_t crc = 0);
+
+// DELTA codec of the items of a single key, in time order. Per item the
+// time delta and, when changed, the type and length are varints, and
+// each element the varint of its delta (INT and UINT, zigzag encoded)
+// or xor (FLOAT) to the previous value. Strings are stored as is,
+// unused elements are not stored and decode as zero. Appends to out.
+void encodeItems(Item const* items, size_t num_items, std::vector<char>* out);
+
+// Decodes num_items items of key, returns false if data is malformed.
+bool decodeItems(char const* data,
+                 size_t size,
+                 int16_t key,
+                 size_t num_items,
+                 Item* items);
@@ -0,0 +1,167 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#include "RecorderMerge.h"
+
+#include <algorithm>
+
+namespace {
+size_t constexpr CHUNK_SIZE = 1<<10;
+}  // namespace
+
+RecorderMerge::Config::Config()
+    : lateness(1000)
+    , max_items(1<<20) {
+}
+
+RecorderMerge::RecorderMerge(Config const& config, Output const& output)
+    : config_(config)
+    , output_(output)
+    , has_latest_(false)
+    , latest_(0)
+    , has_emitted_(false)
+    , last_emitted_(0)
+    , buffered_(0)
+    , max_buffered_(0)
+    , emitted_(0)
+    , late_(0) {
+  chunk_.reserve(CHUNK_SIZE);
+}
+
+void
+RecorderMerge::add(int16_t recorder_id,
+                   Item const* items,
+                   size_t num_items,
+                   bool priority) {
+  if (num_items == 0) {
+    return;
+  }
+  if (static_cast<size_t>(recorder_id) >= buffers_.size()) {
+    buffers_.resize(recorder_id + 1);
+  }
+  auto& buffer = buffers_[recorder_id];
+  if (!buffer.active) {
+    buffer.active = true;
+    active_.push_back(recorder_id);
+  }
+
+  bool const was_empty = buffer.items.empty();
+  int32_t const front = was_empty ? 0 : buffer.items.front().time;
+  int32_t latest = buffer.watermark;
+  for (size_t i = 0; i < num_items; ++i) {
+    auto const& item = items[i];
+    if (has_emitted_ && item.time < last_emitted_) {
+      ++late_;
+      continue;
+    }
+    if (buffer.items.empty() || item.time >= buffer.items.back().time) {
+      buffer.items.push_back(item);
+    } else {
+      auto const it = std::upper_bound(
+          buffer.items.begin(), buffer.items.end(), item.time,
+          [](int32_t time, Item const& other) { return time < other.time; });
+      buffer.items.insert(it, item);
+    }
+    if (!priority) {
+      buffer.watermark = std::max(buffer.watermark, item.time);
+    }
+    latest = std::max(latest, item.time);
+    ++buffered_;
+  }
+  if (!buffer.items.empty()) {
+    int32_t const time = buffer.items.front().time;
+    if (was_empty) {
+      heap_.emplace_back(time, recorder_id);
+      std::push_heap(heap_.begin(), heap_.end(), std::greater<Head>());
+    } else if (time != front) {
+      // An item was inserted ahead of the buffered ones.
+      auto const head = std::find_if(
+          heap_.begin(), heap_.end(),
+          [recorder_id](Head const& entry) {
+            return entry.second == recorder_id;
+          });
+      head->first = time;
+      std::make_heap(heap_.begin(), heap_.end(), std::greater<Head>());
+    }
+  }
+  if (!has_latest_ || latest > latest_) {
+    latest_ = latest;
+    has_latest_ = true;
+  }
+  max_buffered_ = std::max(max_buffered_, buffered_);
+
+  // The low watermark, held back at most the lateness window.
+  auto watermark = latest_;
+  for (auto const id : active_) {
+    watermark = std::min(watermark, buffers_[id].watermark);
+  }
+  emit(std::max(watermark, latest_ - config_.lateness), false);
+}
+
+void
+RecorderMerge::flush() {
+  emit(0, true);
+}
+
+void
+RecorderMerge::emit(int32_t bound, bool all) {
+  while (!heap_.empty() &&
+         (all || heap_.front().first <= bound ||
+          buffered_ > config_.max_items)) {
+    std::pop_heap(heap_.begin(), heap_.end(), std::greater<Head>());
+    auto const recorder_id = heap_.back().second;
+    heap_.pop_back();
+
+    auto& buffer = buffers_[recorder_id];
+    MergedItem merged;
+    merged.recorder_id = recorder_id;
+    merged.reserved0 = 0;
+    merged.reserved1 = 0;
+    merged.item = buffer.items.front();
+    buffer.items.pop_front();
+    --buffered_;
+    if (!buffer.items.empty()) {
+      int32_t const time = buffer.items.front().time;
+      heap_.emplace_back(time, recorder_id);
+      std::push_heap(heap_.begin(), heap_.end(), std::greater<Head>());
+    }
+
+    last_emitted_ = merged.item.time;
+    has_emitted_ = true;
+    chunk_.push_back(merged);
+    if (chunk_.size() == CHUNK_SIZE) {
+      output();
+    }
+  }
+  output();
+}
+
+void
+RecorderMerge::output() {
+  if (!chunk_.empty()) {
+    emitted_ += chunk_.size();
+    output_(chunk_.data(), chunk_.size());
+    chunk_.clear();
+  }
+}
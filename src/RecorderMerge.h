@@ -0,0 +1,109 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "RecorderTypes.h"
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <utility>
+#include <vector>
+
+// Merges the DATA items of all recorders into one stream ordered by item
+// time. Items are buffered per recorder and merged with a k-way heap
+// over the buffer heads. An item is emitted when its time is at most
+// the low watermark, the minimum over all recorders of the latest item
+// time received, so no recorder can still send an earlier item. Idle or
+// lagging recorders hold the watermark back for at most the lateness
+// window: items older than the latest time received minus the lateness
+// are emitted regardless. Items arriving after later items have been
+// emitted are late, they are counted and dropped from the stream.
+// Memory is bounded by the lateness window and, as a hard limit, by
+// max_items. Items of a recorder arriving out of time order, e.g. on the
+// priority lane ahead of bulk items recorded before them, are inserted
+// in time order while still buffered. Priority lane items do not advance
+// the watermark of their recorder, as earlier bulk items may still be in
+// flight. Owned by a single thread, not thread safe.
+class RecorderMerge {
+ public:
+  RecorderMerge(RecorderMerge const&) = delete;
+  RecorderMerge& operator=(RecorderMerge const&) = delete;
+
+  struct Config {
+    Config();
+    int32_t lateness;   // In the unit of the item time
+    size_t  max_items;  // Maximum number of items buffered
+  };
+
+  // Receives the merged stream in chunks.
+  typedef std::function<void(MergedItem const*, size_t)> Output;
+
+  RecorderMerge(Config const& config, Output const& output);
+
+  // Buffer the items of a DATA batch and emit the items now safe.
+  // Priority is set for batches of the priority lane.
+  void add(int16_t recorder_id,
+           Item const* items,
+           size_t num_items,
+           bool priority = false);
+
+  // Emit all buffered items, e.g. at shutdown.
+  void flush();
+
+  int64_t emitted() const { return emitted_; }
+  int64_t late() const { return late_; }
+  size_t  buffered() const { return buffered_; }
+  size_t  maxBuffered() const { return max_buffered_; }
+
+ private:
+  struct Buffer {
+    Buffer() : active(false), watermark(0) {}
+    bool active;
+    int32_t watermark;  // Latest item time received
+    std::deque<Item> items;
+  };
+
+  // Heap entry of a non-empty buffer, its head time and recorder id.
+  typedef std::pair<int32_t, int16_t> Head;
+
+  void emit(int32_t bound, bool all);
+  void output();
+
+  Config const config_;
+  Output const output_;
+  std::vector<Buffer> buffers_;
+  std::vector<int16_t> active_;
+  std::vector<Head> heap_;
+  std::vector<MergedItem> chunk_;
+  bool    has_latest_;
+  int32_t latest_;       // Latest item time received from any recorder
+  bool    has_emitted_;
+  int32_t last_emitted_;
+  size_t  buffered_;
+  size_t  max_buffered_;
+  int64_t emitted_;
+  int64_t late_;
+};
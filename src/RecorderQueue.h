@@ -0,0 +1,98 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Bounded lock-free single producer, single consumer queue. Used to
+// connect the sink pipeline stages, each queue has exactly one pushing
+// and one popping thread. The capacity is rounded up to a power of 2.
+template<typename T>
+class RecorderQueue {
+ public:
+  RecorderQueue(RecorderQueue const&) = delete;
+  RecorderQueue& operator=(RecorderQueue const&) = delete;
+
+  explicit RecorderQueue(size_t capacity)
+      : buffer_(roundUp(capacity))
+      , mask_(buffer_.size() - 1)
+      , head_(0)
+      , tail_(0) {
+  }
+
+  // Producer side, returns false if the queue is full.
+  bool push(T const& value) {
+    auto const head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) > mask_) {
+      return false;
+    }
+    buffer_[head & mask_] = value;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side, returns false if the queue is empty.
+  bool pop(T* value) {
+    auto const tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *value = buffer_[tail & mask_];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Approximate number of queued elements, safe from any thread.
+  size_t size() const {
+    auto const tail = tail_.load(std::memory_order_acquire);
+    return head_.load(std::memory_order_relaxed) - tail;
+  }
+
+  size_t capacity() const {
+    return buffer_.size();
+  }
+
+ private:
+  static size_t roundUp(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    return size;
+  }
+
+  std::vector<T> buffer_;
+  size_t const mask_;
+
+  // Producer and consumer indices on separate cache lines.
+  static size_t constexpr CACHE_LINE = 64;
+  char padding0_[CACHE_LINE];
+  std::atomic<size_t> head_;
+  char padding1_[CACHE_LINE - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> tail_;
+  char padding2_[CACHE_LINE - sizeof(std::atomic<size_t>)];
+};
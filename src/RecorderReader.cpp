@@ -0,0 +1,441 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+
+#include "RecorderReader.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+// First element of the item value as T, zero for strings.
+template<typename T>
+T
+itemValue(Item const& item) {
+  switch (item.type) {
+    case ItemType::INT:   return static_cast<T>(item.data.i);
+    case ItemType::UINT:  return static_cast<T>(item.data.u);
+    case ItemType::FLOAT: return static_cast<T>(item.data.d);
+    default:              return T();
+  }
+}
+}  // namespace
+
+
+// Reader
+// ----------------------------------------------------------------------------
+RecorderReader::Config::Config()
+    : reserve(size_t(1) << 30)
+    , verify(true) {}
+
+RecorderReader::RecorderReader(std::string const& path, Config const& config)
+    : config_(config)
+    , fd_(-1)
+    , data_(nullptr)
+    , map_size_(0)
+    , offset_(0)
+    , valid_(false) {
+  std::memset(&info_, 0, sizeof(info_));
+  fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd_ < 0 || fstat(fd_, &st) != 0) {
+    perror(path.c_str());
+    return;
+  }
+  // Pages beyond the end of the file are never touched, records are
+  // only read up to the file size.
+  map_size_ = std::max<size_t>(st.st_size, config_.reserve);
+  void* map = mmap(nullptr, map_size_, PROT_READ, MAP_SHARED, fd_, 0);
+  if (map == MAP_FAILED) {
+    perror(path.c_str());
+    map_size_ = 0;
+    return;
+  }
+  data_ = static_cast<char const*>(map);
+  refresh();
+}
+
+RecorderReader::~RecorderReader() {
+  if (data_ != nullptr) {
+    munmap(const_cast<char*>(data_), map_size_);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+std::vector<std::string>
+RecorderReader::segments(std::string const& directory) {
+  std::vector<std::pair<uint32_t, std::string> > found;
+  if (DIR* dir = opendir(directory.c_str())) {
+    while (dirent const* entry = readdir(dir)) {
+      uint32_t sequence = 0;
+      if (parseSegmentName(entry->d_name, &sequence)) {
+        found.emplace_back(sequence, directory + "/" + entry->d_name);
+      }
+    }
+    closedir(dir);
+  } else {
+    perror(directory.c_str());
+  }
+  std::sort(found.begin(), found.end());
+  std::vector<std::string> paths;
+  for (auto const& segment : found) {
+    paths.push_back(segment.second);
+  }
+  return paths;
+}
+
+size_t
+RecorderReader::refresh() {
+  struct stat st;
+  if (data_ == nullptr || fstat(fd_, &st) != 0) {
+    return 0;
+  }
+  auto const end = std::min<size_t>(st.st_size, map_size_);
+  size_t num_records = 0;
+  while (offset_ + sizeof(RecordHeader) <= end) {
+    auto const* header =
+        reinterpret_cast<RecordHeader const*>(data_ + offset_);
+    if (header->magic != RECORD_MAGIC ||
+        offset_ + recordSize(header->size) > end) {
+      break;
+    }
+    // The chunks of compacted segments are verified when decoded.
+    auto const* payload = data_ + offset_ + sizeof(RecordHeader);
+    bool const lazy = header->type == RecordType::CHUNK && compacted();
+    if (!lazy && header->checksum != crc32c(payload, header->size)) {
+      break;
+    }
+    readRecord(*header, payload);
+    offset_ += recordSize(header->size);
+    ++num_records;
+  }
+  return num_records;
+}
+
+std::vector<std::pair<int16_t, int16_t> >
+RecorderReader::channels() const {
+  std::vector<std::pair<int16_t, int16_t> > channels;
+  for (auto const& item : items_) {
+    channels.push_back(item.first);
+  }
+  for (auto const& recorder : blocks_) {
+    for (auto const& block : recorder.second) {
+      if (block.kind == Block::CHUNK) {
+        channels.emplace_back(recorder.first, block.key);
+      }
+    }
+  }
+  std::sort(channels.begin(), channels.end());
+  channels.erase(std::unique(channels.begin(), channels.end()),
+                 channels.end());
+  return channels;
+}
+
+RecorderReader::Cursor
+RecorderReader::cursor(int16_t recorder_id, int16_t key) const {
+  return Cursor(this, recorder_id, key);
+}
+
+void
+RecorderReader::addBlock(int16_t recorder_id, Block const& block) {
+  blocks_[recorder_id].push_back(block);
+}
+
+// Indexes a valid record at offset_. Malformed payloads are skipped.
+void
+RecorderReader::readRecord(RecordHeader const& header, char const* payload) {
+  auto const size = header.size;
+  auto const recorder_id = header.recorder_id;
+  bool valid = true;
+  switch (header.type) {
+    case RecordType::SEGMENT:
+      valid = size == sizeof(SegmentInfo);
+      if (valid) {
+        std::memcpy(&info_, payload, size);
+        valid_ = offset_ == 0;
+      }
+      break;;
+    case RecordType::RECORDER: {
+      valid = size == sizeof(InitRecorder);
+      if (valid) {
+        auto const& init = *reinterpret_cast<InitRecorder const*>(payload);
+        recorders_.erase(recorder_id);
+        recorders_.insert(std::make_pair(recorder_id, init));
+      }
+    } break;;
+    case RecordType::ITEM: {
+      valid = size == sizeof(InitItem);
+      if (valid) {
+        auto const& init = *reinterpret_cast<InitItem const*>(payload);
+        auto const key = std::make_pair(init.recorder_id, init.key);
+        items_.erase(key);
+        items_.insert(std::make_pair(key, init));
+      }
+    } break;;
+    case RecordType::DATA:
+    case RecordType::VARDATA: {
+      auto const* items = reinterpret_cast<Item const*>(payload);
+      auto const num_slots = size / sizeof(Item);
+      bool const var = header.type == RecordType::VARDATA;
+      valid = size % sizeof(Item) == 0 &&
+          (!var || varItemCount(items, num_slots) >= 0);
+      if (valid) {
+        addBlock(recorder_id, Block{ var ? Block::VAR : Block::FIXED, -1,
+                                     static_cast<uint32_t>(num_slots), items,
+                                     nullptr });
+      }
+    } break;;
+    case RecordType::FRAME: {
+      auto const* frame = reinterpret_cast<FrameHeader const*>(payload);
+      auto const* sections = reinterpret_cast<FrameSection const*>(frame + 1);
+      valid = size >= sizeof(FrameHeader) &&
+          frame->num_sections >= 0 && frame->num_items >= 0 &&
+          size == sizeof(FrameHeader) +
+          frame->num_sections * sizeof(FrameSection) +
+          frame->num_items * sizeof(Item);
+      auto const* items =
+          reinterpret_cast<Item const*>(sections + frame->num_sections);
+      // Sections are checked before any is indexed, a frame is whole.
+      int32_t remaining = valid ? frame->num_items : 0;
+      for (int32_t i = 0; valid && i < frame->num_sections; ++i) {
+        auto const& section = sections[i];
+        valid = section.num_items >= 0 && section.num_items <= remaining &&
+            ((section.flags & FRAME_SECTION_VAR) == 0 ||
+             varItemCount(items, section.num_items) >= 0);
+        remaining -= section.num_items;
+        items += section.num_items;
+      }
+      items = reinterpret_cast<Item const*>(sections + frame->num_sections);
+      for (int32_t i = 0; valid && i < frame->num_sections; ++i) {
+        auto const& section = sections[i];
+        bool const var = section.flags & FRAME_SECTION_VAR;
+        addBlock(section.recorder_id,
+                 Block{ var ? Block::VAR : Block::FIXED, -1,
+                        static_cast<uint32_t>(section.num_items), items,
+                        nullptr });
+        items += section.num_items;
+      }
+    } break;;
+    case RecordType::INDEX: {
+      auto const* entries = reinterpret_cast<IndexEntry const*>(payload);
+      valid = size % sizeof(IndexEntry) == 0;
+      for (size_t i = 0; valid && i < size / sizeof(IndexEntry); ++i) {
+        // Chunks precede the index.
+        auto const& entry = entries[i];
+        auto const chunk_offset = static_cast<size_t>(entry.offset);
+        auto const* chunk =
+            reinterpret_cast<RecordHeader const*>(data_ + chunk_offset);
+        if (entry.offset < 0 ||
+            chunk_offset + sizeof(RecordHeader) > offset_ ||
+            chunk_offset % RECORD_ALIGNMENT != 0 ||
+            chunk->magic != RECORD_MAGIC ||
+            chunk->type != RecordType::CHUNK ||
+            chunk_offset + recordSize(chunk->size) > offset_) {
+          std::fprintf(stderr, "Malformed index entry %lu of segment %u\n",
+                       i, info_.sequence);
+          continue;
+        }
+        addBlock(entry.recorder_id,
+                 Block{ Block::CHUNK, entry.key, 0, nullptr, chunk });
+      }
+    } break;;
+    default:
+      break;;
+  }
+  if (!valid) {
+    std::fprintf(stderr, "Malformed record at offset %lu of segment %u\n",
+                 offset_, info_.sequence);
+  }
+}
+
+
+// Cursor
+// ----------------------------------------------------------------------------
+RecorderReader::Cursor::Cursor(RecorderReader const* reader,
+                               int16_t recorder_id,
+                               int16_t key)
+    : reader_(reader)
+    , recorder_id_(recorder_id)
+    , key_(key)
+    , block_(0)
+    , items_(nullptr)
+    , num_slots_(0)
+    , var_(false)
+    , filter_(false)
+    , errors_(0) {}
+
+bool
+RecorderReader::Cursor::advance() {
+  auto const it = reader_->blocks_.find(recorder_id_);
+  if (it == reader_->blocks_.end()) {
+    return false;
+  }
+  auto const& blocks = it->second;
+  while (block_ < blocks.size()) {
+    auto const& block = blocks[block_++];
+    if (block.kind != Block::CHUNK) {
+      items_ = block.items;
+      num_slots_ = block.num_slots;
+      var_ = block.kind == Block::VAR;
+      filter_ = true;
+      return true;
+    }
+    if (block.key != key_) {
+      continue;
+    }
+    if (decode(block)) {
+      return true;
+    }
+    std::fprintf(stderr, "Malformed chunk of %d-%d\n", recorder_id_, key_);
+    ++errors_;
+  }
+  return false;
+}
+
+bool
+RecorderReader::Cursor::decode(Block const& block) {
+  auto const& record = *block.record;
+  auto const* payload = reinterpret_cast<char const*>(&record + 1);
+  ChunkHeader chunk;
+  if (record.size < sizeof(chunk) ||
+      (reader_->config_.verify &&
+       record.checksum != crc32c(payload, record.size))) {
+    return false;
+  }
+  std::memcpy(&chunk, payload, sizeof(chunk));
+  auto const* data = payload + sizeof(chunk);
+  auto const size = record.size - sizeof(chunk);
+  if (chunk.num_items <= 0) {
+    return false;
+  }
+  if (chunk.codec == ChunkCodec::DELTA) {
+    if (decoded_.size() < static_cast<size_t>(chunk.num_items)) {
+      decoded_.resize(chunk.num_items);
+    }
+    if (!decodeItems(data, size, chunk.key, chunk.num_items,
+                     decoded_.data())) {
+      return false;
+    }
+    items_ = decoded_.data();
+    num_slots_ = chunk.num_items;
+    var_ = false;
+  } else {
+    items_ = reinterpret_cast<Item const*>(data);
+    num_slots_ = size / sizeof(Item);
+    var_ = (chunk.flags & CHUNK_VAR) != 0;
+    auto const count = var_ ?
+        varItemCount(items_, num_slots_) : static_cast<int32_t>(num_slots_);
+    if (size % sizeof(Item) != 0 || count != chunk.num_items) {
+      num_slots_ = 0;
+      return false;
+    }
+  }
+  filter_ = false;
+  return true;
+}
+
+Item const*
+RecorderReader::Cursor::next() {
+  for (;;) {
+    if (num_slots_ == 0 && !advance()) {
+      return nullptr;
+    }
+    if (var_) {
+      auto const* var = reinterpret_cast<VarItem const*>(items_);
+      auto const slots = varItemSlots(var->type, var->length);
+      items_ += slots;
+      num_slots_ -= slots;
+      if (!filter_ || var->key == key_) {
+        head_ = varItemHead(var);
+        return &head_;
+      }
+    } else {
+      auto const* item = items_++;
+      --num_slots_;
+      if (!filter_ || item->key == key_) {
+        return item;
+      }
+    }
+  }
+}
+
+// Fixed size items are read a block at a time, variable length items
+// one at a time.
+template<typename T>
+size_t
+RecorderReader::Cursor::read(int32_t* times, T* values, size_t max_items) {
+  size_t n = 0;
+  while (n < max_items) {
+    if (num_slots_ == 0 && !advance()) {
+      break;
+    }
+    if (var_) {
+      auto const* item = next();
+      if (item == nullptr) {
+        break;
+      }
+      times[n] = item->time;
+      values[n] = itemValue<T>(*item);
+      ++n;
+    } else if (filter_) {
+      size_t i = 0;
+      for (; i < num_slots_ && n < max_items; ++i) {
+        auto const& item = items_[i];
+        if (item.key == key_) {
+          times[n] = item.time;
+          values[n] = itemValue<T>(item);
+          ++n;
+        }
+      }
+      items_ += i;
+      num_slots_ -= i;
+    } else {
+      auto const count = std::min(num_slots_, max_items - n);
+      for (size_t i = 0; i < count; ++i) {
+        times[n + i] = items_[i].time;
+        values[n + i] = itemValue<T>(items_[i]);
+      }
+      n += count;
+      items_ += count;
+      num_slots_ -= count;
+    }
+  }
+  return n;
+}
+
+template size_t
+RecorderReader::Cursor::read<int64_t>(int32_t*, int64_t*, size_t);
+template size_t
+RecorderReader::Cursor::read<uint64_t>(int32_t*, uint64_t*, size_t);
+template size_t
+RecorderReader::Cursor::read<double>(int32_t*, double*, size_t);
@@ -0,0 +1,162 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+
+#pragma once
+
+#include "RecorderFormat.h"
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Reader of a recorded segment (see RecorderFormat.h) for analysis
+// tools. The segment is memory mapped and its items are read in place,
+// without copies, through cursors over the channels of the segment, the
+// items of a (recorder, key). The records of plain segments are indexed
+// by recorder when read, compacted segments are opened by their INDEX
+// and each chunk decoded when a cursor reaches it, one chunk at a time.
+//
+// Segments still being written by the sink can be read, the mapping
+// reserves address space beyond the end of the file so that records
+// appended later are picked up by refresh() without moving it. A record
+// is only read once complete with a matching checksum, the first that
+// is not ends the segment until the next refresh(). A reader and its
+// cursors belong to a single thread, concurrent readers of a segment
+// open their own readers.
+class RecorderReader {
+ public:
+  RecorderReader(RecorderReader const&) = delete;
+  RecorderReader& operator=(RecorderReader const&) = delete;
+
+  struct Config {
+    Config();
+    size_t reserve;  // Address space mapped for a growing segment
+    bool   verify;   // Verify the checksums of chunks when decoded
+  };
+
+  class Cursor;
+
+  // Opens and reads the segment, check valid().
+  explicit RecorderReader(std::string const& path,
+                          Config const& config = Config());
+  ~RecorderReader();
+
+  // Paths of the segments of a storage directory, in sequence order.
+  static std::vector<std::string> segments(std::string const& directory);
+
+  // The segment is mapped and starts with its SegmentInfo.
+  bool valid() const { return valid_; }
+  SegmentInfo const& info() const { return info_; }
+  bool compacted() const { return (info_.flags & SEGMENT_COMPACTED) != 0; }
+
+  // Read the records appended since the last refresh, returns their
+  // number. Cursors continue with the new items.
+  size_t refresh();
+
+  // Bytes of the segment read, the end of the last valid record.
+  size_t size() const { return offset_; }
+
+  std::map<int16_t, InitRecorder> const& recorders() const {
+    return recorders_;
+  }
+  std::map<std::pair<int16_t, int16_t>, InitItem> const& items() const {
+    return items_;
+  }
+
+  // Recorder and key of each channel, the set up items of plain segments
+  // and the chunks of compacted segments.
+  std::vector<std::pair<int16_t, int16_t> > channels() const;
+
+  Cursor cursor(int16_t recorder_id, int16_t key) const;
+
+ private:
+  // Items of a recorder, a DATA or VARDATA record, a frame section or a
+  // chunk of a single key.
+  struct Block {
+    enum Kind : int8_t { FIXED, VAR, CHUNK, };
+    Kind kind;
+    int16_t key;                 // Chunks only
+    uint32_t num_slots;          // FIXED and VAR
+    Item const* items;           // FIXED and VAR
+    RecordHeader const* record;  // CHUNK
+  };
+
+  void readRecord(RecordHeader const& header, char const* payload);
+  void addBlock(int16_t recorder_id, Block const& block);
+
+  Config const config_;
+  int fd_;
+  char const* data_;
+  size_t map_size_;
+  size_t offset_;
+  bool valid_;
+  SegmentInfo info_;
+  std::map<int16_t, InitRecorder> recorders_;
+  std::map<std::pair<int16_t, int16_t>, InitItem> items_;
+  std::map<int16_t, std::vector<Block> > blocks_;
+};
+
+// Items of a channel, in the order stored, time ordered in compacted
+// segments. Variable length items are read as their head, see
+// varItemHead().
+class RecorderReader::Cursor {
+ public:
+  Cursor(Cursor&&) = default;
+
+  // The next item, nullptr at the end. Valid until the next call.
+  Item const* next();
+
+  // Read up to max_items items into the arrays, the first element of
+  // the item value converted to T (int64_t, uint64_t or double, zero for
+  // strings). Returns the number read, zero at the end.
+  template<typename T>
+  size_t read(int32_t* times, T* values, size_t max_items);
+
+  // Malformed chunks skipped.
+  int64_t errors() const { return errors_; }
+
+ private:
+  friend class RecorderReader;
+  Cursor(RecorderReader const* reader, int16_t recorder_id, int16_t key);
+
+  // Moves to the next block of the channel, false at the end. Blocks of
+  // plain segments hold all keys of the recorder and are filtered.
+  bool advance();
+  bool decode(Block const& block);
+
+  RecorderReader const* reader_;
+  int16_t recorder_id_;
+  int16_t key_;
+  size_t block_;       // Next block of the recorder
+  Item const* items_;  // Current block, from the position on
+  size_t num_slots_;
+  bool var_;
+  bool filter_;
+  std::vector<Item> decoded_;  // Current chunk
+  Item head_;                  // Current variable length item
+  int64_t errors_;
+};
@@ -0,0 +1,358 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+
+#include "RecorderRules.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+namespace {
+// Item times wrap, a + b without signed overflow.
+int32_t
+timeAdd(int32_t a, int32_t b) {
+  return static_cast<int32_t>(
+      static_cast<uint32_t>(a) + static_cast<uint32_t>(b));
+}
+
+bool
+itemValue(Item const& item, int32_t element, double* value) {
+  if (element >= item.length) {
+    return false;
+  }
+  switch (item.type) {
+    case ItemType::INT:
+      *value = static_cast<double>(item.data.v_i[element]);
+      return true;
+    case ItemType::UINT:
+      *value = static_cast<double>(item.data.v_u[element]);
+      return true;
+    case ItemType::FLOAT:
+      *value = item.data.v_d[element];
+      return true;
+    default:
+      return false;
+  }
+}
+}  // namespace
+
+RecorderRules::Rule::Rule()
+    : element(0)
+    , measure(Measure::VALUE)
+    , compare(Compare::ABOVE)
+    , limit(0.0)
+    , hysteresis(0.0)
+    , hold(0)
+    , period(1) {}
+
+bool
+RecorderRules::parse(std::string const& text, Rule* rule) {
+  std::istringstream in(text);
+  std::string token;
+  Rule parsed;
+  if (!(in >> token) || token.size() < 2 || token.back() != ':') {
+    return false;
+  }
+  parsed.name = token.substr(0, token.size() - 1);
+
+  if (!(in >> token)) {
+    return false;
+  }
+  auto const slash = token.rfind('/');
+  if (slash == std::string::npos) {
+    return false;
+  }
+  parsed.recorder = token.substr(0, slash);
+  parsed.item = token.substr(slash + 1);
+  auto const bracket = parsed.item.find('[');
+  if (bracket != std::string::npos) {
+    if (parsed.item.size() != bracket + 3 || parsed.item.back() != ']' ||
+        parsed.item[bracket + 1] < '0' || parsed.item[bracket + 1] > '2') {
+      return false;
+    }
+    parsed.element = parsed.item[bracket + 1] - '0';
+    parsed.item.resize(bracket);
+  }
+  if (parsed.item.empty()) {
+    return false;
+  }
+
+  if (!(in >> token)) {
+    return false;
+  }
+  if (token == "rate") {
+    parsed.measure = Measure::RATE;
+    if (!(in >> token)) {
+      return false;
+    }
+  }
+  if (token == ">") {
+    parsed.compare = Compare::ABOVE;
+  } else if (token == "<") {
+    parsed.compare = Compare::BELOW;
+  } else {
+    return false;
+  }
+  if (!(in >> parsed.limit)) {
+    return false;
+  }
+
+  while (in >> token) {
+    if (token == "for") {
+      if (!(in >> parsed.hold) || parsed.hold < 0) {
+        return false;
+      }
+    } else if (token == "hysteresis") {
+      if (!(in >> parsed.hysteresis) || parsed.hysteresis < 0.0) {
+        return false;
+      }
+    } else if (token == "per") {
+      if (!(in >> parsed.period) || parsed.period < 1) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+  }
+  *rule = parsed;
+  return true;
+}
+
+bool
+RecorderRules::load(std::string const& path, std::vector<Rule>* rules) {
+  std::ifstream in(path);
+  if (!in) {
+    std::fprintf(stderr, "Opening rules %s failed\n", path.c_str());
+    return false;
+  }
+  bool valid = true;
+  std::string line;
+  for (int number = 1; std::getline(in, line); ++number) {
+    auto const begin = line.find_first_not_of(" \t");
+    if (begin == std::string::npos || line[begin] == '#') {
+      continue;
+    }
+    Rule rule;
+    if (!parse(line, &rule)) {
+      std::fprintf(stderr, "Malformed rule at line %d of %s\n",
+                   number, path.c_str());
+      valid = false;
+      continue;
+    }
+    rules->push_back(rule);
+  }
+  return valid;
+}
+
+RecorderRules::RecorderRules(Config const& config, Output const& output)
+    : config_(config)
+    , output_(output)
+    , clock_(0)
+    , clocked_(false)
+    , bound_(0)
+    , evaluated_(0)
+    , raised_(0)
+    , cleared_(0) {
+  for (size_t i = 0; i < config_.rules.size(); ++i) {
+    items_[config_.rules[i].item].push_back(static_cast<int32_t>(i));
+  }
+}
+
+RecorderRules::Binding
+RecorderRules::compile(Rule const& rule, int32_t index) {
+  Binding binding;
+  binding.rule = index;
+  binding.element = rule.element;
+  binding.rate = rule.measure == Measure::RATE;
+  binding.sign = rule.compare == Compare::ABOVE ? 1.0 : -1.0;
+  binding.level = binding.sign * rule.limit;
+  binding.clear = binding.level - rule.hysteresis;
+  binding.scale = rule.period;
+  binding.hold = rule.hold;
+  binding.active = false;
+  binding.raised = false;
+  binding.pending = false;
+  binding.has_last = false;
+  binding.since = 0;
+  binding.last_time = 0;
+  binding.last_value = 0.0;
+  binding.value = 0.0;
+  return binding;
+}
+
+void
+RecorderRules::addRecorder(int16_t recorder_id,
+                           char const* name,
+                           size_t size,
+                           RecorderSchema::Schema const& schema) {
+  if (recorder_id < 0) {
+    return;
+  }
+  if (tables_.size() <= static_cast<size_t>(recorder_id)) {
+    tables_.resize(recorder_id + 1);
+  }
+  pending_.erase(std::remove_if(pending_.begin(), pending_.end(),
+                                [recorder_id](Pending const& pending) {
+                                  return pending.recorder_id == recorder_id;
+                                }),
+                 pending_.end());
+  auto& table = tables_[recorder_id];
+  bound_ -= table.bindings.size();
+  table.first.clear();
+  table.bindings.clear();
+
+  std::string const recorder(name, strnlen(name, size));
+  for (size_t key = 0; key < schema.names.size(); ++key) {
+    table.first.push_back(static_cast<uint32_t>(table.bindings.size()));
+    if (schema.names[key] == nullptr) {
+      continue;
+    }
+    auto const it = items_.find(schema.names[key]);
+    if (it == items_.end()) {
+      continue;
+    }
+    for (auto const index : it->second) {
+      auto const& rule = config_.rules[index];
+      if (recorder.compare(0, rule.recorder.size(), rule.recorder) == 0) {
+        table.bindings.push_back(compile(rule, index));
+      }
+    }
+  }
+  table.first.push_back(static_cast<uint32_t>(table.bindings.size()));
+  if (table.bindings.empty()) {
+    table.first.clear();
+  }
+  bound_ += table.bindings.size();
+}
+
+void
+RecorderRules::evaluate(int16_t recorder_id, Item const& item) {
+  ++evaluated_;
+  auto& table = tables_[recorder_id];
+  size_t const key = static_cast<uint16_t>(item.key);
+  for (auto i = table.first[key]; i < table.first[key + 1]; ++i) {
+    auto& binding = table.bindings[i];
+    double value;
+    if (!itemValue(item, binding.element, &value)) {
+      continue;
+    }
+    if (binding.rate) {
+      auto const elapsed = binding.has_last ?
+          timeDiff(item.time, binding.last_time) : -1;
+      auto const last_value = binding.last_value;
+      binding.has_last = true;
+      binding.last_time = item.time;
+      binding.last_value = value;
+      if (elapsed < 0) {
+        // First item, or out of order, the next rate is from this one.
+        continue;
+      }
+      value = (value - last_value) * binding.scale / std::max(elapsed, 1);
+    } else {
+      // The previous value held up to this item.
+      expire(recorder_id, item.key, item.time, &binding);
+    }
+
+    auto const level = binding.sign * value;
+    if (binding.raised) {
+      if (level <= binding.clear) {
+        binding.raised = false;
+        binding.active = false;
+        ++cleared_;
+        emit(recorder_id, item.key, item.time, binding, value);
+      }
+    } else if (level > binding.level) {
+      if (!binding.active) {
+        binding.active = true;
+        binding.since = item.time;
+      }
+      binding.value = value;
+      if (!expire(recorder_id, item.key, item.time, &binding) &&
+          !binding.rate && !binding.pending) {
+        binding.pending = true;
+        pending_.push_back(Pending{ recorder_id, item.key, i });
+      }
+    } else {
+      binding.active = false;
+    }
+  }
+}
+
+// Expire the holds of the pending bindings at the stream clock.
+void
+RecorderRules::advance() {
+  for (size_t i = 0; i < pending_.size();) {
+    auto const& pending = pending_[i];
+    auto& binding = tables_[pending.recorder_id].bindings[pending.index];
+    expire(pending.recorder_id, pending.key, clock_, &binding);
+    if (binding.active && !binding.raised) {
+      ++i;
+      continue;
+    }
+    binding.pending = false;
+    pending_[i] = pending_.back();
+    pending_.pop_back();
+  }
+}
+
+// Raise an active binding whose condition has held for the hold time
+// at time, the event is at the time the hold expired.
+bool
+RecorderRules::expire(int16_t recorder_id,
+                      int16_t key,
+                      int32_t time,
+                      Binding* binding) {
+  if (!binding->active || binding->raised ||
+      timeDiff(time, binding->since) < binding->hold) {
+    return false;
+  }
+  binding->raised = true;
+  ++raised_;
+  emit(recorder_id, key, timeAdd(binding->since, binding->hold), *binding,
+       binding->value);
+  return true;
+}
+
+void
+RecorderRules::emit(int16_t recorder_id,
+                    int16_t key,
+                    int32_t time,
+                    Binding const& binding,
+                    double value) {
+  RuleEvent event;
+  std::memset(&event, 0, sizeof(event));
+  event.rule = binding.rule;
+  event.recorder_id = recorder_id;
+  event.key = key;
+  event.raised = binding.raised ? 1 : 0;
+  event.time = time;
+  event.since = binding.since;
+  event.value = value;
+  if (output_) {
+    output_(event, config_.rules[binding.rule].name.c_str());
+  }
+}
@@ -0,0 +1,211 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+
+#pragma once
+
+#include "RecorderSchema.h"
+#include "RecorderTypes.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Threshold and trigger rules evaluated by the sink on the item stream,
+// e.g. a value above a limit for some time, or a rate of change beyond a
+// limit. A rule applies to an item, by name, of all recorders whose name
+// starts with a prefix. Rules are parsed and compiled when loaded, and
+// bound to the (recorder id, key) channels they apply to when the schema
+// of a recorder is received. Each recorder gets a dispatch table by key
+// of the compiled rules of its channels, so an item is only checked
+// against the rules of its own channel, and unmatched items cost a
+// single lookup regardless of the number of rules. The state of a rule
+// is kept per channel and updated incrementally with each item.
+//
+// A rule is raised when its condition has held for at least hold from
+// the first item meeting it (zero hold raises at once), and cleared
+// when the value is back past the limit by the hysteresis. Producers
+// record on change, so a value holds until the next item of its
+// channel and the hold of a value rule expires with the stream clock,
+// the latest item time received from any recorder, also while the
+// channel is quiet. A rate is only known at the items of its channel,
+// its hold expires at a later item. Items at the same time are a step,
+// its rate is taken over one unit of the item time. Items are assumed
+// to arrive in time order per channel, rates are not computed across
+// items out of order. Owned by a single thread (the sink fanout
+// stage), not thread safe.
+class RecorderRules {
+ public:
+  RecorderRules(RecorderRules const&) = delete;
+  RecorderRules& operator=(RecorderRules const&) = delete;
+
+  enum class Measure : int8_t { VALUE, RATE, };
+  enum class Compare : int8_t { ABOVE, BELOW, };
+
+  // Rate is the change of the value per period, in the unit of the item
+  // time, between consecutive items of the channel. Hold is in the unit
+  // of the item time. Element selects the element of items of length
+  // two or three.
+  struct Rule {
+    Rule();
+    std::string name;
+    std::string recorder;  // Recorder name prefix, empty for all
+    std::string item;      // Item name
+    int32_t element;
+    Measure measure;
+    Compare compare;
+    double  limit;
+    double  hysteresis;
+    int32_t hold;
+    int32_t period;
+  };
+
+  // Parse a rule from text, returns false if malformed:
+  //
+  //   NAME: RECORDER_PREFIX/ITEM[ELEMENT] [rate] >|< LIMIT
+  //         [for HOLD] [hysteresis HYSTERESIS] [per PERIOD]
+  //
+  // e.g. "hot: pump/temp > 90 for 200000 hysteresis 5".
+  static bool parse(std::string const& text, Rule* rule);
+
+  // Load rules from a file, one per line, empty lines and lines starting
+  // with '#' are skipped. Malformed rules are reported, returns false if
+  // any.
+  static bool load(std::string const& path, std::vector<Rule>* rules);
+
+  // Bind address of the PUB socket the sink publishes events on, may be
+  // empty.
+  struct Config {
+    std::vector<Rule> rules;
+    std::string address;
+  };
+
+  // Receives each event and the name of its rule.
+  typedef std::function<void(RuleEvent const&, char const*)> Output;
+
+  RecorderRules(Config const& config, Output const& output);
+
+  // Bind the rules to the channels of a recorder, replaces its bindings
+  // and state if set up before.
+  void addRecorder(int16_t recorder_id,
+                   char const* name,
+                   size_t size,
+                   RecorderSchema::Schema const& schema);
+
+  // Evaluate the rules of the channels of the items of a recorder, and
+  // the holds pending at the stream clock advanced by the items.
+  void add(int16_t recorder_id, Item const* items, size_t num_items) {
+    auto const* table = static_cast<size_t>(recorder_id) < tables_.size() ?
+        &tables_[recorder_id] : nullptr;
+    for (size_t i = 0; i < num_items; ++i) {
+      auto const time = items[i].time;
+      if (!clocked_ || timeDiff(time, clock_) > 0) {
+        clock_ = time;
+        clocked_ = true;
+      }
+      size_t const key = static_cast<uint16_t>(items[i].key);
+      if (table != nullptr && key + 1 < table->first.size() &&
+          table->first[key] != table->first[key + 1]) {
+        evaluate(recorder_id, items[i]);
+      }
+    }
+    if (!pending_.empty()) {
+      advance();
+    }
+  }
+
+  size_t  numRules() const { return config_.rules.size(); }
+  size_t  bound() const { return bound_; }  // Channel bindings
+  int64_t evaluated() const { return evaluated_; }  // Items with rules
+  int64_t raised() const { return raised_; }
+  int64_t cleared() const { return cleared_; }
+
+ private:
+  // A rule bound to a channel, the compiled rule and its state. The
+  // condition is sign * value > level, cleared at sign * value <= clear.
+  struct Binding {
+    int32_t rule;
+    int32_t element;
+    bool    rate;
+    double  sign;
+    double  level;
+    double  clear;
+    double  scale;  // Rate period
+    int32_t hold;
+    bool    active;   // Condition met since
+    bool    raised;
+    bool    pending;  // Active value rule, in pending_
+    bool    has_last;
+    int32_t since;
+    int32_t last_time;
+    double  last_value;
+    double  value;  // Last value (or rate) meeting the condition
+  };
+
+  // A binding waiting for its hold to expire.
+  struct Pending {
+    int16_t  recorder_id;
+    int16_t  key;
+    uint32_t index;
+  };
+
+  // Bindings of a recorder by key, those of key k are first[k] up to
+  // first[k + 1].
+  struct Table {
+    std::vector<uint32_t> first;
+    std::vector<Binding> bindings;
+  };
+
+  // Item times wrap, the difference a - b without signed overflow.
+  static int32_t timeDiff(int32_t a, int32_t b) {
+    return static_cast<int32_t>(
+        static_cast<uint32_t>(a) - static_cast<uint32_t>(b));
+  }
+
+  static Binding compile(Rule const& rule, int32_t index);
+  void evaluate(int16_t recorder_id, Item const& item);
+  void advance();
+  bool expire(int16_t recorder_id, int16_t key, int32_t time,
+              Binding* binding);
+  void emit(int16_t recorder_id,
+            int16_t key,
+            int32_t time,
+            Binding const& binding,
+            double value);
+
+  Config const config_;
+  Output const output_;
+  // Rules by item name, in rule order.
+  std::unordered_map<std::string, std::vector<int32_t> > items_;
+  std::vector<Table> tables_;
+  std::vector<Pending> pending_;
+  int32_t clock_;  // Stream clock, latest item time
+  bool    clocked_;
+  size_t  bound_;
+  int64_t evaluated_;
+  int64_t raised_;
+  int64_t cleared_;
+};
@@ -0,0 +1,70 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#include "RecorderSchema.h"
+
+#include <cstring>
+#include <string>
+
+RecorderSchema::Schema const*
+RecorderSchema::find(uint64_t hash) const {
+  auto it = schemas_.find(hash);
+  return hash != 0 && it != schemas_.end() ? it->second.get() : nullptr;
+}
+
+RecorderSchema::Schema const*
+RecorderSchema::add(uint64_t hash,
+                    InitItem const* items,
+                    size_t num_items,
+                    int16_t recorder_id) {
+  std::unique_ptr<Schema> schema(new Schema);
+  schema->hash = hash;
+  for (size_t i = 0; i < num_items; ++i) {
+    auto const& item = items[i];
+    if (item.key < 0) {
+      continue;
+    }
+    auto const key = static_cast<size_t>(item.key);
+    if (key >= schema->names.size()) {
+      schema->names.resize(key + 1, nullptr);
+      schema->descs.resize(key + 1, nullptr);
+    }
+    schema->names[key] = intern(item.name, sizeof(item.name));
+    schema->descs[key] = intern(item.desc, sizeof(item.desc));
+  }
+
+  auto const* rval = schema.get();
+  if (hash == 0) {
+    anonymous_[recorder_id] = std::move(schema);
+  } else {
+    schemas_[hash] = std::move(schema);
+  }
+  return rval;
+}
+
+char const*
+RecorderSchema::intern(char const* str, size_t max_size) {
+  // Elements of an unordered_set are never moved.
+  return strings_.emplace(str, strnlen(str, max_size)).first->c_str();
+}
@@ -0,0 +1,77 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "RecorderTypes.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Schema registry of the sink. Schemas, the item set up of a recorder,
+// are identified by the hash computed by the producer. Recorders of the
+// same type share a schema and a known schema is not processed again,
+// e.g. when a producer restarts or reconnects. Item names and
+// descriptions are interned. Owned by a single sink stage, not thread
+// safe.
+class RecorderSchema {
+ public:
+  RecorderSchema() = default;
+  RecorderSchema(RecorderSchema const&) = delete;
+  RecorderSchema& operator=(RecorderSchema const&) = delete;
+
+  // Interned names and descriptions indexed by key, nullptr for keys
+  // not set up.
+  struct Schema {
+    uint64_t hash;
+    std::vector<char const*> names;
+    std::vector<char const*> descs;
+  };
+
+  // Returns the known schema with the hash or nullptr.
+  Schema const* find(uint64_t hash) const;
+
+  // Add a schema from the items of a recorder. Schemas of an unknown
+  // (zero) hash are never found, only the last one of each recorder is
+  // kept.
+  Schema const* add(uint64_t hash,
+                    InitItem const* items,
+                    size_t num_items,
+                    int16_t recorder_id);
+
+  // Intern a possibly not terminated string of at most max_size chars.
+  char const* intern(char const* str, size_t max_size);
+
+  size_t numSchemas() const { return schemas_.size() + anonymous_.size(); }
+  size_t numStrings() const { return strings_.size(); }
+
+ private:
+  std::unordered_set<std::string> strings_;
+  std::unordered_map<uint64_t, std::unique_ptr<Schema> > schemas_;
+  std::unordered_map<int16_t, std::unique_ptr<Schema> > anonymous_;
+};
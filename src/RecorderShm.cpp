@@ -0,0 +1,423 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#include "RecorderShm.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <set>
+
+namespace {
+size_t constexpr DIRECTORY_SIZE =
+    sizeof(ShmDirectoryHeader) +
+    RecorderShm::MAX_RECORDERS * sizeof(ShmRecorderEntry);
+
+ShmRecorderEntry*
+entries(void* directory) {
+  return reinterpret_cast<ShmRecorderEntry*>(
+      static_cast<char*>(directory) + sizeof(ShmDirectoryHeader));
+}
+
+ShmRecorderEntry const*
+entries(void const* directory) {
+  return reinterpret_cast<ShmRecorderEntry const*>(
+      static_cast<char const*>(directory) + sizeof(ShmDirectoryHeader));
+}
+
+size_t
+segmentSize(int16_t num_items) {
+  return sizeof(ShmRecorderHeader) +
+      num_items * (sizeof(InitItem) + sizeof(ShmSlot));
+}
+
+// Create and map a new segment, nullptr on failure.
+void*
+createSegment(std::string const& name, size_t size) {
+  shm_unlink(name.c_str());
+  int const fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) {
+    std::fprintf(stderr, "Warning: shm_open %s: %s\n",
+                 name.c_str(), std::strerror(errno));
+    return nullptr;
+  }
+  void* base = nullptr;
+  if (ftruncate(fd, size) == 0) {
+    base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (base == nullptr || base == MAP_FAILED) {
+    std::fprintf(stderr, "Warning: Mapping %s: %s\n",
+                 name.c_str(), std::strerror(errno));
+    shm_unlink(name.c_str());
+    return nullptr;
+  }
+  return base;
+}
+
+// Map an existing segment read only, nullptr on failure.
+void const*
+openSegment(std::string const& name, size_t* size) {
+  int const fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  void* base = nullptr;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    *size = st.st_size;
+    base = mmap(nullptr, *size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  return base == MAP_FAILED ? nullptr : base;
+}
+
+// Seqlock write of a directory entry.
+template<typename F>
+void
+writeEntry(ShmRecorderEntry* entry, F const& write) {
+  auto const seq = entry->seq.load(std::memory_order_relaxed);
+  entry->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  write(entry);
+  entry->seq.store(seq + 2, std::memory_order_release);
+}
+
+// Seqlock read, copy() is repeated until the sequence was even and
+// unchanged around it. Returns false if that did not happen within
+// MAX_READ_RETRIES tries, e.g. the writer died in the middle of a write
+// and left the sequence odd.
+int constexpr MAX_READ_RETRIES = 1<<20;
+
+template<typename F>
+bool
+readLocked(std::atomic<uint32_t> const& seq, F const& copy) {
+  for (int i = 0; i < MAX_READ_RETRIES; ++i) {
+    auto const before = seq.load(std::memory_order_acquire);
+    if ((before & 1) == 0) {
+      copy();
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (seq.load(std::memory_order_relaxed) == before) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Seqlock read of an entry into dst, a plain copy of the fields after
+// the sequence.
+bool
+readEntry(ShmRecorderEntry const* src, ShmRecorderEntry* dst) {
+  auto constexpr offset = sizeof(std::atomic<uint32_t>);
+  return readLocked(src->seq, [&]() {
+    std::memcpy(reinterpret_cast<char*>(dst) + offset,
+                reinterpret_cast<char const*>(src) + offset,
+                sizeof(*dst) - offset);
+  });
+}
+
+// The directory segment of this process, created with the first
+// recorder and removed at exit.
+class Directory {
+ public:
+  Directory() : base_(nullptr) {}
+  ~Directory() {
+    if (base_ != nullptr) {
+      munmap(base_, DIRECTORY_SIZE);
+      shm_unlink(name_.c_str());
+    }
+  }
+
+  // Allocate an entry for the recorder, nullptr if none is free.
+  ShmRecorderEntry* add(std::string const& prefix,
+                        int16_t recorder_id,
+                        int64_t external_id,
+                        std::string const& name,
+                        int16_t num_items) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (base_ == nullptr && !create(prefix)) {
+      return nullptr;
+    }
+    auto* entry = entries(base_);
+    for (int32_t i = 0; i < RecorderShm::MAX_RECORDERS; ++i, ++entry) {
+      if (entry->num_items == 0) {
+        writeEntry(entry, [&](ShmRecorderEntry* e) {
+          e->recorder_id = recorder_id;
+          e->num_items = num_items;
+          e->external_id = external_id;
+          std::strncpy(e->recorder_name, name.c_str(),
+                       sizeof(e->recorder_name) - 1);
+          e->recorder_name[sizeof(e->recorder_name) - 1] = '\0';
+        });
+        return entry;
+      }
+    }
+    std::fprintf(stderr, "Warning: Shared memory directory full\n");
+    return nullptr;
+  }
+
+  void remove(ShmRecorderEntry* entry) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    writeEntry(entry, [](ShmRecorderEntry* e) { e->num_items = 0; });
+  }
+
+ private:
+  bool create(std::string const& prefix) {
+    name_ = RecorderShm::directoryName(prefix, getpid());
+    base_ = createSegment(name_, DIRECTORY_SIZE);
+    if (base_ == nullptr) {
+      return false;
+    }
+    // The mapping is zero filled, all entries are unused.
+    auto* header = static_cast<ShmDirectoryHeader*>(base_);
+    header->version = RecorderShm::VERSION;
+    header->pid = getpid();
+    header->max_recorders = RecorderShm::MAX_RECORDERS;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = RecorderShm::MAGIC;
+    return true;
+  }
+
+  std::mutex mutex_;
+  std::string name_;
+  void* base_;
+};
+
+Directory g_directory;
+}  // namespace
+
+
+// RecorderShm
+// ----------------------------------------------------------------------------
+std::string
+RecorderShm::directoryName(std::string const& prefix, pid_t pid) {
+  return "/" + prefix + "." + std::to_string(pid);
+}
+
+std::string
+RecorderShm::segmentName(std::string const& prefix,
+                         pid_t pid,
+                         int16_t recorder_id) {
+  return directoryName(prefix, pid) + "." + std::to_string(recorder_id);
+}
+
+RecorderShm::RecorderShm(std::string const& prefix,
+                         int16_t recorder_id,
+                         int64_t external_id,
+                         std::string const& name,
+                         int16_t num_items)
+    : segment_name_(segmentName(prefix, getpid(), recorder_id))
+    , size_(segmentSize(num_items))
+    , base_(createSegment(segment_name_, size_))
+    , items_(nullptr)
+    , slots_(nullptr)
+    , num_items_(num_items)
+    , entry_(nullptr) {
+  if (base_ == nullptr) {
+    return;
+  }
+  auto* header = static_cast<ShmRecorderHeader*>(base_);
+  header->version = VERSION;
+  header->recorder_id = recorder_id;
+  header->num_items = num_items;
+  header->external_id = external_id;
+  std::strncpy(header->recorder_name, name.c_str(),
+               sizeof(header->recorder_name) - 1);
+  header->recorder_name[sizeof(header->recorder_name) - 1] = '\0';
+  items_ = reinterpret_cast<InitItem*>(header + 1);
+  slots_ = reinterpret_cast<ShmSlot*>(items_ + num_items);
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = MAGIC;
+
+  entry_ = g_directory.add(prefix, recorder_id, external_id, name, num_items);
+}
+
+RecorderShm::~RecorderShm() {
+  if (entry_ != nullptr) {
+    g_directory.remove(entry_);
+  }
+  if (base_ != nullptr) {
+    munmap(base_, size_);
+    shm_unlink(segment_name_.c_str());
+  }
+}
+
+void
+RecorderShm::setupItem(InitItem const& init) {
+  if (slots_ == nullptr || init.key < 0 || init.key >= num_items_) {
+    return;
+  }
+  // The setup is covered by the slot sequence, readers only use it for
+  // set up items.
+  auto& slot = slots_[init.key];
+  auto const seq = slot.seq.load(std::memory_order_relaxed);
+  slot.seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  items_[init.key] = init;
+  slot.item = Item(init.key);
+  slot.seq.store(seq + 2, std::memory_order_release);
+}
+
+
+// RecorderShmReader
+// ----------------------------------------------------------------------------
+RecorderShmReader::RecorderShmReader(std::string const& prefix, pid_t pid)
+    : prefix_(prefix)
+    , pid_(pid)
+    , directory_size_(0)
+    , directory_(openSegment(RecorderShm::directoryName(prefix, pid),
+                             &directory_size_)) {
+  auto const* header = static_cast<ShmDirectoryHeader const*>(directory_);
+  if (directory_ != nullptr &&
+      (directory_size_ < DIRECTORY_SIZE ||
+       header->magic != RecorderShm::MAGIC ||
+       header->version != RecorderShm::VERSION)) {
+    munmap(const_cast<void*>(directory_), directory_size_);
+    directory_ = nullptr;
+  }
+}
+
+RecorderShmReader::~RecorderShmReader() {
+  for (auto const& it : segments_) {
+    munmap(const_cast<void*>(it.second.base), it.second.size);
+  }
+  if (directory_ != nullptr) {
+    munmap(const_cast<void*>(directory_), directory_size_);
+  }
+}
+
+bool
+RecorderShmReader::alive() const {
+  return kill(pid_, 0) == 0 || errno == EPERM;
+}
+
+std::vector<RecorderShmReader::Recorder>
+RecorderShmReader::recorders() {
+  std::vector<Recorder> result;
+  if (directory_ == nullptr) {
+    return result;
+  }
+  std::set<int16_t> active;
+  auto const* entry = entries(directory_);
+  for (int32_t i = 0; i < RecorderShm::MAX_RECORDERS; ++i, ++entry) {
+    // Entries left locked by a dead writer are skipped.
+    ShmRecorderEntry copy;
+    if (readEntry(entry, &copy) && copy.num_items > 0) {
+      Recorder recorder;
+      recorder.recorder_id = copy.recorder_id;
+      recorder.num_items = copy.num_items;
+      recorder.external_id = copy.external_id;
+      recorder.name.assign(
+          copy.recorder_name,
+          strnlen(copy.recorder_name, sizeof(copy.recorder_name)));
+      result.push_back(recorder);
+      active.insert(recorder.recorder_id);
+    }
+  }
+  // Segments of removed recorders are stale.
+  for (auto it = segments_.begin(); it != segments_.end();) {
+    if (active.count(it->first) == 0) {
+      munmap(const_cast<void*>(it->second.base), it->second.size);
+      it = segments_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  return result;
+}
+
+RecorderShmReader::ReadStatus
+RecorderShmReader::read(int16_t recorder_id,
+                        int16_t key,
+                        Item* item,
+                        InitItem* init) {
+  auto const* seg = segment(recorder_id);
+  if (seg == nullptr || key < 0 || key >= seg->header->num_items) {
+    return ReadStatus::MISSING;
+  }
+  auto const& slot = seg->slots[key];
+  bool const consistent = readLocked(slot.seq, [&]() {
+    std::memcpy(item, &slot.item, sizeof(*item));
+    std::memcpy(init, &seg->items[key], sizeof(*init));
+  });
+  if (!consistent) {
+    return ReadStatus::STALE;
+  }
+  return item->type != ItemType::NOTSETUP ? ReadStatus::OK
+                                          : ReadStatus::MISSING;
+}
+
+RecorderShmReader::Segment const*
+RecorderShmReader::segment(int16_t recorder_id) {
+  auto it = segments_.find(recorder_id);
+  if (it != segments_.end()) {
+    return &it->second;
+  }
+  Segment seg;
+  seg.base = openSegment(
+      RecorderShm::segmentName(prefix_, pid_, recorder_id), &seg.size);
+  if (seg.base == nullptr) {
+    return nullptr;
+  }
+  seg.header = static_cast<ShmRecorderHeader const*>(seg.base);
+  if (seg.size < sizeof(ShmRecorderHeader) ||
+      seg.header->magic != RecorderShm::MAGIC ||
+      seg.size < segmentSize(seg.header->num_items)) {
+    munmap(const_cast<void*>(seg.base), seg.size);
+    return nullptr;
+  }
+  seg.items = reinterpret_cast<InitItem const*>(seg.header + 1);
+  seg.slots = reinterpret_cast<ShmSlot const*>(
+      seg.items + seg.header->num_items);
+  return &segments_.insert(std::make_pair(recorder_id, seg)).first->second;
+}
+
+std::vector<pid_t>
+RecorderShmReader::processes(std::string const& prefix) {
+  // Shared memory objects live in /dev/shm on Linux.
+  std::vector<pid_t> pids;
+  auto const match = prefix + ".";
+  DIR* dir = opendir("/dev/shm");
+  if (dir == nullptr) {
+    return pids;
+  }
+  while (auto const* entry = readdir(dir)) {
+    std::string const name(entry->d_name);
+    if (name.compare(0, match.size(), match) == 0 &&
+        name.find('.', match.size()) == std::string::npos) {
+      pids.push_back(std::atoi(name.c_str() + match.size()));
+    }
+  }
+  closedir(dir);
+  return pids;
+}
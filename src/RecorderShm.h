@@ -0,0 +1,196 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "RecorderTypes.h"
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+// Latest values of recorders in shared memory, for local tools that do
+// not want to go through the sink. Opt-in with
+// RecorderBase::setSharedMemory().
+//
+// Each process has a directory segment, "/<prefix>.<pid>", with an
+// entry per recorder, and each recorder a segment,
+// "/<prefix>.<pid>.<recorder_id>", with its item setups followed by a
+// slot per key holding the latest recorded item. Entries and slots are
+// seqlocks: the writer makes the sequence odd while writing and even
+// when done, readers retry if it changed or was odd. Writers never
+// wait, readers never make syscalls once the segments are mapped and
+// give up on a slot that stays odd.
+// ----------------------------------------------------------------------------
+struct ShmDirectoryHeader {
+  uint32_t magic;
+  uint32_t version;
+  int32_t  pid;
+  int32_t  max_recorders;
+  char     reserved[48];
+};
+
+struct ShmRecorderEntry {
+  std::atomic<uint32_t> seq;
+  int16_t  recorder_id;
+  int16_t  num_items;  // Zero if the entry is unused
+  int64_t  external_id;
+  char     recorder_name[48];
+};
+
+struct ShmRecorderHeader {
+  uint32_t magic;
+  uint32_t version;
+  int16_t  recorder_id;
+  int16_t  num_items;
+  int32_t  reserved0;
+  int64_t  external_id;
+  char     recorder_name[40];
+};
+
+struct ShmSlot {
+  std::atomic<uint32_t> seq;
+  uint32_t reserved0;
+  Item     item;
+  char     reserved1[24];
+};
+
+CHECK_POW2_SIZE(ShmDirectoryHeader);
+CHECK_POW2_SIZE(ShmRecorderEntry);
+CHECK_POW2_SIZE(ShmRecorderHeader);
+CHECK_POW2_SIZE(ShmSlot);
+
+// Shared memory segment of a single recorder, owned by the recording
+// thread. The segment and its directory entry are removed by the dtor.
+class RecorderShm {
+ public:
+  RecorderShm(RecorderShm const&) = delete;
+  RecorderShm& operator=(RecorderShm const&) = delete;
+
+  static uint32_t constexpr MAGIC = 0x4d485352;  // "RSHM"
+  static uint32_t constexpr VERSION = 1;
+  static int32_t constexpr MAX_RECORDERS = 1024;
+
+  // The segment is not created, valid() is false, if shared memory is
+  // not available.
+  RecorderShm(std::string const& prefix,
+              int16_t recorder_id,
+              int64_t external_id,
+              std::string const& name,
+              int16_t num_items);
+  ~RecorderShm();
+
+  bool valid() const { return slots_ != nullptr; }
+
+  // Publish the item setup, the slot is reset.
+  void setupItem(InitItem const& init);
+
+  // Publish the latest value of the item, the key must be in range.
+  void publish(Item const& item) {
+    auto& slot = slots_[item.key];
+    auto const seq = slot.seq.load(std::memory_order_relaxed);
+    slot.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(&slot.item, &item, sizeof(item));
+    slot.seq.store(seq + 2, std::memory_order_release);
+  }
+
+  static std::string directoryName(std::string const& prefix, pid_t pid);
+  static std::string segmentName(std::string const& prefix,
+                                 pid_t pid,
+                                 int16_t recorder_id);
+
+ private:
+  std::string segment_name_;
+  size_t size_;
+  void* base_;
+  InitItem* items_;
+  ShmSlot* slots_;
+  int16_t num_items_;
+  ShmRecorderEntry* entry_;
+};
+
+// Reader of the shared memory of a process. Segments are mapped read
+// only on first use. Not thread safe.
+class RecorderShmReader {
+ public:
+  RecorderShmReader(RecorderShmReader const&) = delete;
+  RecorderShmReader& operator=(RecorderShmReader const&) = delete;
+
+  struct Recorder {
+    int16_t recorder_id;
+    int16_t num_items;
+    int64_t external_id;
+    std::string name;
+  };
+
+  RecorderShmReader(std::string const& prefix, pid_t pid);
+  ~RecorderShmReader();
+
+  // False if the directory segment does not exist or is not valid.
+  bool valid() const { return directory_ != nullptr; }
+
+  // True if the writing process is still running.
+  bool alive() const;
+
+  // Consistent snapshot of the directory. Unmaps the segments of
+  // recorders no longer in it.
+  std::vector<Recorder> recorders();
+
+  // Consistent copy of the latest item of key and its setup. MISSING if
+  // the recorder segment is gone or the key not set up, STALE if the
+  // slot stayed locked, e.g. the writing process died in the middle of
+  // an update, and the copy may be torn. The item type is INIT if
+  // nothing is recorded yet.
+  enum class ReadStatus { OK, MISSING, STALE, };
+  ReadStatus read(int16_t recorder_id,
+                  int16_t key,
+                  Item* item,
+                  InitItem* init);
+
+  // Processes with a directory segment.
+  static std::vector<pid_t> processes(std::string const& prefix);
+
+ private:
+  struct Segment {
+    size_t size;
+    void const* base;
+    ShmRecorderHeader const* header;
+    InitItem const* items;
+    ShmSlot const* slots;
+  };
+
+  Segment const* segment(int16_t recorder_id);
+
+  std::string prefix_;
+  pid_t pid_;
+  size_t directory_size_;
+  void const* directory_;
+  std::map<int16_t, Segment> segments_;
+};
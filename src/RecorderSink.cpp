@@ -23,21 +23,133 @@
 */
 
 #include "RecorderSink.h"
+#include "RecorderAffinity.h"
 #include "RecorderBase.h"
 
 #include "zmqutils.h"
 
 #include <zmq.hpp>
 
+#include <algorithm>
 #include <chrono>
+#include <cstring>
 #include <map>
+#include <memory>
 #include <string>
+#include <vector>
 
 typedef std::chrono::milliseconds msec;
 typedef std::chrono::microseconds usec;
+typedef std::chrono::nanoseconds  nsec;
+
+// A single zeromq message moving through the pipeline. Batches are
+// pooled and reused, frames beyond num_frames are kept for reuse.
+struct RecorderSink::Batch {
+  std::vector<zmq::message_t> frames;
+  size_t num_frames;
+  Clock::time_point received;
+  bool priority;  // Received on the priority lane
+  size_t bytes;   // Size of the message, in the shedding arena
+
+  // Set by the decode stage
+  bool valid;
+  PayloadType type;
+  int16_t recorder_id;
+  Item const* items;
+  size_t num_items;
+  InitItem const* init_items;
+  size_t num_init_items;
+
+  // Send time, microseconds since epoch, zero if unknown.
+  int64_t sent;
+
+  // CLOCK echo and its receive time, microseconds since epoch.
+  ClockSync const* clock;
+  int64_t clock_received;
+
+  // Items by recorder for DATA and FRAME, DATA has a single section.
+  FrameHeader const* frame;
+  FrameSection const* sections;
+  size_t num_sections;
+  FrameSection section;
+};
+
+namespace {
+// Idle strategy for stages waiting on a queue, yield for a while and
+// then sleep to not burn a core on an idle sink.
+void
+backoff(int* idle) {
+  if (++*idle < 100) {
+    std::this_thread::yield();
+  } else {
+    std::this_thread::sleep_for(usec(50));
+  }
+}
+
+// Microseconds since epoch.
+int64_t
+systemTime() {
+  return std::chrono::duration_cast<usec>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// System clock minus the steady clock, in microseconds.
+int64_t
+clockOffset() {
+  return systemTime() -
+         std::chrono::duration_cast<usec>(
+             std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Item times wrap, subtract without signed overflow.
+int32_t
+shiftTime(int32_t time, int32_t correction) {
+  return static_cast<int32_t>(
+      static_cast<uint32_t>(time) - static_cast<uint32_t>(correction));
+}
+
+char const* const STAGE_NAMES[] = {
+  "receive", "decode", "fanout", "merge", "write" };
+}  // namespace
 
 RecorderSink::RecorderSink()
-    : RecorderBase("Backend") {
+    : RecorderBase("Backend")
+    , control_commands_(0)
+    , schemas_reused_(0)
+    , merge_enabled_(false)
+    , telemetry_enabled_(false)
+    , clock_offset_(0)
+    , rules_enabled_(false)
+    , clock_sync_enabled_(false)
+    , sync_clock_offset_(0)
+    , clock_probes_(0)
+    , storage_enabled_(false)
+    , arena_bytes_(0)
+    , arena_peak_(0)
+    , shed_batches_(0)
+    , shed_items_(0)
+    , shed_bytes_(0)
+    , spare_(nullptr)
+    , count_(0)
+    , frames_(0)
+    , priority_(0)
+    , invalid_(0)
+    , verbose_mode_(false)
+    , poller_running_(false) {
+  counter_.fill(0);
+  decimation_count_.fill(0);
+  shed_counter_.fill(0);
+  levels_.fill(Level::NORMAL);
+  for (auto& queue : queues_) {
+    queue.reset(new BatchQueue(BATCH_POOL_SIZE));
+  }
+  for (auto& stage_done : stage_done_) {
+    stage_done.store(false);
+  }
+  for (auto& queue : priority_queues_) {
+    queue.reset(new BatchQueue(PRIORITY_POOL_SIZE));
+  }
+  cpus_.fill(-1);
 }
 
 RecorderSink::~RecorderSink() {
@@ -46,11 +158,127 @@ RecorderSink::~RecorderSink() {
   }
 }
 
+void
+RecorderSink::setQueryAddress(std::string const& address) {
+  query_address_ = address;
+}
+
+void
+RecorderSink::setControlEndpoint(std::string const& address) {
+  control_address_ = address;
+}
+
+void
+RecorderSink::setPriorityEndpoint(std::string const& address) {
+  priority_address_ = address;
+}
+
+void
+RecorderSink::setTelemetry(RecorderTelemetry::Config const& config) {
+  telemetry_enabled_ = true;
+  telemetry_config_ = config;
+}
+
+void
+RecorderSink::setClockSync(RecorderClock::Config const& config) {
+  clock_sync_enabled_ = true;
+  clock_config_ = config;
+}
+
+std::vector<RecorderClock::Estimate>
+RecorderSink::clockEstimates() const {
+  return clock_ ? clock_->estimates() : std::vector<RecorderClock::Estimate>();
+}
+
+void
+RecorderSink::setRules(RecorderRules::Config const& config,
+                       RecorderRules::Output const& output) {
+  rules_enabled_ = true;
+  rules_config_ = config;
+  rules_output_ = output;
+}
+
+RecorderSink::RuleStats
+RecorderSink::ruleStats() const {
+  RuleStats stats = RuleStats();
+  if (rules_) {
+    stats.rules = rules_->numRules();
+    stats.bound = rules_->bound();
+    stats.evaluated = rules_->evaluated();
+    stats.raised = rules_->raised();
+    stats.cleared = rules_->cleared();
+  }
+  return stats;
+}
+
+void
+RecorderSink::setAffinity(std::vector<int> const& cpus) {
+  cpus_.fill(-1);
+  std::copy_n(cpus.begin(), std::min(cpus.size(), cpus_.size()),
+              cpus_.begin());
+}
+
+RecorderSink::Shedding::Shedding()
+    : max_bytes(0)
+    , policy(Policy::DROP)
+    , decimation(4)
+    , thresholds({{0.5, 0.75, 0.9}})
+    , default_level(Level::NORMAL) {}
+
+void
+RecorderSink::setShedding(Shedding const& shedding) {
+  shedding_ = shedding;
+  if (shedding_.decimation < 1) {
+    shedding_.decimation = 1;
+  }
+  levels_.fill(shedding_.default_level);
+}
+
+RecorderSink::SheddingStats
+RecorderSink::sheddingStats() const {
+  SheddingStats stats;
+  stats.arena_bytes = arena_bytes_.load(std::memory_order_relaxed);
+  stats.arena_peak = arena_peak_.load(std::memory_order_relaxed);
+  stats.batches = shed_batches_.load(std::memory_order_relaxed);
+  stats.items = shed_items_.load(std::memory_order_relaxed);
+  stats.bytes = shed_bytes_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void
+RecorderSink::setStorage(RecorderStorage::Config const& config) {
+  storage_enabled_ = true;
+  storage_config_ = config;
+}
+
+void
+RecorderSink::setMerge(RecorderMerge::Config const& config,
+                       std::string const& address,
+                       RecorderMerge::Output const& output) {
+  merge_enabled_ = true;
+  merge_config_ = config;
+  merge_address_ = address;
+  merge_output_ = output;
+}
+
+void
+RecorderSink::setObserver(Observer const& observer) {
+  observer_ = observer;
+}
+
 void
 RecorderSink::start(bool verbose) {
   verbose_mode_.store(verbose);
   poller_running_.store(true);
+  for (auto& stage_done : stage_done_) {
+    stage_done.store(false);
+  }
+  start_time_ = Clock::now();
   poller_thread_ = std::thread(&RecorderSink::run, this);
+  stage_threads_[0] = std::thread(&RecorderSink::runDecode, this);
+  stage_threads_[1] = std::thread(&RecorderSink::runFanout, this);
+  stage_threads_[2] = std::thread(&RecorderSink::runMerge, this);
+  stage_threads_[3] = std::thread(&RecorderSink::runWrite, this);
 }
 
 void
@@ -59,100 +287,1145 @@ RecorderSink::stop() {
   if (poller_thread_.joinable()) {
     poller_thread_.join();
   }
+  for (auto& thread : stage_threads_) {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+
+  auto const mib = 1<<20;
+
+  auto duration = std::chrono::duration_cast<usec>(stop_time_ - start_time_);
+  double duration_msec = duration.count()/1000.0;
+  printf("Messages:     %ld (%.3fms)\n", count_, duration_msec);
+  printf("Messages/sec: %.1f (%.1fMiB/sec)\n",
+         count_ * 1000 / duration_msec,
+         sizeof(Item) * count_ * 1000 / (mib * duration_msec));
+  if (frames_ > 0) {
+    printf("Frames:       %ld\n", frames_);
+  }
+  if (priority_ > 0) {
+    printf("Priority:     %ld batches\n", priority_);
+  }
+  if (invalid_ > 0) {
+    printf("Invalid:      %ld\n", invalid_);
+  }
+  printf("Schemas:      %lu (%ld reused, %lu strings)\n",
+         schemas_.numSchemas(),
+         schemas_reused_,
+         schemas_.numStrings());
+  if (control_commands_ > 0) {
+    printf("Control:      %ld commands\n", control_commands_);
+  }
+  if (shedding_.max_bytes > 0) {
+    auto const stats = sheddingStats();
+    printf("Shed:         %ld batches, %ld items, %ld bytes "
+           "(arena peak %lu of %lu bytes)\n",
+           stats.batches,
+           stats.items,
+           stats.bytes,
+           stats.arena_peak,
+           shedding_.max_bytes);
+  }
+  if (merge_) {
+    printf("Merged:       %ld (%ld late, %lu max buffered)\n",
+           merge_->emitted(),
+           merge_->late(),
+           merge_->maxBuffered());
+    merge_.reset();
+  }
+  if (rules_) {
+    printf("Rules:        %lu (%lu bound, %ld items, %ld raised, "
+           "%ld cleared)\n",
+           rules_->numRules(),
+           rules_->bound(),
+           rules_->evaluated(),
+           rules_->raised(),
+           rules_->cleared());
+  }
+  if (clock_) {
+    for (auto const& estimate : clock_->estimates()) {
+      printf("Clock:        %08x offset %.1fus drift %.3fppm delay %ldus "
+             "(%ld samples, %lu recorders)\n",
+             static_cast<uint32_t>(estimate.process),
+             estimate.offset_usec,
+             estimate.drift_ppm,
+             estimate.delay_usec,
+             estimate.samples,
+             estimate.recorders);
+    }
+  }
+  if (storage_) {
+    printf("Stored:       %ld bytes (%s, %ld errors)\n",
+           storage_->bytesWritten(),
+           storage_->ioName(),
+           storage_->writeErrors());
+    storage_.reset();
+  }
+
+  for (auto const& stats : pipelineStats()) {
+    printf("(PIPE): %-8s batches:%ld avg:%.1fus max:%.1fus\n",
+           stats.name.c_str(),
+           stats.batches,
+           stats.avg_latency_usec,
+           stats.max_latency_usec);
+  }
+
+  int total = 0;
+  for (size_t i = 0; i < counter_.max_size(); ++i) {
+    if (counter_[i] == 0) {
+      continue;
+    }
+    printf("(RECV): %2lu:%d\n", i, counter_[i]);
+    total += counter_[i];
+  }
+  printf("(RECV): %d\n", total);
+  for (size_t i = 0; i < shed_counter_.max_size(); ++i) {
+    if (shed_counter_[i] > 0) {
+      printf("(SHED): %2lu:%d\n", i, shed_counter_[i]);
+    }
+  }
+}
+
+std::vector<RecorderSink::StageStats>
+RecorderSink::pipelineStats() const {
+  std::vector<StageStats> stats;
+  for (int stage = RECEIVE; stage < NUM_STAGES; ++stage) {
+    auto const& counters = stage_counters_[stage];
+    auto const& queue = *queues_[stage];
+    StageStats stage_stats;
+    stage_stats.name = STAGE_NAMES[stage];
+    stage_stats.queue_depth = queue.size();
+    stage_stats.queue_capacity = queue.capacity();
+    if (stage == RECEIVE) {
+      stage_stats.queue_depth = BATCH_POOL_SIZE - queue.size();
+    }
+    stage_stats.batches = counters.batches.load(std::memory_order_relaxed);
+    auto const busy = counters.busy.load(std::memory_order_relaxed);
+    stage_stats.avg_latency_usec =
+        stage_stats.batches > 0 ? busy / (1000.0 * stage_stats.batches) : 0.0;
+    stage_stats.max_latency_usec =
+        counters.max.load(std::memory_order_relaxed) / 1000.0;
+    stats.push_back(stage_stats);
+  }
+  return stats;
+}
+
+RecorderSink::Pull
+RecorderSink::pull(Stage stage, Batch** batch) {
+  // Read the upstream state first, if it is done all its batches are
+  // already in the queue.
+  bool const upstream_done = stage_done_[stage - 1].load(
+      std::memory_order_acquire);
+  if (priority_queues_[stage]->pop(batch) || queues_[stage]->pop(batch)) {
+    return Pull::BATCH;
+  }
+  return upstream_done ? Pull::DONE : Pull::EMPTY;
+}
+
+void
+RecorderSink::done(Stage stage, Batch* batch, Clock::time_point begin) {
+  auto const elapsed =
+      std::chrono::duration_cast<nsec>(Clock::now() - begin).count();
+  auto& counters = stage_counters_[stage];
+  auto constexpr relaxed = std::memory_order_relaxed;
+  counters.batches.store(counters.batches.load(relaxed) + 1, relaxed);
+  counters.busy.store(counters.busy.load(relaxed) + elapsed, relaxed);
+  if (elapsed > counters.max.load(relaxed)) {
+    counters.max.store(elapsed, relaxed);
+  }
+
+  // The last stage returns the batch to the pool.
+  auto& queues = batch->priority ? priority_queues_ : queues_;
+  auto& queue = *queues[(stage + 1) % NUM_STAGES];
+  int idle = 0;
+  while (!queue.push(batch)) {
+    backoff(&idle);
+  }
+}
+
+void
+RecorderSink::place(Stage stage) {
+  auto const cpu = cpus_[stage];
+  if (cpu >= 0 && pinThread(cpu)) {
+    std::fprintf(stderr, "Sink %s on cpu %d (node %d)\n",
+                 STAGE_NAMES[stage], cpu, cpuNode(cpu));
+  }
+}
+
+// Called by the receive stage, the batches are node local to it.
+void
+RecorderSink::allocateBatches() {
+  batches_.reserve(BATCH_POOL_SIZE + PRIORITY_POOL_SIZE);
+  for (int i = 0; i < BATCH_POOL_SIZE + PRIORITY_POOL_SIZE; ++i) {
+    batches_.emplace_back(new Batch);
+    batches_.back()->priority = i >= BATCH_POOL_SIZE;
+    batches_.back()->bytes = 0;
+    auto& pool = batches_.back()->priority ? priority_queues_ : queues_;
+    pool[RECEIVE]->push(batches_.back().get());
+  }
 }
 
 void
 RecorderSink::run() {
+  place(RECEIVE);
+  if (batches_.empty()) {
+    allocateBatches();
+  }
   zmq::socket_t sock(*RecorderBase::socket_context, ZMQ_PULL);
   int constexpr recvhvm = 16000;
   sock.setsockopt(ZMQ_RCVHWM, &recvhvm, sizeof(recvhvm));
   zmqutils::bind(&sock, RecorderBase::socket_address.c_str());
 
-  zmq::message_t zmsg;
-  bool messages_to_process = true;
-  std::array<int32_t, 4096> counter;
-  counter.fill(0);
-  int64_t count = 0;
-  zmq_pollitem_t pollitems[] = { { sock, 0, ZMQ_POLLIN, 0 } };
+  std::unique_ptr<zmq::socket_t> priority_sock;
+  if (!priority_address_.empty()) {
+    priority_sock.reset(
+        new zmq::socket_t(*RecorderBase::socket_context, ZMQ_PULL));
+    zmqutils::bind(priority_sock.get(), priority_address_);
+  }
 
-  auto t1 = std::chrono::high_resolution_clock::now();
+  bool messages_to_process = true;
+  zmq_pollitem_t pollitems[] = {
+    { priority_sock ? static_cast<void*>(*priority_sock) : nullptr,
+      0, ZMQ_POLLIN, 0 },
+    { sock, 0, ZMQ_POLLIN, 0 } };
+  auto* const poll_begin = priority_sock ? pollitems : pollitems + 1;
+  int const num_pollitems = priority_sock ? 2 : 1;
 
   while (poller_running_.load() || messages_to_process) {
-    if (!zmqutils::poll(pollitems)) {
+    if (!zmqutils::poll(poll_begin, num_pollitems)) {
       messages_to_process = false;
       continue;
     }
 
-    auto type = zmqutils::pop<PayloadType>(&sock, &zmsg);
+    // The priority lane is always received first.
+    bool const priority =
+        priority_sock && (pollitems[0].revents & ZMQ_POLLIN) != 0;
+    auto* const from = priority ? priority_sock.get() : &sock;
 
-    switch (type) {
-      case PayloadType::DATA: {
-        auto rcid = zmqutils::pop<int16_t>(&sock, &zmsg);
-        sock.recv(&zmsg);
-        auto const num_params = zmsg.size() / sizeof(Item);
-        count += num_params;
-        counter[rcid] += num_params;
-        if (verbose_mode_.load()) {
-          for (size_t i = 0; i < num_params; ++i) {
-            auto const* item = static_cast<Item*>(zmsg.data()) + i;
-            printf("(DATA): @%03d %6d-%d T%d L%d -- %s\n",
-                   item->time,
-                   rcid,
-                   item->key,
-                   item->type,
-                   item->length,
-                   item->str().c_str());
+    // Wait for a free batch, the pool bounds the data in flight. A shed
+    // batch is kept for the next bulk message.
+    Batch* batch = nullptr;
+    if (!priority && spare_ != nullptr) {
+      std::swap(batch, spare_);
+    }
+    auto& pool = priority ? *priority_queues_[RECEIVE] : *queues_[RECEIVE];
+    int idle = 0;
+    while (batch == nullptr && !pool.pop(&batch)) {
+      backoff(&idle);
+    }
+
+    auto const begin = Clock::now();
+    size_t size = 0;
+    batch->num_frames = 0;
+    do {
+      if (batch->num_frames == batch->frames.size()) {
+        batch->frames.emplace_back();
+      }
+      auto& frame = batch->frames[batch->num_frames++];
+      from->recv(&frame);
+      size += frame.size();
+    } while (zmqutils::more(from));
+    batch->received = begin;
+    if (shed(*batch, size)) {
+      release(batch);
+      spare_ = batch;
+      continue;
+    }
+    batch->bytes = size;
+    auto const arena = arena_bytes_.fetch_add(size) + size;
+    if (arena > arena_peak_.load(std::memory_order_relaxed)) {
+      arena_peak_.store(arena, std::memory_order_relaxed);
+    }
+    done(RECEIVE, batch, begin);
+  }
+  if (priority_sock) {
+    priority_sock->close();
+  }
+  sock.close();
+  stage_done_[RECEIVE].store(true, std::memory_order_release);
+}
+
+void
+RecorderSink::runDecode() {
+  place(DECODE);
+  if (clock_sync_enabled_) {
+    clock_.reset(new RecorderClock(clock_config_));
+    sync_clock_offset_ = clockOffset();
+  }
+  int idle = 0;
+  for (;;) {
+    Batch* batch = nullptr;
+    auto const state = pull(DECODE, &batch);
+    if (state == Pull::DONE) {
+      break;
+    } else if (state == Pull::EMPTY) {
+      backoff(&idle);
+      continue;
+    }
+    idle = 0;
+
+    auto const begin = Clock::now();
+    auto const& frames = batch->frames;
+    auto const num_frames = batch->num_frames;
+    batch->valid = false;
+    batch->recorder_id = -1;
+    batch->items = nullptr;
+    batch->num_items = 0;
+    batch->init_items = nullptr;
+    batch->num_init_items = 0;
+    batch->frame = nullptr;
+    batch->sections = nullptr;
+    batch->num_sections = 0;
+    batch->sent = 0;
+    batch->clock = nullptr;
+    batch->clock_received = 0;
+
+    // DATA and VARDATA have an optional fourth frame, the send time.
+    bool const data_frames = num_frames == 3 ||
+        (num_frames == 4 && frames[3].size() == sizeof(batch->sent));
+    if (data_frames && num_frames == 4) {
+      std::memcpy(&batch->sent, frames[3].data(), sizeof(batch->sent));
+    }
+
+    if (frames[0].size() == sizeof(batch->type)) {
+      std::memcpy(&batch->type, frames[0].data(), sizeof(batch->type));
+      switch (batch->type) {
+        case PayloadType::DATA: {
+          if (data_frames &&
+              frames[1].size() == sizeof(batch->recorder_id) &&
+              frames[2].size() % sizeof(Item) == 0) {
+            std::memcpy(&batch->recorder_id, frames[1].data(),
+                        sizeof(batch->recorder_id));
+            batch->items = static_cast<Item const*>(frames[2].data());
+            batch->num_items = frames[2].size() / sizeof(Item);
+            batch->section.recorder_id = batch->recorder_id;
+            batch->section.flags = 0;
+            batch->section.num_items = batch->num_items;
+            batch->sections = &batch->section;
+            batch->num_sections = 1;
+            batch->valid = true;
           }
+        } break;;
+        case PayloadType::VARDATA: {
+          if (data_frames &&
+              frames[1].size() == sizeof(batch->recorder_id) &&
+              frames[2].size() % sizeof(Item) == 0) {
+            std::memcpy(&batch->recorder_id, frames[1].data(),
+                        sizeof(batch->recorder_id));
+            batch->items = static_cast<Item const*>(frames[2].data());
+            batch->num_items = frames[2].size() / sizeof(Item);
+            batch->section.recorder_id = batch->recorder_id;
+            batch->section.flags = FRAME_SECTION_VAR;
+            batch->section.num_items = batch->num_items;
+            batch->sections = &batch->section;
+            batch->num_sections = 1;
+            batch->valid = varItemCount(batch->items, batch->num_items) > 0;
+          }
+        } break;;
+        case PayloadType::FRAME: {
+          if (num_frames == 4 &&
+              frames[1].size() == sizeof(FrameHeader) &&
+              frames[2].size() >= sizeof(FrameSection) &&
+              frames[2].size() % sizeof(FrameSection) == 0 &&
+              frames[3].size() % sizeof(Item) == 0) {
+            batch->frame = static_cast<FrameHeader const*>(frames[1].data());
+            batch->sent = batch->frame->sent;
+            batch->sections =
+                static_cast<FrameSection const*>(frames[2].data());
+            batch->num_sections = frames[2].size() / sizeof(FrameSection);
+            batch->items = static_cast<Item const*>(frames[3].data());
+            batch->num_items = frames[3].size() / sizeof(Item);
+            batch->recorder_id = batch->sections[0].recorder_id;
+
+            // All sections must be valid, the frame is kept whole.
+            size_t num_items = 0;
+            bool valid = true;
+            for (size_t i = 0; i < batch->num_sections && valid; ++i) {
+              auto const& section = batch->sections[i];
+              valid &= section.recorder_id >= 0 &&
+                  section.recorder_id < MAX_RECORDERS &&
+                  section.num_items > 0 &&
+                  num_items + section.num_items <= batch->num_items;
+              if (valid && (section.flags & FRAME_SECTION_VAR)) {
+                valid &= varItemCount(batch->items + num_items,
+                                      section.num_items) > 0;
+              }
+              num_items += section.num_items;
+            }
+            // The header must agree with the sections, it is stored as
+            // the record header.
+            batch->valid = valid && num_items == batch->num_items &&
+                batch->frame->num_items >= 0 &&
+                static_cast<size_t>(batch->frame->num_items) ==
+                    batch->num_items &&
+                batch->frame->num_sections >= 0 &&
+                static_cast<size_t>(batch->frame->num_sections) ==
+                    batch->num_sections;
+          }
+        } break;;
+        case PayloadType::INIT_ITEM: {
+          if (num_frames == 2 && frames[1].size() == sizeof(InitItem)) {
+            batch->init_items = static_cast<InitItem const*>(frames[1].data());
+            batch->num_init_items = 1;
+            batch->recorder_id = batch->init_items->recorder_id;
+            batch->valid = true;
+          }
+        } break;;
+        case PayloadType::INIT_RECORDER: {
+          // The items frame is optional
+          if ((num_frames == 2 || num_frames == 3) &&
+              frames[1].size() == sizeof(InitRecorder)) {
+            batch->recorder_id =
+                static_cast<InitRecorder const*>(frames[1].data())->recorder_id;
+            batch->valid = true;
+          }
+          if (num_frames == 3) {
+            batch->init_items = static_cast<InitItem const*>(frames[2].data());
+            batch->num_init_items = frames[2].size() / sizeof(InitItem);
+            batch->valid &= frames[2].size() % sizeof(InitItem) == 0;
+          }
+        } break;;
+        case PayloadType::CLOCK: {
+          // The recorder ids frame is optional
+          if ((num_frames == 2 || num_frames == 3) &&
+              frames[1].size() == sizeof(ClockSync)) {
+            batch->clock = static_cast<ClockSync const*>(frames[1].data());
+            batch->valid = num_frames == 2 ||
+                frames[2].size() % sizeof(int16_t) == 0;
+          }
+        } break;;
+        default:
+          break;;
+      }
+    }
+    if (batch->clock == nullptr &&
+        (batch->recorder_id < 0 || batch->recorder_id >= MAX_RECORDERS)) {
+      batch->valid = false;
+    }
+    if (batch->valid && clock_) {
+      if (batch->clock != nullptr) {
+        addClock(batch);
+      } else if (clock_config_.correct) {
+        correctTime(batch);
+      }
+    }
+    done(DECODE, batch, begin);
+  }
+  stage_done_[DECODE].store(true, std::memory_order_release);
+}
+
+void
+RecorderSink::runFanout() {
+  place(FANOUT);
+  std::unique_ptr<zmq::socket_t> query_sock;
+  if (!query_address_.empty()) {
+    query_sock.reset(new zmq::socket_t(*RecorderBase::socket_context, ZMQ_REP));
+    zmqutils::bind(query_sock.get(), query_address_);
+  }
+  std::unique_ptr<zmq::socket_t> control_sock;
+  if (!control_address_.empty()) {
+    int constexpr linger = 0;
+    control_sock.reset(
+        new zmq::socket_t(*RecorderBase::socket_context, ZMQ_PUB));
+    control_sock->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+    zmqutils::bind(control_sock.get(), control_address_);
+  }
+  zmq_pollitem_t pollitems[] = {
+    { query_sock ? static_cast<void*>(*query_sock) : nullptr,
+      0, ZMQ_POLLIN, 0 } };
+  auto* const probe_sock = clock_sync_enabled_ ? control_sock.get() : nullptr;
+  if (clock_sync_enabled_ && probe_sock == nullptr) {
+    std::fprintf(stderr, "Clock synchronization requires a control endpoint\n");
+  }
+  next_probe_ = Clock::now();
+
+  std::unique_ptr<zmq::socket_t> telemetry_sock;
+  FILE* telemetry_file = nullptr;
+  if (telemetry_enabled_) {
+    if (!telemetry_config_.address.empty()) {
+      int constexpr linger = 0;
+      telemetry_sock.reset(
+          new zmq::socket_t(*RecorderBase::socket_context, ZMQ_PUB));
+      telemetry_sock->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+      zmqutils::bind(telemetry_sock.get(), telemetry_config_.address);
+    }
+    if (!telemetry_config_.file.empty()) {
+      telemetry_file = std::fopen(telemetry_config_.file.c_str(), "a");
+      if (telemetry_file == nullptr) {
+        perror("Opening telemetry file");
+      }
+    }
+    auto* sock = telemetry_sock.get();
+    telemetry_.reset(new RecorderTelemetry(
+        telemetry_config_,
+        [sock, telemetry_file](std::string const& report) {
+          if (telemetry_file) {
+            std::fprintf(telemetry_file, "%s\n", report.c_str());
+            std::fflush(telemetry_file);
+          }
+          if (sock) {
+            sock->send(report.data(), report.size(), ZMQ_DONTWAIT);
+          }
+        }));
+    clock_offset_ = clockOffset();
+  }
+
+  // Events are published as [RuleEvent][rule name].
+  std::unique_ptr<zmq::socket_t> rules_sock;
+  if (rules_enabled_) {
+    if (!rules_config_.address.empty()) {
+      int constexpr linger = 0;
+      rules_sock.reset(
+          new zmq::socket_t(*RecorderBase::socket_context, ZMQ_PUB));
+      rules_sock->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+      zmqutils::bind(rules_sock.get(), rules_config_.address);
+    }
+    auto* sock = rules_sock.get();
+    auto const& output = rules_output_;
+    rules_.reset(new RecorderRules(
+        rules_config_,
+        [sock, &output](RuleEvent const& event, char const* name) {
+          if (output) {
+            output(event, name);
+          }
+          if (sock) {
+            sock->send(&event, sizeof(event), ZMQ_SNDMORE);
+            sock->send(name, std::strlen(name));
+          }
+        }));
+  }
+
+  // Queries are served between batches, when idle or every 64 batches
+  // when busy.
+  int idle = 0;
+  int64_t num_batches = 0;
+  for (;;) {
+    Batch* batch = nullptr;
+    auto const state = pull(FANOUT, &batch);
+    if (state == Pull::DONE) {
+      break;
+    }
+    if (query_sock && (state == Pull::EMPTY || (num_batches & 63) == 0) &&
+        zmq_poll(pollitems, 1, 0) > 0) {
+      serveQuery(query_sock.get(), control_sock.get());
+    }
+    if (state == Pull::EMPTY) {
+      if (telemetry_ && telemetry_->due(Clock::now())) {
+        reportTelemetry(Clock::now());
+      }
+      if (probe_sock) {
+        probeClock(probe_sock, Clock::now());
+      }
+      backoff(&idle);
+      continue;
+    }
+    idle = 0;
+    ++num_batches;
+
+    auto const begin = Clock::now();
+    if (!batch->valid) {
+      ++invalid_;
+    } else {
+      switch (batch->type) {
+        case PayloadType::DATA:
+        case PayloadType::VARDATA:
+        case PayloadType::FRAME: {
+          auto const* items = batch->items;
+          if (telemetry_) {
+            telemetry_->addBatch(
+                batch->num_items,
+                batch->sent,
+                std::chrono::duration_cast<usec>(
+                    batch->received.time_since_epoch()).count() +
+                clock_offset_);
+          }
+          for (size_t i = 0; i < batch->num_sections; ++i) {
+            auto const& section = batch->sections[i];
+            auto const size = section.num_items * sizeof(Item);
+            if (section.flags & FRAME_SECTION_VAR) {
+              auto const num_items = updateVar(section, items, begin);
+              if (telemetry_) {
+                telemetry_->addItems(section.recorder_id, num_items, size);
+              }
+              items += section.num_items;
+              continue;
+            }
+            if (telemetry_) {
+              telemetry_->addItems(
+                  section.recorder_id, section.num_items, size);
+            }
+            count_ += section.num_items;
+            counter_[section.recorder_id] += section.num_items;
+            cache_.update(section.recorder_id, items, section.num_items, begin);
+            if (rules_) {
+              rules_->add(section.recorder_id, items, section.num_items);
+            }
+            if (observer_) {
+              observer_(section.recorder_id, items, section.num_items);
+            }
+            items += section.num_items;
+          }
+          frames_ += batch->frame != nullptr;
+          priority_ += batch->priority;
+        } break;;
+        case PayloadType::INIT_ITEM: {
+          auto const& init = *batch->init_items;
+          cache_.addItem(init, schemas_.intern(init.name, sizeof(init.name)));
+        } break;;
+        case PayloadType::INIT_RECORDER: {
+          auto const& init =
+              *static_cast<InitRecorder const*>(batch->frames[1].data());
+          auto const* schema = schemas_.find(init.schema_hash);
+          if (schema != nullptr) {
+            ++schemas_reused_;
+          } else {
+            schema = schemas_.add(init.schema_hash,
+                                  batch->init_items,
+                                  batch->num_init_items,
+                                  init.recorder_id);
+          }
+          cache_.addRecorder(init, *schema);
+          if (rules_) {
+            rules_->addRecorder(init.recorder_id,
+                                init.recorder_name,
+                                sizeof(init.recorder_name),
+                                *schema);
+          }
+          if (telemetry_) {
+            telemetry_->addRecorder(init.recorder_id,
+                                    init.recorder_name,
+                                    sizeof(init.recorder_name));
+          }
+        } break;;
+        default:
+          break;;
+      }
+    }
+    done(FANOUT, batch, begin);
+    if (telemetry_ && telemetry_->due(begin)) {
+      reportTelemetry(Clock::now());
+    }
+    if (probe_sock) {
+      probeClock(probe_sock, begin);
+    }
+  }
+  if (telemetry_) {
+    reportTelemetry(Clock::now());
+    telemetry_.reset();
+  }
+  if (telemetry_sock) {
+    telemetry_sock->close();
+  }
+  if (rules_sock) {
+    rules_sock->close();
+  }
+  if (telemetry_file) {
+    std::fclose(telemetry_file);
+  }
+  if (query_sock) {
+    query_sock->close();
+  }
+  if (control_sock) {
+    control_sock->close();
+  }
+  stage_done_[FANOUT].store(true, std::memory_order_release);
+}
+
+void
+RecorderSink::runMerge() {
+  place(MERGE);
+  // Created by the stage thread, the stream is published from it.
+  std::unique_ptr<zmq::socket_t> merge_sock;
+  if (merge_enabled_) {
+    if (!merge_address_.empty()) {
+      int constexpr linger = 0;
+      merge_sock.reset(
+          new zmq::socket_t(*RecorderBase::socket_context, ZMQ_PUB));
+      merge_sock->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+      zmqutils::bind(merge_sock.get(), merge_address_);
+    }
+    auto* sock = merge_sock.get();
+    auto const& output = merge_output_;
+    merge_.reset(new RecorderMerge(
+        merge_config_,
+        [sock, &output](MergedItem const* items, size_t num_items) {
+          if (output) {
+            output(items, num_items);
+          }
+          if (sock) {
+            sock->send(items, num_items * sizeof(MergedItem));
+          }
+        }));
+  }
+
+  int idle = 0;
+  for (;;) {
+    Batch* batch = nullptr;
+    auto const state = pull(MERGE, &batch);
+    if (state == Pull::DONE) {
+      break;
+    } else if (state == Pull::EMPTY) {
+      backoff(&idle);
+      continue;
+    }
+    idle = 0;
+
+    auto const begin = Clock::now();
+    if (merge_ && batch->valid) {
+      auto const* items = batch->items;
+      for (size_t i = 0; i < batch->num_sections; ++i) {
+        auto const& section = batch->sections[i];
+        // The merged stream has fixed size items only.
+        if ((section.flags & FRAME_SECTION_VAR) == 0) {
+          merge_->add(section.recorder_id, items, section.num_items,
+                      batch->priority);
         }
-      } break;;
-      case PayloadType::INIT_ITEM: {
-        auto init = zmqutils::pop<InitItem>(&sock, &zmsg);
-        if (verbose_mode_.load()) {
-          printf("(ITEM): %6d-%d '%s' '%s'\n",
-                 init.recorder_id,
-                 init.key,
-                 init.name,
-                 init.desc);
+        items += section.num_items;
+      }
+    }
+    done(MERGE, batch, begin);
+  }
+  if (merge_) {
+    merge_->flush();
+  }
+  if (merge_sock) {
+    merge_sock->close();
+  }
+  stage_done_[MERGE].store(true, std::memory_order_release);
+}
+
+void
+RecorderSink::runWrite() {
+  place(WRITE);
+  // Created by the stage thread, allocating its buffers locally.
+  if (storage_enabled_) {
+    storage_.reset(new RecorderStorage(storage_config_));
+  }
+
+  // A partially filled storage buffer is written when idle, at most
+  // every flush_interval.
+  auto constexpr flush_interval = msec(100);
+  auto last_flush = Clock::now();
+
+  int idle = 0;
+  for (;;) {
+    Batch* batch = nullptr;
+    auto const state = pull(WRITE, &batch);
+    if (state == Pull::DONE) {
+      break;
+    } else if (state == Pull::EMPTY) {
+      if (storage_ && Clock::now() - last_flush > flush_interval) {
+        storage_->flush();
+        last_flush = Clock::now();
+      }
+      backoff(&idle);
+      continue;
+    }
+    idle = 0;
+
+    auto const begin = Clock::now();
+    if (batch->valid && storage_) {
+      switch (batch->type) {
+        case PayloadType::DATA:
+          storage_->writeData(
+              batch->recorder_id, batch->items, batch->num_items);
+          break;;
+        case PayloadType::VARDATA:
+          storage_->writeVarData(
+              batch->recorder_id, batch->items, batch->num_items);
+          break;;
+        case PayloadType::FRAME:
+          storage_->writeFrame(
+              *batch->frame, batch->sections, batch->num_sections,
+              batch->items, batch->num_items);
+          break;;
+        case PayloadType::INIT_RECORDER:
+          storage_->writeRecorder(
+              *static_cast<InitRecorder const*>(batch->frames[1].data()));
+          // Fall through
+        case PayloadType::INIT_ITEM:
+          for (size_t i = 0; i < batch->num_init_items; ++i) {
+            storage_->writeItem(batch->init_items[i]);
+          }
+          break;;
+        default:
+          break;;
+      }
+    }
+    if (batch->valid && verbose_mode_.load()) {
+      auto const* payload = batch->frames[1].data();
+      switch (batch->type) {
+        case PayloadType::FRAME: {
+          printf("(FRAM): @%03d #%ld %lu sections %lu items from %d\n",
+                 batch->frame->time,
+                 batch->frame->sequence,
+                 batch->num_sections,
+                 batch->num_items,
+                 batch->frame->source);
         }
-      } break;;
-      case PayloadType::INIT_RECORDER: {
-        auto const pkg = zmqutils::pop<InitRecorder>(&sock, &zmsg);
-        if (verbose_mode_.load()) {
-          printf("(REC):  %4d(%ld) L%d '%s'\n",
+        // Fall through
+        case PayloadType::DATA:
+        case PayloadType::VARDATA: {
+          auto const* item = batch->items;
+          for (size_t i = 0; i < batch->num_sections; ++i) {
+            auto const& section = batch->sections[i];
+            if (section.flags & FRAME_SECTION_VAR) {
+              auto const* end = item + section.num_items;
+              while (item < end) {
+                auto const* var = reinterpret_cast<VarItem const*>(item);
+                printf("(VAR):  @%03d %6d-%d T%d L%d C%d -- %s\n",
+                       var->time,
+                       section.recorder_id,
+                       var->key,
+                       static_cast<int>(var->type),
+                       var->length,
+                       var->changed,
+                       varItemStr(var).c_str());
+                item += varItemSlots(var->type, var->length);
+              }
+              continue;
+            }
+            for (int32_t j = 0; j < section.num_items; ++j, ++item) {
+              printf("(DATA): @%03d %6d-%d T%d L%d -- %s\n",
+                     item->time,
+                     section.recorder_id,
+                     item->key,
+                     static_cast<int>(item->type),
+                     item->length,
+                     item->str().c_str());
+            }
+          }
+        } break;;
+        case PayloadType::CLOCK: {
+          auto const& sync = *batch->clock;
+          printf("(CLK):  %08x #%d t1:%ld t2:%ld t3:%ld t4:%ld\n",
+                 static_cast<uint32_t>(sync.process),
+                 sync.sequence,
+                 sync.t1,
+                 sync.t2,
+                 sync.t3,
+                 batch->clock_received);
+        } break;;
+        case PayloadType::INIT_RECORDER: {
+          auto const& pkg = *static_cast<InitRecorder const*>(payload);
+          printf("(REC):  %4d(%ld) L%d '%.*s' %016lx\n",
                  pkg.recorder_id,
                  pkg.external_id,
                  pkg.recorder_num_items,
-                 pkg.recorder_name);
+                 static_cast<int>(sizeof(pkg.recorder_name)),
+                 pkg.recorder_name,
+                 pkg.schema_hash);
         }
-      } break;;
-      default:
-        break;;
+        // Fall through
+        case PayloadType::INIT_ITEM: {
+          for (size_t i = 0; i < batch->num_init_items; ++i) {
+            auto const& init = batch->init_items[i];
+            printf("(ITEM): %6d-%d '%.*s' '%.*s'\n",
+                   init.recorder_id,
+                   init.key,
+                   static_cast<int>(sizeof(init.name)),
+                   init.name,
+                   static_cast<int>(sizeof(init.desc)),
+                   init.desc);
+          }
+        } break;;
+        default:
+          break;;
+      }
     }
+    release(batch);
+    done(WRITE, batch, begin);
+  }
+  if (storage_) {
+    storage_->sync();
+  }
+  stop_time_ = Clock::now();
+  stage_done_[WRITE].store(true, std::memory_order_release);
+}
 
-    size_t idx = 0;
-    while (idx < (zmsg.size()/sizeof(Item))) {
-      ++idx;
+void
+RecorderSink::setLevel(InitRecorder const& init) {
+  if (init.recorder_id < 0 || init.recorder_id >= MAX_RECORDERS) {
+    return;
+  }
+  // Longest matching name prefix.
+  auto const* recorder_name = init.recorder_name;
+  std::string const name(
+      recorder_name, strnlen(recorder_name, sizeof(init.recorder_name)));
+  auto level = shedding_.default_level;
+  size_t longest = 0;
+  for (auto const& prefix : shedding_.levels) {
+    if (prefix.first.size() >= longest &&
+        name.compare(0, prefix.first.size(), prefix.first) == 0) {
+      level = prefix.second;
+      longest = prefix.first.size();
     }
   }
-  sock.close();
+  levels_[init.recorder_id] = level;
+}
 
-  auto const mib = 1<<20;
+RecorderSink::Level
+RecorderSink::level(Batch const& batch, int16_t* recorder_id) {
+  // Malformed messages are left to the decode stage.
+  auto const& frames = batch.frames;
+  PayloadType type;
+  if (frames[0].size() != sizeof(type)) {
+    return Level::CRITICAL;
+  }
+  std::memcpy(&type, frames[0].data(), sizeof(type));
+  switch (type) {
+    case PayloadType::DATA:
+    case PayloadType::VARDATA:
+      if (batch.num_frames >= 3 && frames[1].size() == sizeof(*recorder_id)) {
+        std::memcpy(recorder_id, frames[1].data(), sizeof(*recorder_id));
+        if (*recorder_id >= 0 && *recorder_id < MAX_RECORDERS) {
+          return levels_[*recorder_id];
+        }
+      }
+      break;;
+    case PayloadType::INIT_RECORDER:
+      if (frames[1].size() == sizeof(InitRecorder)) {
+        setLevel(*static_cast<InitRecorder const*>(frames[1].data()));
+      }
+      break;;
+    case PayloadType::FRAME:
+      // The most important recorder of the frame decides.
+      if (batch.num_frames == 4 && frames[2].size() >= sizeof(FrameSection) &&
+          frames[2].size() % sizeof(FrameSection) == 0) {
+        auto const* sections =
+            static_cast<FrameSection const*>(frames[2].data());
+        auto const num_sections = frames[2].size() / sizeof(FrameSection);
+        auto max_level = Level::LOW;
+        for (size_t i = 0; i < num_sections; ++i) {
+          auto const id = sections[i].recorder_id;
+          if (id < 0 || id >= MAX_RECORDERS) {
+            return Level::CRITICAL;
+          }
+          max_level = std::max(max_level, levels_[id]);
+        }
+        *recorder_id = sections[0].recorder_id;
+        return max_level;
+      }
+      break;;
+    default:
+      break;;
+  }
+  return Level::CRITICAL;
+}
 
-  auto t2 = std::chrono::high_resolution_clock::now();
-  auto duration = std::chrono::duration_cast<usec>(t2 - t1);
-  double duration_msec = duration.count()/1000.0;
-  printf("Messages:     %ld (%.3fms)\n", count, duration_msec);
-  printf("Messages/sec: %.1f (%.1fMiB/sec)\n",
-         count * 1000 / duration_msec,
-         sizeof(Item) * count * 1000 / (mib * duration_msec));
+bool
+RecorderSink::shed(Batch const& batch, size_t size) {
+  auto const max_bytes = shedding_.max_bytes;
+  if (max_bytes == 0 || batch.priority) {
+    return false;
+  }
+  int16_t recorder_id = -1;
+  auto const shed_level = level(batch, &recorder_id);
+  if (shed_level == Level::CRITICAL) {
+    return false;
+  }
+  auto const arena = arena_bytes_.load(std::memory_order_relaxed);
+  bool drop = arena + size > max_bytes;
+  auto const threshold =
+      shedding_.thresholds[static_cast<size_t>(shed_level)] * max_bytes;
+  if (!drop && arena >= threshold) {
+    drop = shedding_.policy == Shedding::Policy::DROP ||
+        ++decimation_count_[recorder_id] % shedding_.decimation != 0;
+  }
+  if (!drop) {
+    return false;
+  }
 
-  int total = 0;
-  for (size_t i = 0; i < counter.max_size(); ++i) {
-    if (counter[i] == 0) {
-      continue;
+  // Account the shed items per recorder.
+  auto const& frames = batch.frames;
+  int64_t items = 0;
+  PayloadType type;
+  std::memcpy(&type, frames[0].data(), sizeof(type));
+  if (type == PayloadType::FRAME) {
+    auto const* sections = static_cast<FrameSection const*>(frames[2].data());
+    auto const num_sections = frames[2].size() / sizeof(FrameSection);
+    for (size_t i = 0; i < num_sections; ++i) {
+      shed_counter_[sections[i].recorder_id] += sections[i].num_items;
+      items += sections[i].num_items;
     }
-    printf("(RECV): %2lu:%d\n", i, counter[i]);
-    total += counter[i];
+  } else {
+    auto const* slots = static_cast<Item const*>(frames[2].data());
+    auto const num_slots = frames[2].size() / sizeof(Item);
+    items = type == PayloadType::VARDATA ?
+        std::max(0, varItemCount(slots, num_slots)) : num_slots;
+    shed_counter_[recorder_id] += items;
   }
-  printf("(RECV): %d\n", total);
+  auto constexpr relaxed = std::memory_order_relaxed;
+  shed_batches_.store(shed_batches_.load(relaxed) + 1, relaxed);
+  shed_items_.store(shed_items_.load(relaxed) + items, relaxed);
+  shed_bytes_.store(shed_bytes_.load(relaxed) + size, relaxed);
+  return true;
+}
+
+void
+RecorderSink::release(Batch* batch) {
+  // Free the message buffers, so that idle batches hold no data.
+  for (size_t i = 0; i < batch->num_frames; ++i) {
+    batch->frames[i].rebuild();
+  }
+  arena_bytes_.fetch_sub(batch->bytes);
+  batch->bytes = 0;
+}
+
+void
+RecorderSink::reportTelemetry(Clock::time_point now) {
+  RecorderTelemetry::Pipeline pipeline;
+  pipeline.receive_busy_nsec =
+      stage_counters_[RECEIVE].busy.load(std::memory_order_relaxed);
+  pipeline.shed_items = shed_items_.load(std::memory_order_relaxed);
+  for (auto const& stats : pipelineStats()) {
+    pipeline.queues.emplace_back(stats.name, stats.queue_depth);
+  }
+  telemetry_->report(now, pipeline);
+
+  // Resampled with every report, the system clock may be adjusted.
+  clock_offset_ = clockOffset();
+}
+
+void
+RecorderSink::addClock(Batch* batch) {
+  // Resampled with every echo, the system clock may be adjusted.
+  sync_clock_offset_ = clockOffset();
+  batch->clock_received = sync_clock_offset_ +
+      std::chrono::duration_cast<usec>(
+          batch->received.time_since_epoch()).count();
+  auto const& frames = batch->frames;
+  bool const has_ids = batch->num_frames == 3;
+  clock_->add(*batch->clock,
+              batch->clock_received,
+              has_ids ? static_cast<int16_t const*>(frames[2].data()) : nullptr,
+              has_ids ? frames[2].size() / sizeof(int16_t) : 0);
+}
+
+void
+RecorderSink::correctTime(Batch* batch) {
+  auto const now = sync_clock_offset_ +
+      std::chrono::duration_cast<usec>(
+          batch->received.time_since_epoch()).count();
+  // The message buffers are owned by the batch.
+  auto* items = const_cast<Item*>(batch->items);
+  for (size_t i = 0; i < batch->num_sections; ++i) {
+    auto const& section = batch->sections[i];
+    auto* const end = items + section.num_items;
+    auto const correction = clock_->correction(section.recorder_id, now);
+    if (correction != 0 && (section.flags & FRAME_SECTION_VAR)) {
+      while (items < end) {
+        auto* var = reinterpret_cast<VarItem*>(items);
+        var->time = shiftTime(var->time, correction);
+        items += varItemSlots(var->type, var->length);
+      }
+    } else if (correction != 0) {
+      for (; items < end; ++items) {
+        items->time = shiftTime(items->time, correction);
+      }
+    }
+    // A frame is recorded by a single thread, the correction of any of
+    // its recorders applies to the frame time.
+    if (i == 0 && batch->frame != nullptr) {
+      auto* frame = const_cast<FrameHeader*>(batch->frame);
+      frame->time = shiftTime(frame->time, correction);
+    }
+    items = end;
+  }
+}
+
+void
+RecorderSink::probeClock(zmq::socket_t* sock, Clock::time_point now) {
+  // None while draining, the echoes would keep the receive stage busy.
+  if (now < next_probe_ || !poller_running_.load()) {
+    return;
+  }
+  next_probe_ = now + clock_config_.interval;
+  ClockSync probe;
+  probe.sequence = static_cast<int32_t>(clock_probes_++);
+  probe.process = 0;
+  probe.t1 = systemTime();
+  probe.t2 = 0;
+  probe.t3 = 0;
+  sock->send(&probe, sizeof(probe), ZMQ_DONTWAIT);
+}
+
+size_t
+RecorderSink::updateVar(FrameSection const& section,
+                        Item const* slots,
+                        Clock::time_point now) {
+  size_t num_items = 0;
+  auto const* end = slots + section.num_items;
+  while (slots < end) {
+    auto const* var = reinterpret_cast<VarItem const*>(slots);
+    auto const head = varItemHead(var);
+    ++count_;
+    ++counter_[section.recorder_id];
+    cache_.update(section.recorder_id, &head, 1, now);
+    if (rules_) {
+      rules_->add(section.recorder_id, &head, 1);
+    }
+    if (observer_) {
+      observer_(section.recorder_id, &head, 1);
+    }
+    slots += varItemSlots(var->type, var->length);
+    ++num_items;
+  }
+  return num_items;
+}
+
+void
+RecorderSink::serveQuery(zmq::socket_t* sock, zmq::socket_t* control_sock) {
+  zmq::message_t zmsg;
+  std::vector<std::string> frames;
+  do {
+    sock->recv(&zmsg);
+    frames.emplace_back(static_cast<char const*>(zmsg.data()), zmsg.size());
+  } while (zmqutils::more(sock));
+
+  std::vector<CacheEntry> entries;
+  std::string names;
+  auto const now = RecorderCache::Clock::now();
+
+  QueryType type;
+  if (frames[0].size() == sizeof(type)) {
+    std::memcpy(&type, frames[0].data(), sizeof(type));
+    switch (type) {
+      case QueryType::LOOKUP: {
+        if (frames.size() > 1) {
+          auto const* keys =
+              reinterpret_cast<QueryKey const*>(frames[1].data());
+          cache_.lookup(keys, frames[1].size() / sizeof(QueryKey),
+                        now, &entries, &names);
+        }
+      } break;;
+      case QueryType::PREFIX: {
+        if (frames.size() > 2) {
+          cache_.prefix(frames[1], frames[2], now, &entries, &names);
+        }
+      } break;;
+      case QueryType::STALE: {
+        int64_t max_age = 0;
+        if (frames.size() > 1 && frames[1].size() == sizeof(max_age)) {
+          std::memcpy(&max_age, frames[1].data(), sizeof(max_age));
+          cache_.stale(msec(max_age), now, &entries, &names);
+        }
+      } break;;
+      case QueryType::CONTROL: {
+        if (control_sock && frames.size() > 1 &&
+            frames[1].size() == sizeof(ControlCommand)) {
+          control_sock->send(frames[1].data(), frames[1].size());
+          ++control_commands_;
+        }
+      } break;;
+      default:
+        break;;
+    }
+  }
+
+  // A REP socket must always answer, malformed queries get an empty
+  // reply.
+  sock->send(entries.data(), entries.size() * sizeof(CacheEntry), ZMQ_SNDMORE);
+  sock->send(names.data(), names.size());
 }
@@ -25,10 +25,44 @@
 #pragma once
 
 #include "Recorder.h"
+#include "RecorderCache.h"
+#include "RecorderClock.h"
+#include "RecorderMerge.h"
+#include "RecorderQueue.h"
+#include "RecorderRules.h"
+#include "RecorderSchema.h"
+#include "RecorderStorage.h"
+#include "RecorderTelemetry.h"
 
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
 #include <thread>
+#include <vector>
 
+// The sink is a pipeline of stages, each running in its own thread and
+// connected by bounded lock-free queues carrying whole batches (one
+// zeromq message each):
+//
+//   receive -> decode -> fanout -> merge -> write
+//
+// receive: Reads messages from the PULL socket into pooled batches.
+// decode:  Validates and decodes the message frames.
+// fanout:  Accounting and last-value cache, serves cache queries.
+// merge:   Time ordered stream across recorders, if enabled.
+// write:   Storage and verbose output, returns batches to the pool.
+//
+// The fanout stage also reports periodic telemetry, see setTelemetry(),
+// and evaluates rules on the items, see setRules(). The decode stage
+// corrects the item times for the clock offsets of the producers, see
+// setClockSync().
+//
+// The batch pool bounds the number of messages in flight, when it is
+// exhausted the receive stage stops reading and the backpressure is left
+// to zeromq. The bytes in flight can additionally be bounded by a
+// shedding arena, see setShedding().
 class RecorderSink : public RecorderBase {
  public:
   RecorderSink(RecorderSink const&) = delete;
@@ -37,13 +71,282 @@ class RecorderSink : public RecorderBase {
   RecorderSink();
   ~RecorderSink();
 
+  // Recorder ids at or above are rejected, processes sharing a sink must
+  // allocate their ranges below (see RecorderBase::setRecorderIdBase()).
+  static int constexpr MAX_RECORDERS = 4096;
+
+  // Address for the last-value cache query (REQ/REP) endpoint, must be
+  // set before start(). No endpoint is bound if empty.
+  void setQueryAddress(std::string const& address);
+
+  // Bind address for the control channel (PUB), must be set before
+  // start(). CONTROL queries are published on it to the processes that
+  // subscribe using RecorderBase::setControlAddress().
+  void setControlEndpoint(std::string const& address);
+
+  // Bind address for the priority lane (PULL), must be set before
+  // start(). Messages of the producers' priority lane (see
+  // RecorderBase::setPriorityAddress()) are received before, and pass
+  // every stage ahead of, the bulk data, with their own batch pool.
+  void setPriorityEndpoint(std::string const& address);
+
+  // Persist all received data to segment files, must be called before
+  // start().
+  void setStorage(RecorderStorage::Config const& config);
+
+  // Merge the data of all recorders into one time ordered stream (see
+  // RecorderMerge), must be called before start(). The stream is passed
+  // to output, called from the merge stage thread, and published on a
+  // PUB socket bound to address. Either may be empty.
+  void setMerge(RecorderMerge::Config const& config,
+                std::string const& address,
+                RecorderMerge::Output const& output = RecorderMerge::Output());
+
+  // Load shedding. The received messages in flight, from the receive
+  // stage until written, form an arena of at most max_bytes. When the
+  // arena fills up data messages of recorders are shed by level, a level
+  // is shed from its threshold (fraction of max_bytes) up, dropped or
+  // decimated to every decimation:th message according to the policy.
+  // Messages that do not fit the arena are always dropped. Schemas, the
+  // priority lane and CRITICAL recorders are never shed, they are only
+  // bounded by the batch pool. Recorders get the level of the longest
+  // matching name prefix in levels, or default_level.
+  enum class Level : int8_t { LOW, NORMAL, HIGH, CRITICAL, };
+  struct Shedding {
+    enum class Policy { DROP, DECIMATE, };
+    Shedding();
+    size_t  max_bytes;  // Zero for no limit (default)
+    Policy  policy;
+    int32_t decimation;
+    std::array<double, 3> thresholds;  // LOW, NORMAL and HIGH
+    Level   default_level;
+    std::vector<std::pair<std::string, Level> > levels;
+  };
+
+  // Must be called before start().
+  void setShedding(Shedding const& shedding);
+
+  // Shed data and arena usage, safe to call from any thread while the
+  // sink is running.
+  struct SheddingStats {
+    size_t  arena_bytes;
+    size_t  arena_peak;
+    int64_t batches;  // Shed
+    int64_t items;
+    int64_t bytes;
+  };
+  SheddingStats sheddingStats() const;
+
+  // Periodic telemetry (see RecorderTelemetry), appended to a file and
+  // published on a PUB socket by the fanout stage. Must be called before
+  // start().
+  void setTelemetry(RecorderTelemetry::Config const& config);
+
+  // Clock synchronization with the producer processes (see
+  // RecorderClock). The fanout stage publishes a probe on the control
+  // channel every interval, the echoes are received by the decode stage,
+  // which estimates the clock of each process and, if config.correct,
+  // subtracts the offset from the item times of its recorders (and the
+  // frame time) on ingest. Items recorded before the first echo of a
+  // process are not corrected. For symmetric delays the producers should
+  // echo on the priority lane. Requires the control endpoint, must be
+  // called before start().
+  void setClockSync(RecorderClock::Config const& config);
+
+  // Clock estimates of the producer processes, safe to call after
+  // stop().
+  std::vector<RecorderClock::Estimate> clockEstimates() const;
+
+  // Evaluate rules (see RecorderRules) on the items of each DATA batch
+  // and frame section, and the head of each variable length item, in the
+  // fanout stage. Events are passed to output, called from the fanout
+  // stage thread, and published on a PUB socket bound to config.address.
+  // Either may be empty. Must be called before start().
+  void setRules(RecorderRules::Config const& config,
+                RecorderRules::Output const& output = RecorderRules::Output());
+
+  // Rule counters, safe to call after stop().
+  struct RuleStats {
+    size_t  rules;
+    size_t  bound;      // Channel bindings
+    int64_t evaluated;  // Items of channels with rules
+    int64_t raised;
+    int64_t cleared;
+  };
+  RuleStats ruleStats() const;
+
+  // Pin the stage threads to cpus, in stage order: receive, decode,
+  // fanout, merge and write. Stages without a cpu, or -1, are left to
+  // the scheduler. Each stage allocates its own state (the receive stage
+  // the batch pool) after it is pinned, so that it is local to the NUMA
+  // node of its cpu. Must be called before start().
+  void setAffinity(std::vector<int> const& cpus);
+
+  // Called by the fanout stage with the items of each DATA batch and
+  // frame section, must be set before start(). Variable length items
+  // are passed one at a time as their head, see varItemHead().
+  typedef std::function<void(int16_t, Item const*, size_t)> Observer;
+  void setObserver(Observer const& observer);
+
   void start(bool verbose);
   void stop();
 
+  // Snapshot of a pipeline stage. The queue is the input queue of the
+  // stage, latency is the time spent processing a batch. For the
+  // receive stage the queue depth is the number of batches in flight.
+  struct StageStats {
+    std::string name;
+    size_t  queue_depth;
+    size_t  queue_capacity;
+    int64_t batches;
+    double  avg_latency_usec;
+    double  max_latency_usec;
+  };
+
+  // Safe to call from any thread while the sink is running.
+  std::vector<StageStats> pipelineStats() const;
+
  private:
+  struct Batch;
+  typedef RecorderQueue<Batch*> BatchQueue;
+  typedef std::chrono::steady_clock Clock;
+
+  enum Stage { RECEIVE, DECODE, FANOUT, MERGE, WRITE, NUM_STAGES, };
+
+  // Per stage counters, written by the stage thread only.
+  struct StageCounters {
+    StageCounters() : batches(0), busy(0), max(0) {}
+    std::atomic<int64_t> batches;
+    std::atomic<int64_t> busy;  // Nanoseconds
+    std::atomic<int64_t> max;   // Nanoseconds
+  };
+
+  // Pins the calling stage thread, see setAffinity().
+  void place(Stage stage);
+  void allocateBatches();
+
   void run();
+  void runDecode();
+  void runFanout();
+  void runMerge();
+  void runWrite();
+
+  // Stage helpers. pull() pops a batch from the input queue of the
+  // stage, DONE when the upstream stage is done and the queue drained.
+  // done() accounts the processing time and passes the batch on.
+  enum class Pull { BATCH, EMPTY, DONE, };
+  Pull pull(Stage stage, Batch** batch);
+  void done(Stage stage, Batch* batch, Clock::time_point begin);
+
+  void serveQuery(zmq::socket_t* sock, zmq::socket_t* control_sock);
+
+  // Receive stage shedding decision for a received batch of size bytes,
+  // returns true if shed. release() returns the bytes of a batch when it
+  // leaves the pipeline. level() is the shedding level of a batch, and
+  // also picks up the level of recorders from their schemas.
+  bool shed(Batch const& batch, size_t size);
+  void release(Batch* batch);
+  Level level(Batch const& batch, int16_t* recorder_id);
+  void setLevel(InitRecorder const& init);
+
+  // Fanout of a section of variable length items, the cache keeps the
+  // head of each item. Returns the number of items.
+  size_t updateVar(FrameSection const& section,
+                   Item const* slots,
+                   Clock::time_point now);
+
+  void reportTelemetry(Clock::time_point now);
+
+  // Decode stage clock synchronization, the echo of a CLOCK batch and
+  // the correction of the item times of a data batch.
+  void addClock(Batch* batch);
+  void correctTime(Batch* batch);
+
+  // Fanout stage, publish a clock probe if due.
+  void probeClock(zmq::socket_t* sock, Clock::time_point now);
+
+  static int constexpr BATCH_POOL_SIZE = 1<<10;
+  static int constexpr PRIORITY_POOL_SIZE = 1<<6;
+
+  RecorderCache cache_;
+  std::string query_address_;
+  std::string control_address_;
+  std::string priority_address_;
+  Observer observer_;
+  int64_t control_commands_;
+
+  // Schema registry, owned by the fanout stage.
+  RecorderSchema schemas_;
+  int64_t schemas_reused_;
+
+  // Merged stream, owned by the merge stage.
+  bool merge_enabled_;
+  RecorderMerge::Config merge_config_;
+  std::string merge_address_;
+  RecorderMerge::Output merge_output_;
+  std::unique_ptr<RecorderMerge> merge_;
+
+  // Telemetry, owned by the fanout stage. The clock offset converts
+  // receive times to microseconds since epoch.
+  bool telemetry_enabled_;
+  RecorderTelemetry::Config telemetry_config_;
+  std::unique_ptr<RecorderTelemetry> telemetry_;
+  int64_t clock_offset_;
+
+  // Rules, owned by the fanout stage.
+  bool rules_enabled_;
+  RecorderRules::Config rules_config_;
+  RecorderRules::Output rules_output_;
+  std::unique_ptr<RecorderRules> rules_;
+
+  // Clock synchronization, the estimates are owned by the decode stage,
+  // the probes sent by the fanout stage. The clock offset converts
+  // receive times to microseconds since epoch.
+  bool clock_sync_enabled_;
+  RecorderClock::Config clock_config_;
+  std::unique_ptr<RecorderClock> clock_;
+  int64_t sync_clock_offset_;
+  int64_t clock_probes_;
+  Clock::time_point next_probe_;
+
+  // Storage, owned by the write stage.
+  bool storage_enabled_;
+  RecorderStorage::Config storage_config_;
+  std::unique_ptr<RecorderStorage> storage_;
+
+  // Shedding, owned by the receive stage. The level of a recorder is
+  // set from its name when its schema is received.
+  Shedding shedding_;
+  std::array<Level, MAX_RECORDERS> levels_;
+  std::array<int32_t, MAX_RECORDERS> decimation_count_;
+  std::array<int32_t, MAX_RECORDERS> shed_counter_;
+  std::atomic<size_t> arena_bytes_;
+  std::atomic<size_t> arena_peak_;
+  std::atomic<int64_t> shed_batches_;
+  std::atomic<int64_t> shed_items_;
+  std::atomic<int64_t> shed_bytes_;
+  Batch* spare_;  // Shed batch, reused by the receive stage
+
+  // Accounting, owned by the fanout stage.
+  std::array<int32_t, MAX_RECORDERS> counter_;
+  int64_t count_;
+  int64_t frames_;
+  int64_t priority_;
+  int64_t invalid_;
+
+  // Input queue per stage, the input of the receive stage is the pool
+  // of free batches. The priority lane has its own queues, popped first.
+  std::vector<std::unique_ptr<Batch> > batches_;
+  std::array<std::unique_ptr<BatchQueue>, NUM_STAGES> queues_;
+  std::array<std::unique_ptr<BatchQueue>, NUM_STAGES> priority_queues_;
+  std::array<StageCounters, NUM_STAGES> stage_counters_;
+  std::array<std::atomic<bool>, NUM_STAGES> stage_done_;
+  std::array<int, NUM_STAGES> cpus_;
+  Clock::time_point start_time_;
+  Clock::time_point stop_time_;
 
   std::atomic<bool> verbose_mode_;
   std::atomic<bool> poller_running_;
   std::thread poller_thread_;
+  std::array<std::thread, NUM_STAGES - 1> stage_threads_;
 };
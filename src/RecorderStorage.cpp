@@ -0,0 +1,756 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#include "RecorderStorage.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace {
+void Error(char const* msg) { std::fprintf(stderr, "%s\n", msg); }
+
+// Alignment and size granularity of O_DIRECT writes.
+size_t constexpr DIRECT_BLOCK = 4096;
+size_t constexpr MIN_BUFFER_SIZE = 16 * DIRECT_BLOCK;
+}  // namespace
+
+
+// IO implementations
+// ----------------------------------------------------------------------------
+class RecorderStorage::IO {
+ public:
+  typedef std::function<void(int, int64_t)> Callback;
+
+  explicit IO(Callback const& on_complete) : on_complete_(on_complete) {}
+  virtual ~IO() {}
+
+  virtual char const* name() const = 0;
+
+  // Write size bytes from buffer at offset. The completion callback is
+  // called with the buffer index and the number of bytes written or a
+  // negative errno.
+  virtual void write(int fd,
+                     int buffer,
+                     char const* data,
+                     size_t size,
+                     int64_t offset) = 0;
+
+  // Fsync and close fd once all writes to it have completed.
+  virtual void syncClose(int fd) = 0;
+
+  // Process completions, if wait block until at least one completes.
+  virtual void reap(bool wait) = 0;
+
+  // Wait for all outstanding operations.
+  virtual void drain() = 0;
+
+ protected:
+  Callback on_complete_;
+};
+
+namespace {
+
+class SyncIO : public RecorderStorage::IO {
+ public:
+  explicit SyncIO(Callback const& on_complete) : IO(on_complete) {}
+
+  char const* name() const { return "sync"; }
+
+  void write(int fd,
+             int buffer,
+             char const* data,
+             size_t size,
+             int64_t offset) {
+    size_t done = 0;
+    while (done < size) {
+      auto const rval = pwrite(fd, data + done, size - done, offset + done);
+      if (rval < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        on_complete_(buffer, -errno);
+        return;
+      }
+      done += rval;
+    }
+    on_complete_(buffer, done);
+  }
+
+  void syncClose(int fd) {
+    if (fsync(fd) != 0) {
+      perror("fsync");
+    }
+    close(fd);
+  }
+
+  void reap(bool) {}
+  void drain() {}
+};
+
+// Minimal io_uring implementation on top of the raw system calls, only
+// the write and fsync operations needed by the storage are supported.
+class UringIO : public RecorderStorage::IO {
+ public:
+  // Returns nullptr if io_uring is not available.
+  static UringIO* create(Callback const& on_complete,
+                         std::vector<iovec> const& buffers) {
+    std::unique_ptr<UringIO> uring(new UringIO(on_complete, buffers.size()));
+    if (!uring->setup(buffers)) {
+      return nullptr;
+    }
+    return uring.release();
+  }
+
+  ~UringIO() {
+    if (ring_fd_ >= 0) {
+      drain();
+    }
+    if (sqes_ != nullptr) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) {
+      munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_ != nullptr) {
+      munmap(sq_ring_, sq_ring_size_);
+    }
+    if (ring_fd_ >= 0) {
+      close(ring_fd_);
+    }
+  }
+
+  char const* name() const { return "io_uring"; }
+
+  void write(int fd,
+             int buffer,
+             char const* data,
+             size_t size,
+             int64_t offset) {
+    auto* sqe = getSqe();
+    if (registered_) {
+      sqe->opcode = IORING_OP_WRITE_FIXED;
+      sqe->addr = reinterpret_cast<uint64_t>(data);
+      sqe->len = size;
+      sqe->buf_index = buffer;
+    } else {
+      auto& iov = write_iovecs_[buffer];
+      iov.iov_base = const_cast<char*>(data);
+      iov.iov_len = size;
+      sqe->opcode = IORING_OP_WRITEV;
+      sqe->addr = reinterpret_cast<uint64_t>(&iov);
+      sqe->len = 1;
+    }
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->user_data = buffer;
+    buffer_fds_[buffer] = fd;
+    ++files_[fd].writes;
+    submit();
+  }
+
+  void syncClose(int fd) {
+    auto& file = files_[fd];
+    file.closing = true;
+    if (file.writes == 0) {
+      submitSync(fd);
+    }
+  }
+
+  void reap(bool wait) {
+    auto head = *cq_head_;
+    for (;;) {
+      auto const tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      if (head == tail) {
+        if (!wait || in_flight_ == 0) {
+          break;
+        }
+        enter(0, 1, IORING_ENTER_GETEVENTS);
+        continue;
+      }
+      auto const cqe = cqes_[head & *cq_mask_];
+      __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+      --in_flight_;
+      wait = false;
+      complete(cqe.user_data, cqe.res);
+    }
+  }
+
+  void drain() {
+    while (in_flight_ > 0) {
+      reap(true);
+    }
+  }
+
+ private:
+  static uint64_t constexpr FSYNC_TAG = 1ull << 32;
+
+  struct File {
+    File() : writes(0), closing(false) {}
+    int  writes;
+    bool closing;
+  };
+
+  UringIO(Callback const& on_complete, size_t num_buffers)
+      : IO(on_complete)
+      , ring_fd_(-1)
+      , sq_ring_(nullptr)
+      , cq_ring_(nullptr)
+      , sqes_(nullptr)
+      , sq_ring_size_(0)
+      , cq_ring_size_(0)
+      , sqes_size_(0)
+      , registered_(false)
+      , in_flight_(0)
+      , write_iovecs_(num_buffers)
+      , buffer_fds_(num_buffers, -1) {
+  }
+
+  bool setup(std::vector<iovec> const& buffers) {
+    // Room for all buffers and the fsyncs of a few segments.
+    unsigned entries = 8;
+    while (entries < 2 * buffers.size() + 8) {
+      entries <<= 1;
+    }
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd_ < 0) {
+      return false;
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool const single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    sq_ring_ = map(sq_ring_size_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == nullptr) {
+      return false;
+    }
+    cq_ring_ = single_mmap ? sq_ring_ : map(cq_ring_size_, IORING_OFF_CQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe*>(map(sqes_size_, IORING_OFF_SQES));
+    if (cq_ring_ == nullptr || sqes_ == nullptr) {
+      return false;
+    }
+
+    auto* sq = static_cast<char*>(sq_ring_);
+    auto* cq = static_cast<char*>(cq_ring_);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sq_entries_ = params.sq_entries;
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    // Registered buffers save the page pinning per write but may fail
+    // on a low RLIMIT_MEMLOCK, plain vectored writes are used then.
+    registered_ = syscall(__NR_io_uring_register, ring_fd_,
+                          IORING_REGISTER_BUFFERS,
+                          buffers.data(), buffers.size()) == 0;
+    return true;
+  }
+
+  void* map(size_t size, off_t offset) {
+    auto* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd_, offset);
+    return ptr == MAP_FAILED ? nullptr : ptr;
+  }
+
+  int enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    int rval;
+    do {
+      rval = syscall(__NR_io_uring_enter, ring_fd_,
+                     to_submit, min_complete, flags, nullptr, 0);
+    } while (rval < 0 && errno == EINTR);
+    return rval;
+  }
+
+  io_uring_sqe* getSqe() {
+    while (in_flight_ >= static_cast<int>(sq_entries_)) {
+      reap(true);
+    }
+    auto const tail = *sq_tail_;
+    auto const index = tail & *sq_mask_;
+    auto* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    return sqe;
+  }
+
+  void submit() {
+    __atomic_store_n(sq_tail_, *sq_tail_ + 1, __ATOMIC_RELEASE);
+    ++in_flight_;
+    if (enter(1, 0, 0) < 0) {
+      perror("io_uring_enter");
+    }
+  }
+
+  void submitSync(int fd) {
+    auto* sqe = getSqe();
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = fd;
+    sqe->user_data = FSYNC_TAG | static_cast<uint32_t>(fd);
+    files_.erase(fd);
+    submit();
+  }
+
+  void complete(uint64_t user_data, int32_t res) {
+    if (user_data & FSYNC_TAG) {
+      int const fd = static_cast<int>(user_data & 0xffffffff);
+      if (res < 0) {
+        std::fprintf(stderr, "fsync: %s\n", std::strerror(-res));
+      }
+      close(fd);
+      return;
+    }
+    int const buffer = static_cast<int>(user_data);
+    int const fd = buffer_fds_[buffer];
+    on_complete_(buffer, res);
+    auto& file = files_[fd];
+    if (--file.writes == 0 && file.closing) {
+      submitSync(fd);
+    }
+  }
+
+  int ring_fd_;
+  void* sq_ring_;
+  void* cq_ring_;
+  io_uring_sqe* sqes_;
+  size_t sq_ring_size_;
+  size_t cq_ring_size_;
+  size_t sqes_size_;
+
+  unsigned* sq_tail_;
+  unsigned* sq_mask_;
+  unsigned* sq_array_;
+  unsigned  sq_entries_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned* cq_mask_;
+  io_uring_cqe* cqes_;
+
+  bool registered_;
+  int in_flight_;
+  std::vector<iovec> write_iovecs_;
+  std::vector<int> buffer_fds_;
+  std::map<int, File> files_;
+};
+
+}  // namespace
+// ----------------------------------------------------------------------------
+
+
+RecorderStorage::Config::Config()
+    : directory(".")
+    , segment_size(256 << 20)
+    , buffer_size(1 << 20)
+    , num_buffers(8)
+    , direct(false)
+    , io(IOMode::AUTO) {
+}
+
+RecorderStorage::RecorderStorage(Config const& config)
+    : config_(config)
+    , direct_(config.direct)
+    , current_(0)
+    , fd_(-1)
+    , sequence_(0)
+    , segment_offset_(0)
+    , segment_full_(false)
+    , bytes_written_(0)
+    , write_errors_(0) {
+  if (config_.buffer_size < MIN_BUFFER_SIZE ||
+      config_.segment_size < 2 * config_.buffer_size + DIRECT_BLOCK ||
+      config_.num_buffers < 1) {
+    Error("Storage buffer or segment size too small");
+    std::exit(1);
+  }
+  if (mkdir(config_.directory.c_str(), 0755) != 0 && errno != EEXIST) {
+    perror(config_.directory.c_str());
+    std::exit(1);
+  }
+
+  // Continue after the last existing segment, compaction (see
+  // RecorderCompactor.h) leaves gaps in the sequence which must not be
+  // filled.
+  if (DIR* dir = opendir(config_.directory.c_str())) {
+    while (dirent* entry = readdir(dir)) {
+      uint32_t sequence;
+      if (parseSegmentName(entry->d_name, &sequence)) {
+        sequence_ = std::max(sequence_, sequence + 1);
+      }
+    }
+    closedir(dir);
+  }
+
+  // Buffers are block aligned for O_DIRECT, with an extra block for
+  // the padding of partially filled buffers.
+  std::vector<iovec> iovecs;
+  for (int i = 0; i < config_.num_buffers; ++i) {
+    void* data = nullptr;
+    auto const size = config_.buffer_size + DIRECT_BLOCK;
+    if (posix_memalign(&data, DIRECT_BLOCK, size) != 0) {
+      Error("Failed to allocate storage buffers");
+      std::exit(1);
+    }
+    std::memset(data, 0, size);
+    buffers_.push_back(Buffer{static_cast<char*>(data), 0, 0, false});
+    iovecs.push_back(iovec{data, size});
+  }
+
+  using namespace std::placeholders;
+  IO::Callback const on_complete =
+      std::bind(&RecorderStorage::complete, this, _1, _2);
+  if (config_.io != IOMode::SYNC) {
+    io_.reset(UringIO::create(on_complete, iovecs));
+    if (!io_ && config_.io == IOMode::URING) {
+      Error("io_uring not available");
+      std::exit(1);
+    }
+  }
+  if (!io_) {
+    io_.reset(new SyncIO(on_complete));
+  }
+
+  openSegment();
+}
+
+RecorderStorage::~RecorderStorage() {
+  submit();
+  closeSegment();
+  io_->drain();
+  io_.reset();
+  for (auto& buffer : buffers_) {
+    free(buffer.data);
+  }
+}
+
+char const*
+RecorderStorage::ioName() const {
+  return io_->name();
+}
+
+// Set ups already in the current segment are not written again.
+void
+RecorderStorage::writeRecorder(InitRecorder const& init) {
+  auto it = recorders_.find(init.recorder_id);
+  if (it != recorders_.end()) {
+    if (std::memcmp(&it->second, &init, sizeof(init)) == 0) {
+      return;
+    }
+    recorders_.erase(it);
+  }
+  recorders_.insert(std::make_pair(init.recorder_id, init));
+  append(RecordType::RECORDER, init.recorder_id, &init, sizeof(init));
+}
+
+void
+RecorderStorage::writeItem(InitItem const& init) {
+  auto const key = std::make_pair(init.recorder_id, init.key);
+  auto it = items_.find(key);
+  if (it != items_.end()) {
+    if (std::memcmp(&it->second, &init, sizeof(init)) == 0) {
+      return;
+    }
+    items_.erase(it);
+  }
+  items_.insert(std::make_pair(key, init));
+  append(RecordType::ITEM, init.recorder_id, &init, sizeof(init));
+}
+
+void
+RecorderStorage::writeData(int16_t recorder_id,
+                           Item const* items,
+                           size_t num_items) {
+  // Records never span buffers, split batches larger than a buffer.
+  auto const max_items =
+      (config_.buffer_size - sizeof(RecordHeader)) / sizeof(Item);
+  while (num_items > 0) {
+    auto const n = std::min(num_items, max_items);
+    append(RecordType::DATA, recorder_id, items, n * sizeof(Item));
+    items += n;
+    num_items -= n;
+  }
+}
+
+void
+RecorderStorage::writeVarData(int16_t recorder_id,
+                              Item const* slots,
+                              size_t num_slots) {
+  // Split on item boundaries, an item always fits a buffer.
+  auto const max_slots =
+      (config_.buffer_size - sizeof(RecordHeader)) / sizeof(Item);
+  while (num_slots > 0) {
+    size_t n = 0;
+    while (n < num_slots) {
+      auto const* var = reinterpret_cast<VarItem const*>(slots + n);
+      auto const size = varItemSlots(var->type, var->length);
+      if (n + size > max_slots) {
+        break;
+      }
+      n += size;
+    }
+    append(RecordType::VARDATA, recorder_id, slots, n * sizeof(Item));
+    slots += n;
+    num_slots -= n;
+  }
+}
+
+void
+RecorderStorage::writeFrame(FrameHeader const& header,
+                            FrameSection const* sections,
+                            size_t num_sections,
+                            Item const* items,
+                            size_t num_items) {
+  Part const parts[] = {
+    { &header, sizeof(header) },
+    { sections, num_sections * sizeof(FrameSection) },
+    { items, num_items * sizeof(Item) } };
+  auto const size = parts[0].size + parts[1].size + parts[2].size;
+  if (recordSize(size) <= config_.buffer_size) {
+    append(RecordType::FRAME, -1, parts, 3);
+    return;
+  }
+  for (size_t i = 0; i < num_sections; ++i) {
+    if (sections[i].flags & FRAME_SECTION_VAR) {
+      writeVarData(sections[i].recorder_id, items, sections[i].num_items);
+    } else {
+      writeData(sections[i].recorder_id, items, sections[i].num_items);
+    }
+    items += sections[i].num_items;
+  }
+}
+
+void
+RecorderStorage::flush() {
+  submit();
+}
+
+void
+RecorderStorage::sync() {
+  submit();
+  io_->drain();
+}
+
+void
+RecorderStorage::append(RecordType type,
+                        int16_t recorder_id,
+                        void const* payload,
+                        size_t size) {
+  Part const part = { payload, size };
+  append(type, recorder_id, &part, 1);
+}
+
+void
+RecorderStorage::append(RecordType type,
+                        int16_t recorder_id,
+                        Part const* parts,
+                        size_t num_parts) {
+  size_t size = 0;
+  uint32_t checksum = 0;
+  for (size_t i = 0; i < num_parts; ++i) {
+    size += parts[i].size;
+    checksum = crc32c(parts[i].data, parts[i].size, checksum);
+  }
+  auto const total = recordSize(size);
+  if (buffers_[current_].used + total > config_.buffer_size) {
+    submit();
+  }
+  if (segment_full_) {
+    closeSegment();
+    openSegment();
+  }
+  auto& buffer = buffers_[current_];
+  RecordHeader const header = {
+    RECORD_MAGIC,
+    static_cast<uint32_t>(size),
+    checksum,
+    type,
+    recorder_id };
+  auto* dst = buffer.data + buffer.used;
+  std::memcpy(dst, &header, sizeof(header));
+  dst += sizeof(header);
+  for (size_t i = 0; i < num_parts; ++i) {
+    std::memcpy(dst, parts[i].data, parts[i].size);
+    dst += parts[i].size;
+  }
+  std::memset(dst, 0, total - sizeof(header) - size);
+  buffer.used += total;
+}
+
+void
+RecorderStorage::submit() {
+  auto& buffer = buffers_[current_];
+  if (buffer.used == 0) {
+    return;
+  }
+  if (direct_) {
+    // Pad with a PADDING record to a whole number of blocks.
+    auto gap = (DIRECT_BLOCK - buffer.used % DIRECT_BLOCK) % DIRECT_BLOCK;
+    if (gap > 0 && gap < sizeof(RecordHeader)) {
+      gap += DIRECT_BLOCK;
+    }
+    if (gap > 0) {
+      auto const size = gap - sizeof(RecordHeader);
+      auto* dst = buffer.data + buffer.used;
+      std::memset(dst + sizeof(RecordHeader), 0, size);
+      RecordHeader const header = {
+        RECORD_MAGIC,
+        static_cast<uint32_t>(size),
+        crc32c(dst + sizeof(RecordHeader), size),
+        RecordType::PADDING,
+        -1 };
+      std::memcpy(dst, &header, sizeof(header));
+      buffer.used += gap;
+    }
+  }
+
+  buffer.in_flight = true;
+  buffer.submitted = buffer.used;
+  io_->write(fd_, current_, buffer.data, buffer.submitted, segment_offset_);
+  segment_offset_ += buffer.submitted;
+  nextBuffer();
+
+  // Start a new segment with the next record if the next buffer may not
+  // fit in this one.
+  segment_full_ = segment_offset_ +
+      static_cast<int64_t>(config_.buffer_size + DIRECT_BLOCK) >
+      static_cast<int64_t>(config_.segment_size);
+}
+
+void
+RecorderStorage::nextBuffer() {
+  for (;;) {
+    for (size_t i = 1; i <= buffers_.size(); ++i) {
+      auto const index = (current_ + i) % buffers_.size();
+      if (!buffers_[index].in_flight) {
+        current_ = index;
+        buffers_[index].used = 0;
+        return;
+      }
+    }
+    io_->reap(true);
+  }
+}
+
+void
+RecorderStorage::complete(int index, int64_t result) {
+  auto& buffer = buffers_[index];
+  buffer.in_flight = false;
+  if (result < 0) {
+    ++write_errors_;
+    std::fprintf(stderr, "Storage write: %s\n", std::strerror(-result));
+  } else {
+    bytes_written_ += result;
+    if (static_cast<size_t>(result) != buffer.submitted) {
+      ++write_errors_;
+      std::fprintf(stderr, "Storage write: short write %ld of %lu\n",
+                   result, buffer.submitted);
+    }
+  }
+}
+
+void
+RecorderStorage::openSegment() {
+  std::string path;
+  for (;;) {
+    path = config_.directory + "/" + segmentName(sequence_);
+    int const flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC |
+        (direct_ ? O_DIRECT : 0);
+    fd_ = open(path.c_str(), flags, 0644);
+    if (fd_ >= 0) {
+      break;
+    } else if (errno == EEXIST) {
+      ++sequence_;
+    } else if (errno == EINVAL && direct_) {
+      Error("O_DIRECT not supported by file system, disabled");
+      direct_ = false;
+    } else {
+      perror(path.c_str());
+      std::exit(1);
+    }
+  }
+
+  // Held until the close after the final fsync, also with writes still
+  // in flight after the rotation to the next segment.
+  if (flock(fd_, LOCK_EX | LOCK_NB) != 0) {
+    perror("flock");
+  }
+
+  // Preallocate without changing the file size, readers of the live
+  // segment see the written size only.
+  if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, config_.segment_size) != 0 &&
+      errno != EOPNOTSUPP) {
+    perror("fallocate");
+  }
+
+  segment_offset_ = 0;
+  segment_full_ = false;
+  SegmentInfo info;
+  std::memset(&info, 0, sizeof(info));
+  info.version = SEGMENT_VERSION;
+  info.sequence = sequence_++;
+  info.created = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  append(RecordType::SEGMENT, -1, &info, sizeof(info));
+
+  for (auto const& recorder : recorders_) {
+    auto const& init = recorder.second;
+    append(RecordType::RECORDER, init.recorder_id, &init, sizeof(init));
+  }
+  for (auto const& item : items_) {
+    auto const& init = item.second;
+    append(RecordType::ITEM, init.recorder_id, &init, sizeof(init));
+  }
+}
+
+void
+RecorderStorage::closeSegment() {
+  if (fd_ >= 0) {
+    io_->syncClose(fd_);
+    fd_ = -1;
+  }
+}
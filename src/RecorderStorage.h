@@ -0,0 +1,145 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "RecorderFormat.h"
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <utility>
+#include <string>
+#include <vector>
+
+// Writer of recorded segments (see RecorderFormat.h). Records are
+// appended to aligned batch buffers which are written to preallocated
+// segment files with several writes in flight. The default IO is
+// io_uring with registered buffers, with a synchronous pwrite()
+// fallback for kernels without io_uring. Segments are fsync'ed
+// asynchronously when full. A segment is locked (flock) from its
+// creation until it is synced and closed, so that readers such as the
+// compactor can tell that writes may still be in flight. Recorder and
+// item setups are repeated at the start of each segment to make
+// segments self-contained. Not thread safe, the writer is owned by the
+// sink write stage.
+class RecorderStorage {
+ public:
+  RecorderStorage(RecorderStorage const&) = delete;
+  RecorderStorage& operator=(RecorderStorage const&) = delete;
+
+  enum class IOMode { AUTO, URING, SYNC, };
+
+  struct Config {
+    Config();
+    std::string directory;
+    size_t segment_size;  // Preallocated size of each segment file
+    size_t buffer_size;   // Size of each batch buffer
+    int    num_buffers;   // Maximum number of writes in flight
+    bool   direct;        // Use O_DIRECT, writes are padded to blocks
+    IOMode io;
+  };
+
+  // Exits if the storage directory or first segment can not be created.
+  explicit RecorderStorage(Config const& config);
+
+  // Writes remaining data and waits for all writes and fsyncs.
+  ~RecorderStorage();
+
+  void writeRecorder(InitRecorder const& init);
+  void writeItem(InitItem const& init);
+  void writeData(int16_t recorder_id, Item const* items, size_t num_items);
+
+  // Variable length items, the VarItem slots of whole items.
+  void writeVarData(int16_t recorder_id, Item const* slots, size_t num_slots);
+
+  // A frame is written as a single record, so that it is stored whole.
+  // Frames larger than a buffer are split into DATA and VARDATA records.
+  // The header must agree with the sections and items.
+  void writeFrame(FrameHeader const& header,
+                  FrameSection const* sections,
+                  size_t num_sections,
+                  Item const* items,
+                  size_t num_items);
+
+  // Submit the current batch buffer even if not full.
+  void flush();
+
+  // Flush and wait for all writes in flight.
+  void sync();
+
+  // Name of the IO implementation in use, "io_uring" or "sync".
+  char const* ioName() const;
+
+  int64_t bytesWritten() const { return bytes_written_; }
+  int64_t writeErrors() const { return write_errors_; }
+
+  class IO;
+
+ private:
+  struct Buffer {
+    char*  data;
+    size_t used;
+    size_t submitted;
+    bool   in_flight;
+  };
+
+  // Payload in parts, written as one record.
+  struct Part {
+    void const* data;
+    size_t size;
+  };
+
+  void append(RecordType type,
+              int16_t recorder_id,
+              void const* payload,
+              size_t size);
+  void append(RecordType type,
+              int16_t recorder_id,
+              Part const* parts,
+              size_t num_parts);
+  void submit();
+  void nextBuffer();
+  void openSegment();
+  void closeSegment();
+  void complete(int buffer, int64_t result);
+
+  Config const config_;
+  bool direct_;
+  std::unique_ptr<IO> io_;
+  std::vector<Buffer> buffers_;
+  int current_;
+
+  int      fd_;
+  uint32_t sequence_;
+  int64_t  segment_offset_;  // File offset of the current buffer
+  bool     segment_full_;
+
+  int64_t bytes_written_;
+  int64_t write_errors_;
+
+  std::map<int16_t, InitRecorder> recorders_;
+  std::map<std::pair<int16_t, int16_t>, InitItem> items_;
+};
@@ -0,0 +1,228 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#include "RecorderTelemetry.h"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+typedef std::chrono::nanoseconds nsec;
+
+void
+appendf(std::string* out, char const* format, ...) {
+  char buffer[256];
+  va_list args;
+  va_start(args, format);
+  auto const size = std::vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  if (size > 0) {
+    out->append(buffer, std::min<size_t>(size, sizeof(buffer) - 1));
+  }
+}
+
+// JSON string, control characters are replaced.
+void
+appendString(std::string* out, std::string const& value) {
+  out->push_back('"');
+  for (char const c : value) {
+    if (c == '"' || c == '\\') {
+      out->push_back('\\');
+      out->push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      out->push_back('?');
+    } else {
+      out->push_back(c);
+    }
+  }
+  out->push_back('"');
+}
+}  // namespace
+
+RecorderTelemetry::Config::Config()
+    : interval(std::chrono::seconds(10)) {}
+
+RecorderTelemetry::RecorderTelemetry(Config const& config,
+                                     Output const& output)
+    : config_(config)
+    , output_(output)
+    , start_(Clock::now())
+    , next_(start_ + config.interval)
+    , receive_busy_nsec_(0)
+    , shed_items_(0) {
+  reset();
+}
+
+void
+RecorderTelemetry::addRecorder(int16_t recorder_id,
+                               char const* name,
+                               size_t size) {
+  if (recorder_id < 0) {
+    return;
+  }
+  if (static_cast<size_t>(recorder_id) >= recorders_.size()) {
+    recorders_.resize(recorder_id + 1);
+  }
+  recorders_[recorder_id].name.assign(name, strnlen(name, size));
+}
+
+void
+RecorderTelemetry::addBatch(size_t num_items, int64_t sent, int64_t received) {
+  ++batches_;
+  add(&batch_items_, num_items);
+  if (sent > 0) {
+    // Clocks of other hosts may be behind.
+    auto const lag = std::max<int64_t>(0, received - sent);
+    add(&lag_, lag);
+    ++lag_samples_;
+    lag_sum_ += lag;
+    lag_max_ = std::max(lag_max_, lag);
+  }
+}
+
+void
+RecorderTelemetry::addItems(int16_t recorder_id,
+                            size_t num_items,
+                            size_t size) {
+  items_ += num_items;
+  bytes_ += size;
+  if (recorder_id < 0) {
+    return;
+  }
+  if (static_cast<size_t>(recorder_id) >= recorders_.size()) {
+    recorders_.resize(recorder_id + 1);
+  }
+  auto& recorder = recorders_[recorder_id];
+  if (recorder.items == 0 && num_items > 0) {
+    active_.push_back(recorder_id);
+  }
+  recorder.items += num_items;
+  recorder.bytes += size;
+}
+
+void
+RecorderTelemetry::report(Clock::time_point now, Pipeline const& pipeline) {
+  auto const elapsed_nsec =
+      std::chrono::duration_cast<nsec>(now - start_).count();
+  double const seconds = std::max<int64_t>(elapsed_nsec, 1) / 1e9;
+  auto const busy_nsec = pipeline.receive_busy_nsec - receive_busy_nsec_;
+  double const idle =
+      1.0 - std::min(1.0, static_cast<double>(busy_nsec) / elapsed_nsec);
+  double const lag_avg =
+      lag_samples_ > 0 ? static_cast<double>(lag_sum_) / lag_samples_ : 0.0;
+
+  json_.clear();
+  appendf(&json_,
+          "{\"time\": %ld, \"interval\": %.3f, \"batches\": %ld, "
+          "\"items\": %ld, \"items_per_sec\": %.1f, \"bytes_per_sec\": %.1f, "
+          "\"receive_idle\": %.3f, ",
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::system_clock::now().time_since_epoch()).count(),
+          seconds, batches_, items_, items_ / seconds, bytes_ / seconds,
+          idle);
+  appendf(&json_,
+          "\"lag_usec\": {\"samples\": %ld, \"avg\": %.1f, \"p50\": %ld, "
+          "\"p99\": %ld, \"max\": %ld}, \"zmq_backlog_est\": %.1f, ",
+          lag_samples_, lag_avg,
+          std::min(lag_max_, percentile(lag_, lag_samples_, 0.50)),
+          std::min(lag_max_, percentile(lag_, lag_samples_, 0.99)),
+          lag_max_,
+          batches_ / seconds * lag_avg / 1e6);
+  json_ += "\"batch_items_log2\": [";
+  auto const last = std::find_if(batch_items_.rbegin(), batch_items_.rend(),
+                                 [](int64_t n) { return n != 0; });
+  auto const num_buckets = batch_items_.rend() - last;
+  for (auto i = 0; i < num_buckets; ++i) {
+    appendf(&json_, i > 0 ? ", %ld" : "%ld", batch_items_[i]);
+  }
+  json_ += "], \"queues\": {";
+  for (size_t i = 0; i < pipeline.queues.size(); ++i) {
+    json_ += i > 0 ? ", " : "";
+    appendString(&json_, pipeline.queues[i].first);
+    appendf(&json_, ": %lu", pipeline.queues[i].second);
+  }
+  appendf(&json_, "}, \"shed_items\": %ld, \"recorders\": [",
+          pipeline.shed_items - shed_items_);
+  std::sort(active_.begin(), active_.end());
+  for (size_t i = 0; i < active_.size(); ++i) {
+    auto const& recorder = recorders_[active_[i]];
+    appendf(&json_, "%s{\"id\": %d, \"name\": ", i > 0 ? ", " : "",
+            active_[i]);
+    appendString(&json_, recorder.name);
+    appendf(&json_, ", \"items_per_sec\": %.1f, \"bytes_per_sec\": %.1f}",
+            recorder.items / seconds, recorder.bytes / seconds);
+  }
+  json_ += "]}";
+  output_(json_);
+
+  start_ = now;
+  next_ = now + config_.interval;
+  receive_busy_nsec_ = pipeline.receive_busy_nsec;
+  shed_items_ = pipeline.shed_items;
+  reset();
+}
+
+void
+RecorderTelemetry::add(Histogram* histogram, int64_t value) {
+  size_t bucket = 0;
+  while (bucket + 1 < histogram->size() && (1LL << bucket) <= value) {
+    ++bucket;
+  }
+  ++(*histogram)[bucket];
+}
+
+// Upper bound of the bucket holding the percentile.
+int64_t
+RecorderTelemetry::percentile(Histogram const& histogram,
+                              int64_t count,
+                              double fraction) {
+  int64_t const target = fraction * count + 0.5;
+  int64_t sum = 0;
+  for (size_t i = 0; i < histogram.size(); ++i) {
+    sum += histogram[i];
+    if (sum >= target && sum > 0) {
+      return (1LL << i) - 1;
+    }
+  }
+  return 0;
+}
+
+void
+RecorderTelemetry::reset() {
+  for (auto const id : active_) {
+    recorders_[id].items = 0;
+    recorders_[id].bytes = 0;
+  }
+  active_.clear();
+  batches_ = 0;
+  items_ = 0;
+  bytes_ = 0;
+  batch_items_.fill(0);
+  lag_.fill(0);
+  lag_samples_ = 0;
+  lag_sum_ = 0;
+  lag_max_ = 0;
+}
@@ -0,0 +1,117 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Periodic sink telemetry. Accumulates per interval the items and bytes
+// of each recorder, the batch sizes and the transport lag, the time from
+// the send timestamp of a message to its arrival at the sink, and
+// reports each interval as a single line JSON object. The zeromq
+// backlog is not observable, it is estimated from the lag and the
+// message rate (Little's law). Owned by a single thread (the sink fanout
+// stage), not thread safe.
+class RecorderTelemetry {
+ public:
+  RecorderTelemetry(RecorderTelemetry const&) = delete;
+  RecorderTelemetry& operator=(RecorderTelemetry const&) = delete;
+
+  typedef std::chrono::steady_clock Clock;
+
+  // Reports are appended to file and published on a PUB socket bound to
+  // address, either may be empty.
+  struct Config {
+    Config();
+    std::chrono::milliseconds interval;
+    std::string file;
+    std::string address;
+  };
+
+  // Receives each report.
+  typedef std::function<void(std::string const&)> Output;
+
+  // Sink state sampled at each report. The counters are cumulative.
+  struct Pipeline {
+    int64_t receive_busy_nsec;
+    int64_t shed_items;
+    std::vector<std::pair<std::string, size_t> > queues;  // Depth per stage
+  };
+
+  RecorderTelemetry(Config const& config, Output const& output);
+
+  void addRecorder(int16_t recorder_id, char const* name, size_t size);
+
+  // A received message with num_items items, sent at sent and received
+  // at received (microseconds since epoch). Zero sent if unknown.
+  void addBatch(size_t num_items, int64_t sent, int64_t received);
+
+  // Items of a recorder, size is their size on the wire.
+  void addItems(int16_t recorder_id, size_t num_items, size_t size);
+
+  bool due(Clock::time_point now) const { return now >= next_; }
+
+  // Report the interval ending now and start the next.
+  void report(Clock::time_point now, Pipeline const& pipeline);
+
+ private:
+  typedef std::array<int64_t, 32> Histogram;  // Log2 buckets
+
+  struct Recorder {
+    Recorder() : items(0), bytes(0) {}
+    std::string name;
+    int64_t items;
+    int64_t bytes;
+  };
+
+  static void add(Histogram* histogram, int64_t value);
+  static int64_t percentile(Histogram const& histogram,
+                            int64_t count,
+                            double fraction);
+  void reset();
+
+  Config const config_;
+  Output const output_;
+  Clock::time_point start_;
+  Clock::time_point next_;
+  int64_t receive_busy_nsec_;
+  int64_t shed_items_;
+  std::vector<Recorder> recorders_;
+  std::vector<int16_t> active_;  // Recorders with items this interval
+  int64_t batches_;
+  int64_t items_;
+  int64_t bytes_;
+  Histogram batch_items_;
+  Histogram lag_;
+  int64_t lag_samples_;
+  int64_t lag_sum_;
+  int64_t lag_max_;
+  std::string json_;
+};
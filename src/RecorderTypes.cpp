@@ -24,6 +24,7 @@
 
 #include "RecorderTypes.h"
 
+#include <algorithm>
 #include <cstdio>
 #include <sstream>
 #include <string>
@@ -38,6 +39,46 @@ InitItem::InitItem(int16_t item_recorder_id,
   std::strncpy(desc, item_desc.c_str(), sizeof(desc));
 }
 
+ControlCommand::ControlCommand(ControlType command_type,
+                               std::string const& name,
+                               int16_t item_key)
+    : type(command_type)
+    , mode(0)
+    , key(item_key)
+    , period(0)
+    , deadband(0.0) {
+  std::strncpy(recorder_name, name.c_str(), sizeof(recorder_name) - 1);
+  recorder_name[sizeof(recorder_name) - 1] = '\0';
+}
+
+namespace {
+// 64 bit FNV-1a
+uint64_t constexpr FNV_OFFSET = 0xcbf29ce484222325ull;
+uint64_t constexpr FNV_PRIME = 0x100000001b3ull;
+
+uint64_t
+fnv1a(void const* data, size_t size, uint64_t hash) {
+  auto const* bytes = static_cast<unsigned char const*>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+}  // namespace
+
+uint64_t
+schemaHash(int16_t num_items, InitItem const* items, size_t size) {
+  uint64_t hash = fnv1a(&num_items, sizeof(num_items), FNV_OFFSET);
+  for (size_t i = 0; i < size; ++i) {
+    auto const& item = items[i];
+    hash = fnv1a(&item.key, sizeof(item.key), hash);
+    // Including the terminating zero to separate name and description.
+    hash = fnv1a(item.name, strnlen(item.name, sizeof(item.name)) + 1, hash);
+    hash = fnv1a(item.desc, strnlen(item.desc, sizeof(item.desc)) + 1, hash);
+  }
+  return hash != 0 ? hash : 1;
+}
+
 Item::Item()
     : time(-1)
     , key(-1)
@@ -81,8 +122,78 @@ std::string Item::str() const {
         case 3: ss << d[0] << "," << d[1] << "," << d[2]; break;;
       }
     } break;;
+    case ItemType::STRING: {
+      auto const length = std::min<size_t>(this->length, sizeof(data.s));
+      ss.write(this->data.s, strnlen(this->data.s, length));
+    } break;;
     default:
       break;;
   }
   return ss.str();
 }
+
+int32_t
+varItemCount(Item const* slots, size_t num_slots) {
+  int32_t count = 0;
+  size_t i = 0;
+  while (i < num_slots) {
+    auto const* var = reinterpret_cast<VarItem const*>(slots + i);
+    if (var->length < 0 || var->length > RECORDER_MAX_VAR_LENGTH) {
+      return -1;
+    }
+    i += varItemSlots(var->type, var->length);
+    ++count;
+  }
+  return i == num_slots ? count : -1;
+}
+
+Item
+varItemHead(VarItem const* var) {
+  Item item;
+  item.time = var->time;
+  item.key = var->key;
+  item.type = var->type;
+  auto const* elements = reinterpret_cast<char const*>(var + 1);
+  if (var->type == ItemType::STRING) {
+    item.length = std::min<int32_t>(var->length, sizeof(item.data.s));
+    std::memcpy(item.data.s, elements, item.length);
+  } else {
+    item.length = std::min<int32_t>(var->length, 3);
+    std::memcpy(&item.data, elements, item.length * 8);
+  }
+  return item;
+}
+
+std::string
+varItemStr(VarItem const* var) {
+  auto const* elements = reinterpret_cast<char const*>(var + 1);
+  if (var->type == ItemType::STRING) {
+    return std::string(elements, strnlen(elements, var->length));
+  }
+  std::stringstream ss;
+  for (int32_t i = 0; i < var->length; ++i) {
+    if (i > 0) {
+      ss << ",";
+    }
+    switch (var->type) {
+      case ItemType::INT: {
+        int64_t v;
+        std::memcpy(&v, elements + i * 8, sizeof(v));
+        ss << v;
+      } break;;
+      case ItemType::UINT: {
+        uint64_t v;
+        std::memcpy(&v, elements + i * 8, sizeof(v));
+        ss << v;
+      } break;;
+      case ItemType::FLOAT: {
+        double v;
+        std::memcpy(&v, elements + i * 8, sizeof(v));
+        ss << v;
+      } break;;
+      default:
+        break;;
+    }
+  }
+  return ss.str();
+}
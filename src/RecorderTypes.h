@@ -30,33 +30,86 @@
 
 #define PACKED __attribute__((packed))
 
+// Maximum number of elements, or characters, of a variable length item
+// (see VarItem). Longer arrays and strings are truncated.
+#ifndef RECORDER_MAX_VAR_LENGTH
+#define RECORDER_MAX_VAR_LENGTH 256
+#endif
+
 #define CHECK_POW2_SIZE(X)                                              \
   static_assert((((sizeof(X) << 1)-1) & sizeof(X)) == sizeof(X),        \
                 "Size of " #X " shall be power of 2")
 
 // Item being passed around on the ZeroMQ-bus.
+//
+// A recorder announces itself with a single INIT_RECORDER message, the
+// InitRecorder frame followed by a frame with the InitItem array of all
+// its set up items. The schema hash identifies the item set up so that
+// the receiver can skip processing schemas it already knows. INIT_ITEM
+// announces a single item.
+//
+// A DATA message carries items of a recorder, the recorder id, the Item
+// array and optionally the send time (int64_t microseconds since epoch).
+//
+// A FRAME message carries all items recorded by one thread during a
+// frame (see RecorderBase::beginFrame()), the FrameHeader, an array of
+// FrameSection and the Item array of all sections in order. Recorders
+// are always announced before their first frame.
+//
+// A VARDATA message carries variable length items (see VarItem) of a
+// recorder, framed like DATA. In a frame they are kept in sections
+// flagged FRAME_SECTION_VAR.
 // ----------------------------------------------------------------------------
 enum class PayloadType {
-  INIT_RECORDER, INIT_ITEM, DATA, };
+  INIT_RECORDER, INIT_ITEM, DATA, FRAME, VARDATA, CLOCK, };
+
+struct PACKED FrameHeader {
+  int64_t sequence;      // Per producer thread
+  int32_t time;          // Time of all items in the frame
+  int32_t source;        // Producer thread id
+  int32_t num_sections;
+  int32_t num_items;
+  int64_t sent;          // Microseconds since epoch, zero if unknown
+};
 
+enum : int16_t {
+  FRAME_SECTION_VAR = 1<<0,  // Items are VarItem slots
+};
+
+// Consecutive items of a recorder within a frame. The number of items
+// of a FRAME_SECTION_VAR section is the number of Item sized slots.
+struct PACKED FrameSection {
+  int16_t recorder_id;
+  int16_t flags;
+  int32_t num_items;
+};
+
+// The layout of the first 64 bytes is that of the original
+// InitRecorder, the schema hash is appended.
 struct PACKED InitRecorder {
   InitRecorder(int16_t rec_id,
                int16_t num_items,
                int64_t ext_id,
-               std::string name)
+               std::string name,
+               uint64_t hash = 0)
       : external_id(ext_id)
       , recorder_id(rec_id)
-      , recorder_num_items(num_items) {
-    std::strncpy(recorder_name, name.c_str(), sizeof(recorder_name));
+      , recorder_num_items(num_items)
+      , schema_hash(hash) {
+    std::strncpy(recorder_name, name.c_str(), sizeof(recorder_name) - 1);
+    recorder_name[sizeof(recorder_name) - 1] = '\0';
+    std::memset(reserved, 0, sizeof(reserved));
   }
-  int64_t external_id;
-  int16_t recorder_id;
-  int16_t recorder_num_items;
-  char recorder_name[52];
+  int64_t  external_id;
+  int16_t  recorder_id;
+  int16_t  recorder_num_items;
+  char     recorder_name[52];
+  uint64_t schema_hash;  // Zero if unknown
+  char     reserved[56];
 };
 
 enum class ItemType : std::int8_t {
-  NOTSETUP, INIT, INT, UINT, FLOAT, };
+  NOTSETUP, INIT, INT, UINT, FLOAT, STRING, };
 
 struct PACKED InitItem {
   InitItem(int16_t recorder_id,
@@ -87,12 +140,153 @@ struct PACKED Item {
     int64_t  v_i[3];
     uint64_t v_u[3];
     double   v_d[3];
+    char     s[24];
   } data;
 };
 
+// Variable length item, an array of more than three elements or a
+// string. The header is followed by the elements, 8 bytes each as in
+// Item or the characters of a STRING, padded to a whole number of Item
+// sized slots so that variable length items can share Item arrays and
+// buffers.
+struct PACKED VarItem {
+  int32_t  time;
+  int16_t  key;
+  ItemType type;
+  int8_t   reserved;
+  int32_t  length;   // Number of elements, characters for STRING
+  int32_t  changed;  // Elements changed since the previous value
+};
+
 CHECK_POW2_SIZE(InitRecorder);
 CHECK_POW2_SIZE(InitItem);
 CHECK_POW2_SIZE(Item);
+CHECK_POW2_SIZE(FrameHeader);
+CHECK_POW2_SIZE(FrameSection);
+CHECK_POW2_SIZE(VarItem);
+
+// Number of Item slots taken by a variable length item.
+inline size_t
+varItemSlots(ItemType type, int32_t length) {
+  size_t const size = sizeof(VarItem) +
+      static_cast<size_t>(length) * (type == ItemType::STRING ? 1 : 8);
+  return (size + sizeof(Item) - 1) / sizeof(Item);
+}
+
+// Number of variable length items in slots, -1 if the slots do not hold
+// whole items.
+int32_t varItemCount(Item const* slots, size_t num_slots);
+
+// The first elements of a variable length item as an Item, at most
+// three or the first 24 characters, for consumers of fixed size items.
+Item varItemHead(VarItem const* var);
+
+// All elements of a variable length item, comma separated.
+std::string varItemStr(VarItem const* var);
+
+// Hash of a recorder schema, the number of items and the keys, names
+// and descriptions of the items (in the given order). Never zero.
+uint64_t schemaHash(int16_t num_items, InitItem const* items, size_t size);
+
+// Queries served by the sink query (REQ/REP) endpoint. A request is a
+// multipart message with the QueryType in the first frame followed by
+// the arguments:
+//   LOOKUP: array of QueryKey
+//   PREFIX: recorder name prefix, item name prefix
+//   STALE:  int64_t age in milliseconds
+//   CONTROL: ControlCommand, published on the sink control channel
+// The reply is always two frames, an array of CacheEntry and the
+// "recorder/item" names of the entries, '\0' separated and in order.
+// The reply to CONTROL has no entries.
+// ----------------------------------------------------------------------------
+enum class QueryType {
+  LOOKUP, PREFIX, STALE, CONTROL, };
+
+struct PACKED QueryKey {
+  int16_t recorder_id;
+  int16_t key;
+};
+
+struct PACKED CacheEntry {
+  int64_t age;  // Microseconds since last update, -1 if never updated
+  int32_t updates;
+  int16_t recorder_id;
+  int16_t reserved;
+  Item    item;
+};
+
+// Item of the time ordered stream merged by the sink across recorders,
+// published as frames of MergedItem arrays (see RecorderMerge).
+struct PACKED MergedItem {
+  int16_t recorder_id;
+  int16_t reserved0;
+  int32_t reserved1;
+  Item    item;
+};
+
+// Runtime control of recorders, published by the sink (PUB/SUB) as a
+// single frame. Commands apply to all recorders with the given name in
+// every subscribing process, or all recorders if the name is empty.
+//   ENABLE/DISABLE: Key, or the whole recorder if the key is negative.
+//                   The recorder and item states are independent.
+//   POLICY:         Item decimation policy (ItemPolicy mode, period and
+//                   deadband) of key, or all keys if negative.
+//   TRIGGER:        Trigger the flight recorder.
+// ----------------------------------------------------------------------------
+enum class ControlType : std::int8_t {
+  ENABLE, DISABLE, POLICY, TRIGGER, };
+
+struct PACKED ControlCommand {
+  ControlCommand(ControlType command_type,
+                 std::string const& name,
+                 int16_t item_key = -1);
+
+  ControlType type;
+  int8_t  mode;
+  int16_t key;
+  int32_t period;
+  double  deadband;
+  char recorder_name[48];
+};
+
+CHECK_POW2_SIZE(ControlCommand);
+
+// Clock synchronization probe, published by the sink on the control
+// channel, and its echo, sent at once by the control thread of each
+// subscribing process as a CLOCK message: [type][ClockSync][int16_t
+// recorder ids of the process]. t1 is the sink send time of the probe,
+// t2 and t3 the receive and send times of the echo in the process, in
+// microseconds since epoch of the respective clock (see
+// RecorderBase::setClock()). The sink adds the receive time t4.
+// ----------------------------------------------------------------------------
+struct PACKED ClockSync {
+  int32_t sequence;
+  int32_t process;  // Random token of the echoing process
+  int64_t t1;
+  int64_t t2;
+  int64_t t3;
+};
+
+CHECK_POW2_SIZE(ClockSync);
+
+// Transition of a sink rule (see RecorderRules) on a channel, published
+// by the sink as [RuleEvent][rule name]. since is the item time the
+// condition began, value the value (or rate) at the transition.
+// ----------------------------------------------------------------------------
+struct PACKED RuleEvent {
+  int32_t rule;  // Index in the rule set
+  int16_t recorder_id;
+  int16_t key;
+  int8_t  raised;  // 1 raised, 0 cleared
+  int8_t  reserved0;
+  int16_t reserved1;
+  int32_t time;
+  int32_t since;
+  int32_t reserved2;
+  double  value;
+};
+
+CHECK_POW2_SIZE(RuleEvent);
 
 template<typename V, int N>
 void setDataType(Item* item) {
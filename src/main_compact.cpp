@@ -0,0 +1,104 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#include "RecorderCompactor.h"
+
+#include <boost/program_options.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+namespace po = boost::program_options;
+
+// Compacts the recorded segments of a storage directory, see
+// RecorderCompactor.h.
+int
+main(int ac, char** av) {
+  RecorderCompactor::Config config;
+  size_t memory_mib = config.memory >> 20;
+  size_t run_mib = config.run_size >> 20;
+
+  // ----------------------------------------------------------------------
+  po::options_description opts("Options", 80, 75);
+  opts.add_options()
+      ("help,h", "Show help")
+      ("directory,d",
+       po::value<std::string>(&config.directory)
+           ->default_value(config.directory),
+       "Storage directory of the segments to compact")
+      ("threads,j",
+       po::value<int>(&config.num_threads)->default_value(config.num_threads),
+       "Number of compacting threads")
+      ("chunk",
+       po::value<size_t>(&config.chunk_items)
+           ->default_value(config.chunk_items),
+       "Maximum items per chunk")
+      ("memory",
+       po::value<size_t>(&memory_mib)->default_value(memory_mib),
+       "MiB of items buffered per thread")
+      ("run",
+       po::value<size_t>(&run_mib)->default_value(run_mib),
+       "MiB of segments replaced by each compacted segment");
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(ac, av, opts), vm);
+  po::notify(vm);
+
+  if (vm.count("help")) {
+    opts.print(std::cout);
+    std::exit(0);
+  }
+  // ----------------------------------------------------------------------
+
+  config.memory = memory_mib << 20;
+  config.run_size = run_mib << 20;
+  if (config.chunk_items < 1 || config.num_threads < 1) {
+    std::fprintf(stderr, "Chunk size and threads shall be positive\n");
+    std::exit(1);
+  }
+
+  auto const t1 = std::chrono::steady_clock::now();
+  RecorderCompactor compactor(config);
+  bool const ok = compactor.run();
+  auto const t2 = std::chrono::steady_clock::now();
+
+  auto const& stats = compactor.stats();
+  double const seconds =
+      std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() /
+      1e6;
+  printf("Segments: %ld into %ld compacted (%ld incomplete)\n",
+         stats.segments, stats.compacted, stats.truncated);
+  printf("Items:    %ld in %ld chunks\n", stats.items, stats.chunks);
+  printf("Bytes:    %ld -> %ld (%.1f%%)\n",
+         stats.bytes_in, stats.bytes_out,
+         stats.bytes_in > 0 ? 100.0 * stats.bytes_out / stats.bytes_in : 0.0);
+  printf("Time:     %.2f s, %.1f MiB/s, %.0f items/s\n",
+         seconds,
+         seconds > 0 ? stats.bytes_in / seconds / (1 << 20) : 0.0,
+         seconds > 0 ? stats.items / seconds : 0.0);
+  return ok ? 0 : 1;
+}
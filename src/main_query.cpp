@@ -0,0 +1,243 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#include "Recorder.h"
+#include "RecorderTypes.h"
+
+#include "zmqutils.h"
+
+#include <boost/program_options.hpp>
+
+#include <zmq.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace po = boost::program_options;
+
+namespace {
+// Parse "RECORDER[:KEY]" into a control command, the key is -1 for the
+// whole recorder.
+ControlCommand
+parseControl(ControlType type, std::string const& spec) {
+  auto const sep = spec.rfind(':');
+  int16_t key = -1;
+  if (sep != std::string::npos &&
+      std::sscanf(spec.c_str() + sep + 1, "%hd", &key) != 1) {
+    std::fprintf(stderr, "Error: Invalid control '%s'\n", spec.c_str());
+    std::exit(1);
+  }
+  return ControlCommand(type, spec.substr(0, sep), key);
+}
+
+ItemPolicy::Mode
+parseMode(std::string const& mode) {
+  if (mode == "all") {
+    return ItemPolicy::Mode::ALL;
+  } else if (mode == "interval") {
+    return ItemPolicy::Mode::INTERVAL;
+  } else if (mode == "nth") {
+    return ItemPolicy::Mode::NTH;
+  } else if (mode == "minmax") {
+    return ItemPolicy::Mode::MINMAX;
+  }
+  std::fprintf(stderr, "Error: Invalid policy mode '%s'\n", mode.c_str());
+  std::exit(1);
+}
+}  // namespace
+
+// Command line client for the sink last-value cache query endpoint.
+int
+main(int ac, char** av) {
+  std::string addr = "tcp://localhost:5556";
+  std::vector<std::string> lookups;
+  std::string prefix;
+  int64_t stale = -1;
+  std::string enable;
+  std::string disable;
+  std::string policy;
+  std::string policy_mode = "all";
+  int32_t policy_period = 0;
+  double policy_deadband = 0.0;
+  std::string trigger;
+
+  // ----------------------------------------------------------------------
+  po::options_description opts("Options", 80, 75);
+  opts.add_options()
+      ("help,h", "Show help")
+      ("address,a",
+       po::value<std::string>(&addr)->default_value(addr),
+       "Sink query address")
+      ("lookup,l",
+       po::value<std::vector<std::string> >(&lookups),
+       "Point lookup of recorder id and key, RECORDER:KEY. May be given "
+       "multiple times, all lookups are sent in one batch.")
+      ("prefix,p",
+       po::value<std::string>(&prefix),
+       "Prefix lookup, RECORDER_PREFIX/ITEM_PREFIX. Either part may be "
+       "empty, i.e. \"/\" lists all items.")
+      ("stale,s",
+       po::value<int64_t>(&stale),
+       "List items not updated in the last given milliseconds")
+      ("enable",
+       po::value<std::string>(&enable),
+       "Enable RECORDER[:KEY], an empty recorder name is all recorders")
+      ("disable",
+       po::value<std::string>(&disable),
+       "Disable RECORDER[:KEY], an empty recorder name is all recorders")
+      ("policy",
+       po::value<std::string>(&policy),
+       "Set the policy of RECORDER[:KEY], see --mode, --period and "
+       "--deadband")
+      ("mode",
+       po::value<std::string>(&policy_mode)->default_value(policy_mode),
+       "Policy mode: all, interval, nth or minmax")
+      ("period",
+       po::value<int32_t>(&policy_period)->default_value(policy_period),
+       "Policy interval, n or window")
+      ("deadband",
+       po::value<double>(&policy_deadband)->default_value(policy_deadband),
+       "Policy deadband")
+      ("trigger",
+       po::value<std::string>(&trigger),
+       "Trigger the flight recorder of RECORDER");
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(ac, av, opts), vm);
+  po::notify(vm);
+
+  if (vm.count("help")) {
+    opts.print(std::cout);
+    std::exit(0);
+  }
+  // ----------------------------------------------------------------------
+
+  zmq::context_t ctx(1);
+  zmq::socket_t sock(ctx, ZMQ_REQ);
+  int constexpr linger = 0;
+  int constexpr recvtimeout = 2000;
+  sock.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+  sock.setsockopt(ZMQ_RCVTIMEO, &recvtimeout, sizeof(recvtimeout));
+  zmqutils::connect(&sock, addr);
+
+  QueryType type;
+  std::vector<ControlCommand> commands;
+  if (vm.count("enable")) {
+    commands.push_back(parseControl(ControlType::ENABLE, enable));
+  }
+  if (vm.count("disable")) {
+    commands.push_back(parseControl(ControlType::DISABLE, disable));
+  }
+  if (vm.count("policy")) {
+    auto command = parseControl(ControlType::POLICY, policy);
+    command.mode = static_cast<int8_t>(parseMode(policy_mode));
+    command.period = policy_period;
+    command.deadband = policy_deadband;
+    commands.push_back(command);
+  }
+  if (vm.count("trigger")) {
+    commands.push_back(ControlCommand(ControlType::TRIGGER, trigger));
+  }
+
+  if (!commands.empty()) {
+    type = QueryType::CONTROL;
+    for (auto const& command : commands) {
+      zmq::message_t reply;
+      sock.send(&type, sizeof(type), ZMQ_SNDMORE);
+      sock.send(&command, sizeof(command));
+      if (!sock.recv(&reply)) {
+        std::fprintf(stderr, "Error: No reply from %s\n", addr.c_str());
+        std::exit(1);
+      }
+      while (zmqutils::more(&sock)) {
+        sock.recv(&reply);
+      }
+    }
+    sock.close();
+    return 0;
+  } else if (!lookups.empty()) {
+    type = QueryType::LOOKUP;
+    std::vector<QueryKey> keys;
+    for (auto const& lookup : lookups) {
+      QueryKey key;
+      if (std::sscanf(lookup.c_str(), "%hd:%hd",
+                      &key.recorder_id, &key.key) != 2) {
+        std::fprintf(stderr, "Error: Invalid lookup '%s'\n", lookup.c_str());
+        std::exit(1);
+      }
+      keys.push_back(key);
+    }
+    sock.send(&type, sizeof(type), ZMQ_SNDMORE);
+    sock.send(keys.data(), keys.size() * sizeof(QueryKey));
+  } else if (vm.count("prefix")) {
+    type = QueryType::PREFIX;
+    auto const sep = prefix.find('/');
+    auto const rec = prefix.substr(0, sep);
+    auto const item = sep == std::string::npos ? "" : prefix.substr(sep + 1);
+    sock.send(&type, sizeof(type), ZMQ_SNDMORE);
+    sock.send(rec.data(), rec.size(), ZMQ_SNDMORE);
+    sock.send(item.data(), item.size());
+  } else if (stale >= 0) {
+    type = QueryType::STALE;
+    sock.send(&type, sizeof(type), ZMQ_SNDMORE);
+    sock.send(&stale, sizeof(stale));
+  } else {
+    opts.print(std::cout);
+    std::exit(1);
+  }
+
+  zmq::message_t entries;
+  zmq::message_t names;
+  if (!sock.recv(&entries) || !zmqutils::more(&sock) || !sock.recv(&names)) {
+    std::fprintf(stderr, "Error: No reply from %s\n", addr.c_str());
+    std::exit(1);
+  }
+
+  auto const num_entries = entries.size() / sizeof(CacheEntry);
+  auto const* name = static_cast<char const*>(names.data());
+  auto const* names_end = name + names.size();
+  for (size_t i = 0; i < num_entries; ++i) {
+    CacheEntry entry;
+    std::memcpy(&entry, static_cast<char const*>(entries.data()) +
+                i * sizeof(CacheEntry), sizeof(entry));
+    std::string const full_name(name, strnlen(name, names_end - name));
+    name += full_name.size() + 1;
+    printf("%6d-%-3d %-40s @%d age:%.3fs n:%d -- %s\n",
+           entry.recorder_id,
+           entry.item.key,
+           full_name.c_str(),
+           entry.item.time,
+           entry.age < 0 ? -1.0 : entry.age / 1e6,
+           entry.updates,
+           entry.item.str().c_str());
+  }
+
+  sock.close();
+  return 0;
+}
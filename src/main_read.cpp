@@ -0,0 +1,217 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+
+#include "RecorderReader.h"
+
+#include <boost/program_options.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace po = boost::program_options;
+
+namespace {
+std::string
+channelName(RecorderReader const& reader, int16_t recorder_id, int16_t key) {
+  std::string name;
+  auto const recorder = reader.recorders().find(recorder_id);
+  if (recorder != reader.recorders().end()) {
+    auto const& init = recorder->second;
+    name.assign(init.recorder_name,
+                strnlen(init.recorder_name, sizeof(init.recorder_name)));
+  }
+  name += "/";
+  auto const item = reader.items().find(std::make_pair(recorder_id, key));
+  if (item != reader.items().end()) {
+    auto const& init = item->second;
+    name.append(init.name, strnlen(init.name, sizeof(init.name)));
+  }
+  return name;
+}
+
+// Items and time range of each channel of the segment.
+void
+list(RecorderReader const& reader) {
+  auto const& info = reader.info();
+  auto const channels = reader.channels();
+  printf("Segment %u: %lu bytes, %lu recorders, %lu channels%s\n",
+         info.sequence,
+         reader.size(),
+         reader.recorders().size(),
+         channels.size(),
+         reader.compacted() ? " (compacted)" : "");
+  for (auto const& channel : channels) {
+    auto cursor = reader.cursor(channel.first, channel.second);
+    int64_t count = 0;
+    int32_t first = 0;
+    int32_t last = 0;
+    while (auto const* item = cursor.next()) {
+      first = count == 0 ? item->time : std::min(first, item->time);
+      last = count == 0 ? item->time : std::max(last, item->time);
+      ++count;
+    }
+    printf("  %5d-%-3d %-40s %10ld items @%d..%d\n",
+           channel.first,
+           channel.second,
+           channelName(reader, channel.first, channel.second).c_str(),
+           count,
+           first,
+           last);
+  }
+}
+
+void
+dump(RecorderReader::Cursor* cursor) {
+  while (auto const* item = cursor->next()) {
+    printf("@%d %s\n", item->time, item->str().c_str());
+  }
+}
+
+// Bulk read of every channel of the segment.
+void
+bench(RecorderReader const& reader) {
+  size_t constexpr max_items = 4096;
+  std::vector<int32_t> times(max_items);
+  std::vector<double> values(max_items);
+  auto const begin = std::chrono::steady_clock::now();
+  int64_t count = 0;
+  double sum = 0.0;
+  for (auto const& channel : reader.channels()) {
+    auto cursor = reader.cursor(channel.first, channel.second);
+    while (auto const n = cursor.read(times.data(), values.data(),
+                                      max_items)) {
+      count += n;
+      for (size_t i = 0; i < n; ++i) {
+        sum += values[i];
+      }
+    }
+  }
+  auto const seconds = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - begin).count() / 1e6;
+  printf("Segment %u: %ld items in %.3f s, %.0f items/s, %.1f MiB/s "
+         "(sum %g)\n",
+         reader.info().sequence,
+         count,
+         seconds,
+         seconds > 0 ? count / seconds : 0.0,
+         seconds > 0 ? reader.size() / seconds / (1 << 20) : 0.0,
+         sum);
+}
+}  // namespace
+
+// Reads recorded segments, see RecorderReader.h.
+int
+main(int ac, char** av) {
+  std::string directory;
+  std::vector<std::string> paths;
+  int16_t recorder_id = -1;
+  int16_t key = -1;
+  int64_t interval = 100;
+
+  // ----------------------------------------------------------------------
+  po::options_description opts("Options", 80, 75);
+  opts.add_options()
+      ("help,h", "Show help")
+      ("directory,d",
+       po::value<std::string>(&directory),
+       "Storage directory, read all its segments")
+      ("segment,s",
+       po::value<std::vector<std::string> >(&paths)->composing(),
+       "Segment file to read, can be repeated")
+      ("recorder,r",
+       po::value<int16_t>(&recorder_id),
+       "Recorder id of the channel to dump, lists the channels if not given")
+      ("key,k",
+       po::value<int16_t>(&key),
+       "Key of the channel to dump")
+      ("follow,f",
+       "Keep dumping the items appended to the last segment, while the "
+       "sink is writing it")
+      ("interval",
+       po::value<int64_t>(&interval)->default_value(interval),
+       "Milliseconds between reads of the last segment when following")
+      ("bench",
+       "Bulk read all channels and report the read rate");
+
+  po::positional_options_description positional;
+  positional.add("segment", -1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(ac, av)
+                .options(opts).positional(positional).run(), vm);
+  po::notify(vm);
+
+  if (vm.count("help")) {
+    opts.print(std::cout);
+    std::exit(0);
+  }
+  // ----------------------------------------------------------------------
+
+  if (!directory.empty()) {
+    auto const segments = RecorderReader::segments(directory);
+    paths.insert(paths.end(), segments.begin(), segments.end());
+  }
+  if (paths.empty()) {
+    std::fprintf(stderr, "No segments to read\n");
+    std::exit(1);
+  }
+  bool const dump_channel = vm.count("recorder") && vm.count("key");
+  if (vm.count("follow") && !dump_channel) {
+    std::fprintf(stderr, "Following requires a recorder and key\n");
+    std::exit(1);
+  }
+
+  int status = 0;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    std::unique_ptr<RecorderReader> reader(new RecorderReader(paths[i]));
+    if (!reader->valid()) {
+      std::fprintf(stderr, "%s: not a segment\n", paths[i].c_str());
+      status = 1;
+      continue;
+    }
+    if (vm.count("bench")) {
+      bench(*reader);
+    } else if (!dump_channel) {
+      list(*reader);
+    } else {
+      auto cursor = reader->cursor(recorder_id, key);
+      dump(&cursor);
+      bool const last = i + 1 == paths.size();
+      while (last && vm.count("follow")) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+        reader->refresh();
+        dump(&cursor);
+        std::fflush(stdout);
+      }
+    }
+  }
+  return status;
+}
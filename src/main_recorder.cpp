@@ -24,6 +24,7 @@
 
 #include "Recorder.h"
 
+#include "RecorderAffinity.h"
 #include "RecorderSink.h"
 
 #include "zmqutils.h"
@@ -32,114 +33,527 @@
 
 #include <zmq.hpp>
 
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <chrono>
+#include <cmath>
+#include <cstdio>
 #include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <random>
 #include <string>
 #include <thread>
 #include <vector>
 
 namespace po = boost::program_options;
 
+// Load generator. Producer threads, optionally in several processes,
+// record synthetic signals at a target rate into a sink running in this
+// process. The result is reported as JSON.
 namespace {
+typedef std::chrono::steady_clock Clock;
 typedef std::chrono::milliseconds msec;
 typedef std::chrono::microseconds usec;
 typedef std::chrono::nanoseconds  nsec;
+
+// Keys of the generated recorders, only the first --keys are set up.
+enum class Key : int16_t { Count = 256 };
+
+enum class Signal { WALK, STEP, NOISE, };
+
+struct LoadConfig {
+  int         processes;
+  int         threads;
+  int         recorders;
+  int         keys;
+  std::string types;     // Value type per key, cycled
+  double      change;    // Probability that a value changes per round
+  Signal      signal;
+  double      rate;      // Record calls per second and thread
+  double      duration;  // Seconds
+  bool        frames;    // One frame per round
+  int         alarms;    // Leading keys of each recorder with priority
+  std::vector<int> producer_cpus;  // Cycled over the producer threads
+  bool        pinned;    // Producer threads pinned to producer_cpus
+};
+
+// Result of the producers of a process, passed through a pipe from
+// child processes.
+struct ProducerStats {
+  int64_t records;   // Record calls
+  int64_t cpu_nsec;  // Producer thread cpu time
+  double  elapsed;   // Seconds, the slowest thread
+  RecorderBase::SendStats send;
+};
+
+// Sink side accounting, updated by the observer in the fanout stage.
+struct SinkStats {
+  SinkStats() : items(0), lag_sum(0), lag_max(0) { histogram.fill(0); }
+  std::atomic<int64_t> items;
+  int64_t lag_sum;  // Microseconds
+  int64_t lag_max;
+  std::array<int64_t, 40> histogram;  // Log2 microseconds
+
+  void add(int64_t lag) {
+    lag_sum += lag;
+    lag_max = std::max(lag_max, lag);
+    size_t bucket = 0;
+    while ((1LL << bucket) <= lag) {
+      ++bucket;
+    }
+    ++histogram[std::min(bucket, histogram.size() - 1)];
+  }
+};
+
+int64_t
+cpuNsec(clockid_t clock) {
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Item time, microseconds since the start of the run. Wraps after
+// about 35 minutes.
+int32_t
+itemTime(Clock::time_point epoch) {
+  return static_cast<int32_t>(
+      std::chrono::duration_cast<usec>(Clock::now() - epoch).count());
+}
+
+// Synthetic clock skew of the producers of the process, an offset and a
+// drift since begin, applied to the item times and the process clock.
+struct ClockSkew {
+  double offset_usec;
+  double drift_ppm;
+  Clock::time_point begin;
+};
+
+ClockSkew g_skew = { 0.0, 0.0, Clock::time_point() };
+
+int64_t
+skewUsec() {
+  if (g_skew.offset_usec == 0.0 && g_skew.drift_ppm == 0.0) {
+    return 0;
+  }
+  auto const elapsed = std::chrono::duration_cast<usec>(
+      Clock::now() - g_skew.begin).count();
+  return std::llround(g_skew.offset_usec + 1e-6 * g_skew.drift_ppm * elapsed);
 }
 
-enum class FOO { A, B, C, D, E, X, Y, Z, Count };
-enum class BAR { A, B, C, D, E, X, Y, Z, Count };
-enum class FUU { A, B, C, D, E, X, Y, Z, Count };
-enum class BER { A, B, C, D, E, X, Y, Z, Count };
+int64_t
+skewedClock() {
+  return std::chrono::duration_cast<usec>(
+      std::chrono::system_clock::now().time_since_epoch()).count() +
+      skewUsec();
+}
 
-template<typename T>
+// Process p (the producers of the sink process are process 0) is
+// skewed p times, the first producer process as much as the sink
+// process.
 void
-funcSetupRecorder(Recorder<T>* rec, char const* prefix, int const id) {
-  char name[8][12];
-
-  snprintf(name[0], sizeof(name[0]), "%s-chr%02d", prefix, id);
-  snprintf(name[1], sizeof(name[1]), "%s-dbl%02d", prefix, id);
-  snprintf(name[2], sizeof(name[2]), "%s-i32%02d", prefix, id);
-  snprintf(name[3], sizeof(name[3]), "%s-i64%02d", prefix, id);
-  snprintf(name[4], sizeof(name[4]), "%s-uns%02d", prefix, id);
-  snprintf(name[5], sizeof(name[5]), "%s-af3%02d", prefix, id);
-  snprintf(name[6], sizeof(name[6]), "%s-ad3%02d", prefix, id);
-  snprintf(name[7], sizeof(name[7]), "%s-id2%02d", prefix, id);
-
-  // key[enum], name[string], type[enum], description[string], compare[pointer]
-
-  rec->setup(T::A, name[0], "m");
-  rec->setup(T::B, name[1], "s");
-  rec->setup(T::C, name[2], "C");
-  rec->setup(T::D, name[3], "u");
-  rec->setup(T::E, name[4], "g");
-  rec->setup(T::X, name[5], "-");
-  rec->setup(T::Y, name[6], "-");
-  rec->setup(T::Z, name[7], "-");
+setSkew(int process, double offset_usec, double drift_ppm) {
+  auto const factor = std::max(process, 1);
+  g_skew.offset_usec = factor * offset_usec;
+  g_skew.drift_ppm = factor * drift_ppm;
+  g_skew.begin = Clock::now();
+  if (offset_usec != 0.0 || drift_ppm != 0.0) {
+    RecorderBase::setClock(&skewedClock);
+  }
 }
 
-template<typename T>
+class Generator {
+ public:
+  Generator(LoadConfig const& config, uint64_t seed)
+      : config_(config)
+      , rng_(seed)
+      , uniform_(0.0, 1.0)
+      , normal_(0.0, 1.0)
+      , values_(config.recorders * config.keys, 0.0) {}
+
+  // Next value of the signal of key of recorder.
+  double next(int recorder, int key) {
+    auto& value = values_[recorder * config_.keys + key];
+    if (uniform_(rng_) < config_.change) {
+      switch (config_.signal) {
+        case Signal::WALK:
+          value += normal_(rng_);
+          break;
+        case Signal::STEP:
+          value = std::floor(200.0 * uniform_(rng_) - 100.0);
+          break;
+        case Signal::NOISE:
+          value = 10.0 * normal_(rng_);
+          break;
+      }
+    }
+    return value;
+  }
+
+ private:
+  LoadConfig const& config_;
+  std::mt19937_64 rng_;
+  std::uniform_real_distribution<double> uniform_;
+  std::normal_distribution<double> normal_;
+  std::vector<double> values_;
+};
+
 void
-funcRecordRecorder(Recorder<T>* rec, int x) {
-  float  data1[3] = {500.111111111f*x, 600.0f*x, 700.0f*x};
-  double data2[3] = {500.222222222*x, 600.0*x, 700.0*x};
-  rec->record(T::A, *reinterpret_cast<char*>(&x), x);
-  rec->record(T::B, std::log(2+x), x);
-  rec->record(T::C, reinterpret_cast<int32_t>(-1), x);
-  rec->record(T::D, static_cast<int64_t>(-2+x), x);
-  rec->record(T::E, static_cast<uint64_t>(2*(1+x)), x);
-  rec->record(T::X, data1, x);
-  rec->record(T::Y, data2, x);
-  rec->record(T::Z, {10*(1+x), 20*(1+x)}, x);
+record(Recorder<Key>* rec, Key key, char type, double value, int32_t time) {
+  switch (type) {
+    case 'i':
+      rec->record(key, static_cast<int64_t>(std::llround(value)), time);
+      break;
+    case 'u':
+      rec->record(key, static_cast<uint64_t>(std::llround(std::fabs(value))),
+                  time);
+      break;
+    case 'v':
+      rec->record(key, {value, 2.0 * value, 3.0 * value}, time);
+      break;
+    default:
+      rec->record(key, value, time);
+      break;
+  }
 }
 
+void
+producer(LoadConfig const& config,
+         int process,
+         int thread,
+         Clock::time_point epoch,
+         ProducerStats* stats) {
+  if (config.pinned && !config.producer_cpus.empty()) {
+    auto const& cpus = config.producer_cpus;
+    pinThread(cpus[(process * config.threads + thread) % cpus.size()]);
+  }
+  auto const cpu_begin = cpuNsec(CLOCK_THREAD_CPUTIME_ID);
+  Generator generator(config, (static_cast<uint64_t>(process) << 32) + thread);
+
+  std::vector<std::unique_ptr<Recorder<Key> > > recorders;
+  for (int r = 0; r < config.recorders; ++r) {
+    char name[32];
+    snprintf(name, sizeof(name), "LOAD-p%d-t%d-r%d", process, thread, r);
+    recorders.emplace_back(new Recorder<Key>(name, thread * 1000 + r));
+    for (int k = 0; k < config.keys; ++k) {
+      snprintf(name, sizeof(name), "k%03d", k);
+      auto const type = config.types[k % config.types.size()];
+      auto const policy =
+          k < config.alarms ? ItemPolicy().withPriority() : ItemPolicy();
+      recorders.back()->setup(
+          static_cast<Key>(k), name, std::string(1, type), policy);
+    }
+  }
+
+  // Each round records every key of every recorder once.
+  int64_t const per_round = config.recorders * config.keys;
+  auto const round_interval = config.rate > 0.0 ?
+      nsec(static_cast<int64_t>(1e9 * per_round / config.rate)) : nsec(0);
+  auto const begin = Clock::now();
+  auto const end = begin + nsec(static_cast<int64_t>(1e9 * config.duration));
+  auto next = begin;
+  int64_t records = 0;
+  while (Clock::now() < end) {
+    auto const time = itemTime(epoch) + static_cast<int32_t>(skewUsec());
+    if (config.frames) {
+      RecorderBase::beginFrame(time);
+    }
+    for (int r = 0; r < config.recorders; ++r) {
+      for (int k = 0; k < config.keys; ++k) {
+        record(recorders[r].get(),
+               static_cast<Key>(k),
+               config.types[k % config.types.size()],
+               generator.next(r, k),
+               time);
+      }
+    }
+    if (config.frames) {
+      RecorderBase::commitFrame();
+    }
+    records += per_round;
+    if (round_interval.count() > 0) {
+      next += round_interval;
+      std::this_thread::sleep_until(next);
+    }
+  }
+  // Flushes the send buffers.
+  recorders.clear();
 
-void funcProducer(int const id, int const num_rounds) {
-  std::string prefix;
-  char recorder_name[32];
+  stats->records = records;
+  stats->cpu_nsec = cpuNsec(CLOCK_THREAD_CPUTIME_ID) - cpu_begin;
+  stats->elapsed =
+      std::chrono::duration_cast<usec>(Clock::now() - begin).count() / 1e6;
+}
 
-  prefix = "FOO";
-  snprintf(recorder_name, sizeof(recorder_name), "%s%02d", prefix.c_str() , id);
-  Recorder<FOO> recfoo(recorder_name, random() % (1<<16));
-  funcSetupRecorder(&recfoo, prefix.c_str(), id);
+// Runs the producer threads of a process and sums their results.
+ProducerStats
+produce(LoadConfig const& config, int process, Clock::time_point epoch) {
+  std::vector<ProducerStats> stats(config.threads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < config.threads; ++i) {
+    threads.emplace_back(
+        &producer, std::cref(config), process, i, epoch, &stats[i]);
+  }
+  ProducerStats total = ProducerStats();
+  for (int i = 0; i < config.threads; ++i) {
+    threads[i].join();
+    total.records += stats[i].records;
+    total.cpu_nsec += stats[i].cpu_nsec;
+    total.elapsed = std::max(total.elapsed, stats[i].elapsed);
+  }
+  return total;
+}
+
+// Send statistics of the process since begin, they are cumulative over
+// runs and inherited by forked processes.
+RecorderBase::SendStats
+sendStatsSince(RecorderBase::SendStats const& begin) {
+  auto stats = RecorderBase::sendStats();
+  stats.batches -= begin.batches;
+  stats.items -= begin.items;
+  stats.dropped_batches -= begin.dropped_batches;
+  stats.dropped_items -= begin.dropped_items;
+  return stats;
+}
+
+int64_t
+percentile(SinkStats const& sink, double fraction) {
+  int64_t const target = std::ceil(fraction * sink.items.load());
+  int64_t count = 0;
+  for (size_t i = 0; i < sink.histogram.size(); ++i) {
+    count += sink.histogram[i];
+    if (count >= target) {
+      return std::min<int64_t>((1LL << i) - 1, sink.lag_max);
+    }
+  }
+  return sink.lag_max;
+}
 
-  //prefix = "BAR";
-  //snprintf(recorder_name, sizeof(recorder_name), "%s%02d", prefix.c_str() , id);
-  //Recorder<BAR> recbar(recorder_name, random() % (1<<16));
-  //funcSetupRecorder(recbar, prefix.c_str(), id);
+void
+Error(char const* msg) {
+  std::fprintf(stderr, "Error: %s\n", msg);
+  std::exit(1);
+}
 
-  for (int j = 0; j < num_rounds; ++j) {
-    std::this_thread::sleep_for(nsec(1));
-    funcRecordRecorder(&recfoo, j);
+// Cpu list where -1 leaves a stage unpinned, e.g. 0,-1,1-2.
+bool
+parseStageCpus(std::string const& list, std::vector<int>* cpus) {
+  cpus->clear();
+  size_t begin = 0;
+  while (begin <= list.size()) {
+    auto end = list.find(',', begin);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    auto const field = list.substr(begin, end - begin);
+    std::vector<int> range;
+    if (field == "-1") {
+      cpus->push_back(-1);
+    } else if (parseCpuList(field, &range)) {
+      cpus->insert(cpus->end(), range.begin(), range.end());
+    } else {
+      return false;
+    }
+    begin = end + 1;
   }
+  return true;
 }
+}  // namespace
 
 int
 main(int ac, char** av) {
-  int num_rec_rounds  = 2;
-  int num_rec_threads = 2;
+  LoadConfig config;
+  config.processes = 0;
+  config.threads = 2;
+  config.recorders = 2;
+  config.keys = 8;
+  config.types = "iufv";
+  config.change = 1.0;
+  config.rate = 0.0;
+  config.duration = 1.0;
+  config.alarms = 0;
+  config.pinned = false;
+  std::string signal = "walk";
+  std::string transport = "inproc";
+  std::string json = "-";
   int num_ctx_threads = 1;
-  std::string addr = "inproc://recorder";
+  std::string addr;
+  std::string query_addr;
+  std::string control_addr;
+  std::string priority_addr;
+  std::string shm_prefix;
+  std::string merge_addr;
+  RecorderMerge::Config merge_config;
+  std::string storage_dir;
+  std::string storage_io = "auto";
+  RecorderStorage::Config storage_config;
+  double arena_mib = 0.0;
+  std::string shed_policy = "drop";
+  std::vector<std::string> levels;
+  RecorderSink::Shedding shedding;
+  RecorderTelemetry::Config telemetry_config;
+  std::string sink_cpu_list;
+  std::string io_cpu_list;
+  std::string producer_cpu_list;
+  std::vector<int> sink_cpus;
+  std::vector<int> io_cpus;
+  int64_t telemetry_interval = telemetry_config.interval.count();
+  RecorderClock::Config clock_config;
+  int64_t clock_sync = 0;
+  double clock_skew = 0.0;
+  double clock_drift = 0.0;
+  std::string rules_file;
+  RecorderRules::Config rules_config;
 
   // ----------------------------------------------------------------------
   po::options_description opts("Options", 80, 75);
   opts.add_options()
       ("help,h", "Show help")
       ("verbose,v", "Be verbose")
-      ("rounds,r",
-       po::value<int>(&num_rec_rounds)->default_value(num_rec_rounds),
-       "Number of recording rounds")
+      ("processes,p",
+       po::value<int>(&config.processes)->default_value(config.processes),
+       "Number of producer processes. Zero runs the producers in the sink "
+       "process, required for the inproc transport.")
       ("threads,t",
-       po::value<int>(&num_rec_threads)->default_value(num_rec_threads),
-       "Number of recording threads. Producer threads that records 8 "
-       "different values per round.")
+       po::value<int>(&config.threads)->default_value(config.threads),
+       "Number of producer threads per process")
+      ("recorders,r",
+       po::value<int>(&config.recorders)->default_value(config.recorders),
+       "Number of recorders per thread")
+      ("keys,k",
+       po::value<int>(&config.keys)->default_value(config.keys),
+       "Number of keys per recorder, at most 256")
+      ("types",
+       po::value<std::string>(&config.types)->default_value(config.types),
+       "Value type of each key, cycled over the keys: i (int64), u "
+       "(uint64), f (double) or v (double[3])")
+      ("change",
+       po::value<double>(&config.change)->default_value(config.change),
+       "Probability that a value changes between rounds")
+      ("signal",
+       po::value<std::string>(&signal)->default_value(signal),
+       "Signal shape: walk (random walk), step (random levels) or noise")
+      ("rate",
+       po::value<double>(&config.rate)->default_value(config.rate),
+       "Target record calls per second and thread, zero for as fast as "
+       "possible")
+      ("duration,d",
+       po::value<double>(&config.duration)->default_value(config.duration),
+       "Seconds to record")
+      ("frames", "Record each round as a frame, see beginFrame()")
+      ("alarms",
+       po::value<int>(&config.alarms)->default_value(config.alarms),
+       "Number of keys per recorder recorded with high priority, their lag "
+       "is reported separately")
+      ("priority",
+       po::value<std::string>(&priority_addr),
+       "Bind address for the sink priority lane, e.g. tcp://*:5559. High "
+       "priority items are sent on the bulk socket if not given.")
+      ("transport",
+       po::value<std::string>(&transport)->default_value(transport),
+       "Transport to the sink: inproc, ipc or tcp")
+      ("address,a",
+       po::value<std::string>(&addr),
+       "Sink address, overrides the default address of the transport")
       ("context_io",
        po::value<int>(&num_ctx_threads)->default_value(num_ctx_threads),
        "Number of ZMQ context io threads. Defaults to one (1) and should "
        "almost always be that.")
-      ("address,a",
-       po::value<std::string>(&addr)->default_value(addr),
-       "Socket address");
+      ("sink_cpus",
+       po::value<std::string>(&sink_cpu_list),
+       "Cpus of the sink stages receive, decode, fanout, merge and write, "
+       "e.g. 0-4. -1 leaves a stage unpinned, e.g. 0,-1,1.")
+      ("io_cpus",
+       po::value<std::string>(&io_cpu_list),
+       "Cpus of the sink ZMQ context io threads, e.g. 5")
+      ("producer_cpus",
+       po::value<std::string>(&producer_cpu_list),
+       "Cpus cycled over the producer threads of all processes, e.g. 6-11")
+      ("compare_pinning",
+       "Run unpinned and then pinned to the given cpus, and report both")
+      ("json",
+       po::value<std::string>(&json)->default_value(json),
+       "File to write the JSON report to, - for stdout")
+      ("query,q",
+       po::value<std::string>(&query_addr),
+       "Bind address for the sink last-value cache query endpoint, e.g. "
+       "tcp://*:5556. Disabled if not given.")
+      ("control,c",
+       po::value<std::string>(&control_addr),
+       "Bind address for the sink control channel, e.g. tcp://*:5557. "
+       "Control commands are sent through the query endpoint. Disabled if "
+       "not given.")
+      ("shm",
+       po::value<std::string>(&shm_prefix),
+       "Publish the latest values of the recorders to shared memory with "
+       "the segment name prefix, e.g. recorder. Read with recordershm.")
+      ("merge",
+       po::value<std::string>(&merge_addr),
+       "Bind address for the time ordered stream merged across "
+       "recorders, e.g. tcp://*:5558. Disabled if not given.")
+      ("lateness",
+       po::value<int32_t>(&merge_config.lateness)
+           ->default_value(merge_config.lateness),
+       "Lateness window of the merged stream, in the unit of the item time")
+      ("storage",
+       po::value<std::string>(&storage_dir),
+       "Directory to store recorded segments in. Disabled if not given.")
+      ("storage_io",
+       po::value<std::string>(&storage_io)->default_value(storage_io),
+       "Storage IO implementation: auto, uring or sync. Auto uses io_uring "
+       "if the kernel supports it.")
+      ("direct", "Use O_DIRECT for storage")
+      ("arena",
+       po::value<double>(&arena_mib)->default_value(arena_mib),
+       "Sink shedding arena in MiB, the bytes in flight in the sink. Zero "
+       "for no limit.")
+      ("shed",
+       po::value<std::string>(&shed_policy)->default_value(shed_policy),
+       "Shedding policy: drop or decimate")
+      ("level",
+       po::value<std::vector<std::string> >(&levels)->composing(),
+       "Shedding level of recorders, NAME_PREFIX=LEVEL where LEVEL is low, "
+       "normal, high or critical. Recorders are named "
+       "LOAD-p<process>-t<thread>-r<recorder>. Can be repeated.")
+      ("telemetry",
+       po::value<std::string>(&telemetry_config.file),
+       "File to append sink telemetry to, one JSON object per line")
+      ("telemetry_address",
+       po::value<std::string>(&telemetry_config.address),
+       "Bind address to publish sink telemetry on, e.g. tcp://*:5560")
+      ("telemetry_interval",
+       po::value<int64_t>(&telemetry_interval)
+           ->default_value(telemetry_interval),
+       "Sink telemetry interval in milliseconds")
+      ("clock_sync",
+       po::value<int64_t>(&clock_sync)->default_value(clock_sync),
+       "Clock synchronization probe interval in milliseconds, the item "
+       "times are corrected for the producer clocks. Requires --control. "
+       "Zero disables.")
+      ("clock_estimate",
+       "Only estimate the producer clocks, do not correct the item times")
+      ("clock_skew",
+       po::value<double>(&clock_skew)->default_value(clock_skew),
+       "Synthetic producer clock offset in microseconds. Producer process "
+       "p is offset p times, the producers of the sink process once.")
+      ("clock_drift",
+       po::value<double>(&clock_drift)->default_value(clock_drift),
+       "Synthetic producer clock drift in ppm, scaled like --clock_skew")
+      ("rules",
+       po::value<std::string>(&rules_file),
+       "File of rules evaluated by the sink, one per line, e.g. "
+       "\"hot: LOAD-p0/k001 > 50 for 200000 hysteresis 5\" or "
+       "\"fast: LOAD-/k002 rate > 10 per 1000\". See RecorderRules.h.")
+      ("rules_address",
+       po::value<std::string>(&rules_config.address),
+       "Bind address to publish rule events on, e.g. tcp://*:5561");
 
   po::variables_map vm;
   po::store(po::parse_command_line(ac, av, opts), vm);
@@ -149,55 +563,382 @@ main(int ac, char** av) {
     opts.print(std::cout);
     std::exit(0);
   }
-  // ----------------------------------------------------------------------
-
-  zmq::context_t ctx(num_ctx_threads);
-
-  RecorderBase::setContext(&ctx);
-  RecorderBase::setAddress(addr);
-
-  printf("PID:       %d\n", getpid());
-  printf("Item size: %lu\n", sizeof(Item));
 
-  RecorderSink backend;
-  backend.start(vm.count("verbose"));
-
-  int const num_recorder_per_thread = 2;
-  int const num_messages_per_recorder = 8;
-
-  // Each item recording generates two messages per round except for the
-  // first, which only creates a single message.
-  auto num_messages = num_rec_threads *
-                      num_recorder_per_thread *
-                      num_messages_per_recorder *
-                      (2 * num_rec_rounds - 1);
-
-  printf("Running %d threads %d rounds\n"
-         "  %d recorders per thread\n"
-         "  %d items per recorder\n"
-         "Total %d (%ldMiB)\n",
-         num_rec_threads,
-         num_rec_rounds,
-         num_recorder_per_thread,
-         num_messages_per_recorder,
-         num_messages,
-         (num_messages * sizeof(Item))/(1024*1024));
-
-  std::vector<std::thread> recorders;
-  for (int i = 0; i < num_rec_threads; ++i) {
-    recorders.emplace_back(std::thread(&funcProducer, i+1, num_rec_rounds));
+  config.frames = vm.count("frames");
+  if (signal == "walk") {
+    config.signal = Signal::WALK;
+  } else if (signal == "step") {
+    config.signal = Signal::STEP;
+  } else if (signal == "noise") {
+    config.signal = Signal::NOISE;
+  } else {
+    Error("Unknown signal shape");
   }
-
-  for (auto& th : recorders) {
-    if (th.joinable())
-      th.join();
+  if (config.keys < 1 || config.keys > static_cast<int>(Key::Count)) {
+    Error("Number of keys out of range");
+  }
+  // Each producer process allocates its recorder ids from its own range,
+  // in-process producers share the sink's range.
+  if (static_cast<int64_t>(std::max(config.processes, 1)) * config.threads *
+      config.recorders >= RecorderSink::MAX_RECORDERS) {
+    Error("Number of recorders out of range");
+  }
+  if (telemetry_interval < 1) {
+    Error("Telemetry interval must be positive");
+  }
+  if (clock_sync < 0) {
+    Error("Clock synchronization interval must not be negative");
   }
+  if (clock_sync > 0 && control_addr.empty()) {
+    Error("Clock synchronization requires --control");
+  }
+  if (!rules_file.empty() &&
+      !RecorderRules::load(rules_file, &rules_config.rules)) {
+    Error("Malformed rules");
+  }
+  if ((!sink_cpu_list.empty() &&
+       !parseStageCpus(sink_cpu_list, &sink_cpus)) ||
+      (!io_cpu_list.empty() && !parseCpuList(io_cpu_list, &io_cpus)) ||
+      (!producer_cpu_list.empty() &&
+       !parseCpuList(producer_cpu_list, &config.producer_cpus))) {
+    Error("Malformed cpu list");
+  }
+  bool const any_cpus =
+      !sink_cpus.empty() || !io_cpus.empty() || !config.producer_cpus.empty();
+  if (vm.count("compare_pinning") && !any_cpus) {
+    Error("Comparing pinning requires cpus");
+  }
+  if (config.types.empty() ||
+      config.types.find_first_not_of("iufv") != std::string::npos) {
+    Error("Unknown value type");
+  }
+  shedding.max_bytes = static_cast<size_t>(arena_mib * (1 << 20));
+  if (shed_policy == "drop") {
+    shedding.policy = RecorderSink::Shedding::Policy::DROP;
+  } else if (shed_policy == "decimate") {
+    shedding.policy = RecorderSink::Shedding::Policy::DECIMATE;
+  } else {
+    Error("Unknown shedding policy");
+  }
+  for (auto const& level : levels) {
+    auto const sep = level.rfind('=');
+    if (sep == std::string::npos) {
+      Error("Shedding level requires NAME_PREFIX=LEVEL");
+    }
+    static char const* const names[] = { "low", "normal", "high", "critical" };
+    auto const* name = std::find(std::begin(names), std::end(names),
+                                 level.substr(sep + 1));
+    if (name == std::end(names)) {
+      Error("Unknown shedding level");
+    }
+    shedding.levels.emplace_back(
+        level.substr(0, sep),
+        static_cast<RecorderSink::Level>(name - std::begin(names)));
+  }
+  if (addr.empty()) {
+    if (transport == "inproc") {
+      addr = "inproc://recorder";
+    } else if (transport == "ipc") {
+      addr = "ipc:///tmp/recorder-" + std::to_string(getpid()) + ".ipc";
+    } else if (transport == "tcp") {
+      addr = "tcp://127.0.0.1:5555";
+    } else {
+      Error("Unknown transport");
+    }
+  }
+  if (config.processes > 0 && addr.compare(0, 9, "inproc://") == 0) {
+    Error("Producer processes require the ipc or tcp transport");
+  }
+  // Producers connect to the bound priority lane address.
+  std::string priority_connect = priority_addr;
+  if (priority_connect.find('*') != std::string::npos) {
+    priority_connect.replace(priority_connect.find('*'), 1, "localhost");
+  }
+  std::string control_connect = control_addr;
+  if (control_connect.find('*') != std::string::npos) {
+    control_connect.replace(control_connect.find('*'), 1, "localhost");
+  }
+  // ----------------------------------------------------------------------
 
-  std::this_thread::sleep_for(msec(1));
+  FILE* out = json == "-" ? stdout : std::fopen(json.c_str(), "w");
+  if (out == nullptr) {
+    Error("Opening JSON report");
+  }
 
-  backend.stop();
+  // A run of the producers and the sink, reported to out.
+  auto const run = [&](bool pinned) {
+    // Producer processes are forked before any zmq context is created.
+    // Each run allocates recorder ids from zero again, the recorders of
+    // the previous run are gone with its sink.
+    config.pinned = pinned;
+    RecorderBase::setRecorderIdBase(0);
+    auto const epoch = Clock::now();
+    auto const process_cpu_begin = cpuNsec(CLOCK_PROCESS_CPUTIME_ID);
+    auto const send_begin = RecorderBase::sendStats();
+    std::vector<pid_t> children;
+    std::vector<int> pipes;
+    for (int i = 0; i < config.processes; ++i) {
+      int fds[2];
+      if (pipe(fds) != 0) {
+        Error("Creating pipe");
+      }
+      pid_t const pid = fork();
+      if (pid < 0) {
+        Error("Forking producer process");
+      } else if (pid == 0) {
+        close(fds[0]);
+        zmq::context_t ctx(num_ctx_threads);
+        RecorderBase::setContext(&ctx);
+        RecorderBase::setAddress(addr);
+        RecorderBase::setPriorityAddress(priority_connect);
+        RecorderBase::setSharedMemory(shm_prefix);
+        RecorderBase::setRecorderIdBase(
+            static_cast<int16_t>(i * config.threads * config.recorders));
+        setSkew(i + 1, clock_skew, clock_drift);
+        // Give the sink time to bind.
+        std::this_thread::sleep_for(msec(200));
+        if (!control_connect.empty()) {
+          RecorderBase::setControlAddress(control_connect);
+        }
+        auto stats = produce(config, i + 1, epoch);
+        stats.send = sendStatsSince(send_begin);
+        RecorderBase::shutDown();
+        auto const written = write(fds[1], &stats, sizeof(stats));
+        std::_Exit(written == sizeof(stats) ? 0 : 1);
+      }
+      close(fds[1]);
+      children.push_back(pid);
+      pipes.push_back(fds[0]);
+    }
+
+    zmq::context_t ctx(num_ctx_threads);
+    if (pinned && !zmqutils::set_io_affinity(&ctx, io_cpus)) {
+      Error("ZMQ io thread affinity not supported");
+    }
+
+    RecorderBase::setContext(&ctx);
+    RecorderBase::setAddress(addr);
+    RecorderBase::setPriorityAddress(priority_connect);
+    RecorderBase::setSharedMemory(shm_prefix);
+
+    fprintf(stderr, "PID:       %d\n", getpid());
+    fprintf(stderr, "Address:   %s\n", addr.c_str());
+
+    SinkStats sink_stats;
+    SinkStats alarm_stats;
+    RecorderSink backend;
+    backend.setObserver(
+        [&sink_stats, &alarm_stats, &config, epoch](
+            int16_t, Item const* items, size_t num_items) {
+          auto const now = itemTime(epoch);
+          int64_t alarms = 0;
+          for (size_t i = 0; i < num_items; ++i) {
+            int64_t const lag = std::max(0, now - items[i].time);
+            sink_stats.add(lag);
+            if (items[i].key < config.alarms) {
+              alarm_stats.add(lag);
+              ++alarms;
+            }
+          }
+          alarm_stats.items.fetch_add(alarms, std::memory_order_relaxed);
+          sink_stats.items.fetch_add(num_items, std::memory_order_relaxed);
+        });
+    backend.setQueryAddress(query_addr);
+    backend.setControlEndpoint(control_addr);
+    backend.setPriorityEndpoint(priority_addr);
+    backend.setShedding(shedding);
+    if (!telemetry_config.file.empty() || !telemetry_config.address.empty()) {
+      telemetry_config.interval = std::chrono::milliseconds(telemetry_interval);
+      backend.setTelemetry(telemetry_config);
+    }
+    if (!storage_dir.empty()) {
+      storage_config.directory = storage_dir;
+      storage_config.direct = vm.count("direct");
+      storage_config.io =
+          storage_io == "uring" ? RecorderStorage::IOMode::URING :
+          storage_io == "sync" ? RecorderStorage::IOMode::SYNC :
+          RecorderStorage::IOMode::AUTO;
+      backend.setStorage(storage_config);
+    }
+    if (!merge_addr.empty()) {
+      backend.setMerge(merge_config, merge_addr);
+    }
+    if (pinned) {
+      backend.setAffinity(sink_cpus);
+    }
+    if (clock_sync > 0) {
+      clock_config.interval = msec(clock_sync);
+      clock_config.correct = !vm.count("clock_estimate");
+      backend.setClockSync(clock_config);
+    }
+    if (!rules_file.empty()) {
+      backend.setRules(rules_config);
+    }
+    backend.start(vm.count("verbose"));
+
+    // Producers in this process, or results from the producer processes.
+    ProducerStats producers = ProducerStats();
+    if (config.processes == 0) {
+      // The producers are in the same process, connect to the bound
+      // address.
+      if (!control_connect.empty()) {
+        RecorderBase::setControlAddress(control_connect);
+      }
+      setSkew(0, clock_skew, clock_drift);
+      producers = produce(config, 0, epoch);
+      producers.send = sendStatsSince(send_begin);
+    }
+    for (size_t i = 0; i < children.size(); ++i) {
+      ProducerStats stats;
+      auto const size = read(pipes[i], &stats, sizeof(stats));
+      close(pipes[i]);
+      int status = 0;
+      waitpid(children[i], &status, 0);
+      if (size != sizeof(stats) || !WIFEXITED(status) ||
+          WEXITSTATUS(status) != 0) {
+        std::fprintf(stderr, "Warning: Producer process %d failed\n",
+                     children[i]);
+        continue;
+      }
+      producers.records += stats.records;
+      producers.cpu_nsec += stats.cpu_nsec;
+      producers.elapsed = std::max(producers.elapsed, stats.elapsed);
+      producers.send.batches += stats.send.batches;
+      producers.send.items += stats.send.items;
+      producers.send.dropped_batches += stats.send.dropped_batches;
+      producers.send.dropped_items += stats.send.dropped_items;
+    }
+
+    // Wait for the sink to drain, lost items are reported.
+    auto const drain_end = Clock::now() + std::chrono::seconds(5);
+    while (sink_stats.items.load() + backend.sheddingStats().items <
+           producers.send.items && Clock::now() < drain_end) {
+      std::this_thread::sleep_for(msec(1));
+    }
+    auto const elapsed =
+        std::chrono::duration_cast<usec>(Clock::now() - epoch).count() / 1e6;
+    auto const shed = backend.sheddingStats();
+
+    backend.stop();
+    auto const clocks = backend.clockEstimates();
+    auto const rules = backend.ruleStats();
+
+    RecorderBase::shutDown();
+
+    // ----------------------------------------------------------------------
+    auto const received = sink_stats.items.load();
+    auto const process_cpu =
+        cpuNsec(CLOCK_PROCESS_CPUTIME_ID) - process_cpu_begin;
+    auto const sink_cpu =
+        config.processes == 0 ? process_cpu - producers.cpu_nsec : process_cpu;
+
+    std::fprintf(
+        out,
+        "{\n"
+        "  \"config\": {\"processes\": %d, \"threads\": %d, "
+        "\"recorders\": %d, \"keys\": %d, \"types\": \"%s\", "
+        "\"change\": %g, \"signal\": \"%s\", \"rate\": %g, "
+        "\"duration\": %g, \"frames\": %s, \"alarms\": %d, "
+        "\"address\": \"%s\"},\n"
+        "  \"pinning\": {\"pinned\": %s, \"sink_cpus\": \"%s\", "
+        "\"io_cpus\": \"%s\", \"producer_cpus\": \"%s\"},\n",
+        config.processes, config.threads, config.recorders, config.keys,
+        config.types.c_str(), config.change, signal.c_str(), config.rate,
+        config.duration, config.frames ? "true" : "false", config.alarms,
+        addr.c_str(),
+        pinned ? "true" : "false",
+        sink_cpu_list.c_str(), io_cpu_list.c_str(),
+        producer_cpu_list.c_str());
+    std::fprintf(
+        out,
+        "  \"records\": %ld,\n"
+        "  \"records_per_sec\": %.1f,\n"
+        "  \"sent_items\": %ld,\n"
+        "  \"sent_batches\": %ld,\n"
+        "  \"dropped_items\": %ld,\n"
+        "  \"dropped_batches\": %ld,\n"
+        "  \"received_items\": %ld,\n"
+        "  \"shed\": {\"items\": %ld, \"batches\": %ld, \"bytes\": %ld, "
+        "\"arena_peak\": %lu, \"arena_max\": %lu},\n"
+        "  \"lost_items\": %ld,\n"
+        "  \"items_per_sec\": %.1f,\n",
+        producers.records,
+        producers.elapsed > 0 ? producers.records / producers.elapsed : 0.0,
+        producers.send.items,
+        producers.send.batches,
+        producers.send.dropped_items,
+        producers.send.dropped_batches,
+        received,
+        shed.items,
+        shed.batches,
+        shed.bytes,
+        shed.arena_peak,
+        shedding.max_bytes,
+        producers.send.items - received - shed.items,
+        elapsed > 0 ? received / elapsed : 0.0);
+    std::fprintf(out, "  \"clock\": [");
+    for (size_t i = 0; i < clocks.size(); ++i) {
+      std::fprintf(
+          out,
+          "%s{\"process\": \"%08x\", \"offset_usec\": %.1f, "
+          "\"drift_ppm\": %.3f, \"delay_usec\": %ld, \"samples\": %ld, "
+          "\"recorders\": %lu}",
+          i > 0 ? ", " : "",
+          static_cast<uint32_t>(clocks[i].process),
+          clocks[i].offset_usec,
+          clocks[i].drift_ppm,
+          clocks[i].delay_usec,
+          clocks[i].samples,
+          clocks[i].recorders);
+    }
+    std::fprintf(out, "],\n");
+    std::fprintf(
+        out,
+        "  \"rules\": {\"rules\": %lu, \"bound\": %lu, \"items\": %ld, "
+        "\"raised\": %ld, \"cleared\": %ld},\n",
+        rules.rules,
+        rules.bound,
+        rules.evaluated,
+        rules.raised,
+        rules.cleared);
+    std::fprintf(
+        out,
+        "  \"lag_usec\": {\"avg\": %.1f, \"p50\": %ld, \"p99\": %ld, "
+        "\"max\": %ld},\n"
+        "  \"alarm_lag_usec\": {\"items\": %ld, \"avg\": %.1f, \"p50\": %ld, "
+        "\"p99\": %ld, \"max\": %ld},\n"
+        "  \"cpu_nsec_per_item\": {\"producer\": %.1f, \"sink\": %.1f}\n"
+        "}\n",
+        received > 0 ? static_cast<double>(sink_stats.lag_sum) / received : 0.0,
+        percentile(sink_stats, 0.50),
+        percentile(sink_stats, 0.99),
+        sink_stats.lag_max,
+        alarm_stats.items.load(),
+        alarm_stats.items.load() > 0 ?
+            static_cast<double>(alarm_stats.lag_sum) / alarm_stats.items : 0.0,
+        percentile(alarm_stats, 0.50),
+        percentile(alarm_stats, 0.99),
+        alarm_stats.lag_max,
+        producers.send.items > 0 ?
+            static_cast<double>(producers.cpu_nsec) / producers.send.items :
+            0.0,
+        received > 0 ? static_cast<double>(sink_cpu) / received : 0.0);
+  };
+
+  // Compared runs are reported as an array, unpinned first.
+  if (vm.count("compare_pinning")) {
+    std::fprintf(out, "[\n");
+    run(false);
+    std::fprintf(out, ",\n");
+    run(true);
+    std::fprintf(out, "]\n");
+  } else {
+    run(any_cpus);
+  }
 
-  RecorderBase::shutDown();
+  if (out != stdout) {
+    std::fclose(out);
+  }
 
   return 0;
 }
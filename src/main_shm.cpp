@@ -0,0 +1,118 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#include "RecorderShm.h"
+
+#include <boost/program_options.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace po = boost::program_options;
+
+namespace {
+void
+dump(std::string const& prefix, pid_t pid) {
+  RecorderShmReader reader(prefix, pid);
+  if (!reader.valid()) {
+    std::fprintf(stderr, "Error: No shared memory for process %d\n", pid);
+    return;
+  }
+  printf("Process %d%s\n", pid, reader.alive() ? "" : " (not running)");
+  for (auto const& recorder : reader.recorders()) {
+    printf("  %4d(%ld) '%s'\n",
+           recorder.recorder_id,
+           recorder.external_id,
+           recorder.name.c_str());
+    for (int16_t key = 0; key < recorder.num_items; ++key) {
+      Item item;
+      InitItem init(0, 0, "", "");
+      auto const status = reader.read(recorder.recorder_id, key,
+                                      &item, &init);
+      if (status == RecorderShmReader::ReadStatus::STALE) {
+        printf("    %-3d (stale)\n", key);
+      } else if (status == RecorderShmReader::ReadStatus::OK) {
+        printf("    %-3d %-32.*s @%d -- %s\n",
+               key,
+               static_cast<int>(sizeof(init.name)),
+               init.name,
+               item.time,
+               item.type == ItemType::INIT ? "-" : item.str().c_str());
+      }
+    }
+  }
+}
+}  // namespace
+
+// Command line reader of the shared memory latest values of recorders
+// on this host, see RecorderBase::setSharedMemory().
+int
+main(int ac, char** av) {
+  std::string prefix = "recorder";
+  std::vector<pid_t> pids;
+  int interval = 0;
+
+  // ----------------------------------------------------------------------
+  po::options_description opts("Options", 80, 75);
+  opts.add_options()
+      ("help,h", "Show help")
+      ("prefix,p",
+       po::value<std::string>(&prefix)->default_value(prefix),
+       "Shared memory segment name prefix")
+      ("pid",
+       po::value<std::vector<pid_t> >(&pids),
+       "Process to read, may be given multiple times. All processes with "
+       "shared memory by default.")
+      ("interval,i",
+       po::value<int>(&interval)->default_value(interval),
+       "Repeat every interval milliseconds, zero reads once");
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(ac, av, opts), vm);
+  po::notify(vm);
+
+  if (vm.count("help")) {
+    opts.print(std::cout);
+    std::exit(0);
+  }
+  // ----------------------------------------------------------------------
+
+  for (;;) {
+    auto const targets =
+        pids.empty() ? RecorderShmReader::processes(prefix) : pids;
+    for (auto const pid : targets) {
+      dump(prefix, pid);
+    }
+    if (interval <= 0) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+  }
+  return 0;
+}
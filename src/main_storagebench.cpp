@@ -0,0 +1,174 @@
+// -*- mode:c++; indent-tabs-mode:nil; -*-
+
+/*
+  Copyright (c) 2014, 2015, Anders Ronnbrant, anders.ronnbrant@gmail.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*/
+
+#include "RecorderStorage.h"
+
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace po = boost::program_options;
+
+namespace {
+typedef std::chrono::steady_clock Clock;
+typedef std::chrono::microseconds usec;
+
+// Write total_mib of DATA records in batches of batch_items and report
+// throughput and the per batch latency seen by the writing thread.
+void
+bench(RecorderStorage::Config const& config,
+      size_t total_mib,
+      size_t batch_items) {
+  std::vector<Item> batch(batch_items);
+  for (size_t i = 0; i < batch.size(); ++i) {
+    batch[i] = Item(i % 64);
+    batch[i].time = i;
+    batch[i].data.i = i * 7;
+  }
+  auto const batch_bytes = batch.size() * sizeof(Item);
+  auto const num_batches = (total_mib << 20) / batch_bytes;
+
+  std::vector<int64_t> latency;
+  latency.reserve(num_batches);
+
+  // The time includes the final fsync when the storage is destroyed.
+  auto const t1 = Clock::now();
+  char const* io_name = "";
+  int64_t bytes = 0;
+  int64_t errors = 0;
+  {
+    RecorderStorage storage(config);
+    io_name = storage.ioName();
+    for (size_t i = 0; i < num_batches; ++i) {
+      auto const begin = Clock::now();
+      storage.writeData(i % 128, batch.data(), batch.size());
+      latency.push_back(
+          std::chrono::duration_cast<usec>(Clock::now() - begin).count());
+    }
+    storage.sync();
+    bytes = storage.bytesWritten();
+    errors = storage.writeErrors();
+  }
+  auto const t2 = Clock::now();
+  auto const bytes_total = static_cast<double>(num_batches * batch_bytes);
+  double const seconds =
+      std::chrono::duration_cast<usec>(t2 - t1).count() / 1e6;
+
+  std::sort(latency.begin(), latency.end());
+  auto const pct = [&latency](double p) {
+    return latency.empty() ? 0 : latency[(latency.size() - 1) * p];
+  };
+  printf("%-8s %-6s %8.1f MiB/s %12.0f items/s "
+         "batch p50:%ldus p99:%ldus max:%ldus (%ld bytes, %ld errors)\n",
+         io_name,
+         config.direct ? "direct" : "cached",
+         bytes_total / (1 << 20) / seconds,
+         bytes_total / sizeof(Item) / seconds,
+         pct(0.5), pct(0.99), pct(1.0),
+         bytes, errors);
+}
+}  // namespace
+
+// Storage writer benchmark, compares the io_uring and the synchronous
+// implementations.
+int
+main(int ac, char** av) {
+  std::string directory = "recorderbench";
+  size_t total_mib = 1024;
+  size_t batch_items = 1024;
+  size_t buffer_kib = 1024;
+  size_t segment_mib = 256;
+  int num_buffers = 8;
+
+  // ----------------------------------------------------------------------
+  po::options_description opts("Options", 80, 75);
+  opts.add_options()
+      ("help,h", "Show help")
+      ("directory,d",
+       po::value<std::string>(&directory)->default_value(directory),
+       "Directory for the segment files, use one on the device to test. "
+       "Segments are removed after each run.")
+      ("size,s",
+       po::value<size_t>(&total_mib)->default_value(total_mib),
+       "MiB to write per run")
+      ("batch",
+       po::value<size_t>(&batch_items)->default_value(batch_items),
+       "Items per DATA batch")
+      ("buffer",
+       po::value<size_t>(&buffer_kib)->default_value(buffer_kib),
+       "Batch buffer size in KiB")
+      ("buffers",
+       po::value<int>(&num_buffers)->default_value(num_buffers),
+       "Number of batch buffers, i.e. maximum writes in flight")
+      ("segment",
+       po::value<size_t>(&segment_mib)->default_value(segment_mib),
+       "Segment size in MiB")
+      ("direct", "Only run with O_DIRECT")
+      ("cached", "Only run without O_DIRECT");
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(ac, av, opts), vm);
+  po::notify(vm);
+
+  if (vm.count("help")) {
+    opts.print(std::cout);
+    std::exit(0);
+  }
+  // ----------------------------------------------------------------------
+
+  RecorderStorage::Config config;
+  config.directory = directory;
+  config.segment_size = segment_mib << 20;
+  config.buffer_size = buffer_kib << 10;
+  config.num_buffers = num_buffers;
+
+  std::vector<bool> direct_modes;
+  if (!vm.count("direct")) {
+    direct_modes.push_back(false);
+  }
+  if (!vm.count("cached")) {
+    direct_modes.push_back(true);
+  }
+
+  for (bool const direct : direct_modes) {
+    for (auto const io : { RecorderStorage::IOMode::SYNC,
+                           RecorderStorage::IOMode::AUTO }) {
+      config.direct = direct;
+      config.io = io;
+      bench(config, total_mib, batch_items);
+      // Clean up for the next run
+      std::string const cmd = "rm -f " + directory + "/segment_*.rec";
+      if (std::system(cmd.c_str()) != 0) {
+        std::fprintf(stderr, "Failed to remove segments\n");
+      }
+    }
+  }
+  return 0;
+}
@@ -40,9 +40,17 @@ pop(zmq::socket_t* socket, zmq::message_t* zmsg) {
 }
 
 inline bool
-poll(zmq_pollitem_t* items) {
+more(zmq::socket_t* socket) {
+  int more = 0;
+  size_t more_size = sizeof(more);
+  socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+  return more != 0;
+}
+
+inline bool
+poll(zmq_pollitem_t* items, int num_items = 1) {
   constexpr static int POLL_INTERVALL = 100;
-  int const rval= zmq_poll(items, 1, POLL_INTERVALL);
+  int const rval= zmq_poll(items, num_items, POLL_INTERVALL);
   switch (rval) {
     case -1:
       perror("zmq_poll");
@@ -95,6 +103,26 @@ to_message(std::string const&) {
   return zmsg;
 }
 
+// Restrict the I/O threads of a context to cpus, before its first
+// socket is created. Returns false if not supported by libzmq (4.3).
+inline bool
+set_io_affinity(zmq::context_t* context, std::vector<int> const& cpus) {
+#ifdef ZMQ_THREAD_AFFINITY_CPU_ADD
+  for (auto const cpu : cpus) {
+    if (zmq_ctx_set(static_cast<void*>(*context),
+                    ZMQ_THREAD_AFFINITY_CPU_ADD, cpu) != 0) {
+      std::fprintf(stderr, "Error:%s: %s\n", __func__,
+                   zmq_strerror(zmq_errno()));
+      return false;
+    }
+  }
+  return true;
+#else
+  (void)context;
+  return cpus.empty();
+#endif
+}
+
 inline std::string
 get_address(zmq::socket_t* zsock) {
   std::vector<char> optbuf(256);